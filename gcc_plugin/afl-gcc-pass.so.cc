@@ -67,6 +67,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 #include <fstream>
 
 #include <gcc-plugin.h>
@@ -77,6 +78,9 @@
 #include <tree-pass.h>
 #include <tree-ssa-alias.h>
 #include <basic-block.h>
+#include <cfghooks.h>
+#include <cfg.h>
+#include <dominance.h>
 #include <gimple-expr.h>
 #include <gimple.h>
 #include <gimple-iterator.h>
@@ -94,6 +98,8 @@
 
 static int                    be_quiet = 0;
 static unsigned int           inst_ratio = 100;
+static unsigned int           map_pow2 = MAP_SIZE_POW2;
+static unsigned int           map_size = MAP_SIZE;
 static bool                   inst_ext = true;
 static std::list<std::string> myWhitelist;
 
@@ -154,7 +160,7 @@ static unsigned int ext_call_instrument(function *fun) {
     if (R(100) >= inst_ratio) continue;
 
     /* Make up cur_loc */
-    unsigned int rand_loc = R(MAP_SIZE);
+    unsigned int rand_loc = R(map_size);
     tree         cur_loc = build_int_cst(uint32_type_node, rand_loc);
 
     /* Update bitmap via external call */
@@ -228,8 +234,40 @@ static unsigned int inline_instrument(function *fun) {
   set_decl_tls_model(prev_loc_g, TLS_MODEL_REAL);          /* TLS attribute */
   rest_of_decl_compilation(prev_loc_g, 1, 0);
 
+  /* The BigMap index table, and the runtime helper that hands out a slot the
+     first time an edge is taken */
+  tree idx_type = build_pointer_type(uint32_type_node);
+  tree idx_ptr_g =
+      build_decl(UNKNOWN_LOCATION, VAR_DECL,
+                 get_identifier_with_length("__afl_idx_ptr", 13), idx_type);
+  TREE_USED(idx_ptr_g) = 1;
+  TREE_STATIC(idx_ptr_g) = 1;                          /* Defined elsewhere */
+  DECL_EXTERNAL(idx_ptr_g) = 1;                         /* External linkage */
+  DECL_PRESERVE_P(idx_ptr_g) = 1;
+  DECL_ARTIFICIAL(idx_ptr_g) = 1;                   /* Injected by compiler */
+  rest_of_decl_compilation(idx_ptr_g, 1, 0);
+
+  tree claim_type = build_function_type_list(uint32_type_node,    /* return */
+                                             uint32_type_node,      /* args */
+                                             NULL_TREE);            /* done */
+  tree claim_decl = build_fn_decl("__afl_claim_idx", claim_type);
+  TREE_STATIC(claim_decl) = 1;                         /* Defined elsewhere */
+  TREE_PUBLIC(claim_decl) = 1;                                    /* Public */
+  DECL_EXTERNAL(claim_decl) = 1;                        /* External linkage */
+  DECL_ARTIFICIAL(claim_decl) = 1;                  /* Injected by compiler */
+
+  /* The slot lookup splits blocks, so collect them before we start */
+  std::vector<basic_block> blocks;
   FOR_EACH_BB_FN(bb, fun) {
 
+    blocks.push_back(bb);
+
+  }
+
+  for (size_t i = 0; i < blocks.size(); ++i) {
+
+    bb = blocks[i];
+
     gimple_seq           seq = NULL;
     gimple_stmt_iterator bentry;
     ++fcnt_blocks;
@@ -268,7 +306,7 @@ static unsigned int inline_instrument(function *fun) {
 
     /* Make up cur_loc */
 
-    unsigned int rand_loc = R(MAP_SIZE);
+    unsigned int rand_loc = R(map_size);
     tree         cur_loc = build_int_cst(uint32_type_node, rand_loc);
 
     /* Load prev_loc, xor with cur_loc */
@@ -279,11 +317,68 @@ static unsigned int inline_instrument(function *fun) {
     update_stmt(g);
 
     // gimple_assign <bit_xor_expr, _2, prev_loc.0_1, 47231, NULL>
-    tree area_off = create_tmp_var_raw(uint32_type_node, "area_off");
+    tree area_off = create_tmp_var(uint32_type_node, "area_off");
     g = gimple_build_assign(area_off, BIT_XOR_EXPR, prev_loc, cur_loc);
     gimple_seq_add_stmt(&seq, g);  // area_off = prev_loc ^ cur_loc
     update_stmt(g);
 
+    /* Look up the compact slot */
+
+    tree idx_ptr = create_tmp_var(idx_type, "idx_ptr");
+    g = gimple_build_assign(idx_ptr, idx_ptr_g);
+    gimple_seq_add_stmt(&seq, g);  // idx_ptr = __afl_idx_ptr
+    update_stmt(g);
+
+    tree idx_off = create_tmp_var(sizetype, "idx_off");
+    g = gimple_build_assign(idx_off, NOP_EXPR, area_off);
+    gimple_seq_add_stmt(&seq, g);  // idx_off = (size_t)area_off
+    update_stmt(g);
+    g = gimple_build_assign(idx_off, MULT_EXPR, idx_off,
+                            build_int_cst(sizetype, sizeof(u32)));
+    gimple_seq_add_stmt(&seq, g);  // idx_off *= sizeof(u32)
+    update_stmt(g);
+
+    tree idx_addr = create_tmp_var(idx_type, "idx_addr");
+    g = gimple_build_assign(idx_addr, POINTER_PLUS_EXPR, idx_ptr, idx_off);
+    gimple_seq_add_stmt(&seq, g);  // idx_addr = idx_ptr + idx_off
+    update_stmt(g);
+
+    tree slot = create_tmp_var(uint32_type_node, "slot");
+    g = gimple_build_assign(slot, build2(MEM_REF, uint32_type_node, idx_addr,
+                                         build_int_cst(idx_type, 0)));
+    gimple_seq_add_stmt(&seq, g);  // slot = *idx_addr
+    update_stmt(g);
+
+    gcond *unassigned = gimple_build_cond(
+        GE_EXPR, slot, build_int_cst(uint32_type_node, IDX_CLAIMING),
+        NULL_TREE, NULL_TREE);
+    gimple_seq_add_stmt(&seq, unassigned);  // if (slot >= IDX_CLAIMING)
+
+    bentry = gsi_after_labels(bb);
+    gsi_insert_seq_before(&bentry, seq, GSI_SAME_STMT);
+    seq = NULL;
+
+    /* Split after the test. The rest of the block carries on in join, the
+       (rare) first visit of the edge claims a slot in cold. */
+
+    edge        e = split_block(bb, unassigned);
+    basic_block join = e->dest;
+    basic_block cold = create_empty_bb(bb);
+
+    e->flags = EDGE_FALSE_VALUE;
+    make_edge(bb, cold, EDGE_TRUE_VALUE);
+    make_edge(cold, join, EDGE_FALLTHRU);
+
+    if (current_loops) add_bb_to_loop(cold, bb->loop_father);
+    if (dom_info_available_p(CDI_DOMINATORS))
+      set_immediate_dominator(CDI_DOMINATORS, cold, bb);
+
+    gcall *claim = gimple_build_call(claim_decl, 1, area_off);
+    gimple_call_set_lhs(claim, slot);  // slot = __afl_claim_idx(area_off)
+    gimple_stmt_iterator cold_gsi = gsi_start_bb(cold);
+    gsi_insert_after(&cold_gsi, claim, GSI_NEW_STMT);
+    update_stmt(claim);
+
     /* Update bitmap */
 
     // gimple_assign <addr_expr, p_6, &map[_2], NULL, NULL>
@@ -301,8 +396,12 @@ static unsigned int inline_instrument(function *fun) {
 		gimple_seq_add_stmt(&seq, g); // map_ptr2 = map_ptr + area_off
 		update_stmt(g);
 #else
-    g = gimple_build_assign(map_ptr2, PLUS_EXPR, map_ptr, area_off);
-    gimple_seq_add_stmt(&seq, g);  // map_ptr2 = map_ptr + area_off
+    tree map_off = create_tmp_var(sizetype, "map_off");
+    g = gimple_build_assign(map_off, NOP_EXPR, slot);
+    gimple_seq_add_stmt(&seq, g);  // map_off = (size_t)slot
+    update_stmt(g);
+    g = gimple_build_assign(map_ptr2, POINTER_PLUS_EXPR, map_ptr, map_off);
+    gimple_seq_add_stmt(&seq, g);  // map_ptr2 = map_ptr + slot
     update_stmt(g);
 #endif
 
@@ -347,9 +446,9 @@ static unsigned int inline_instrument(function *fun) {
     gimple_seq_add_stmt(&seq, g);  // __afl_prev_loc = cur_loc >> 1
     update_stmt(g);
 
-    /* Done - grab the entry to the block and insert sequence */
+    /* Done - grab the entry to the join block and insert sequence */
 
-    bentry = gsi_after_labels(bb);
+    bentry = gsi_after_labels(join);
     gsi_insert_seq_before(&bentry, seq, GSI_NEW_STMT);
 
     ++finst_blocks;
@@ -495,6 +594,24 @@ static struct opt_pass *make_afl_pass(bool ext_call, gcc::context *ctxt) {
 
 }
 
+/* Record the map size this translation unit was built for, in the section
+   the runtime scans before the forkserver handshake. */
+
+static void emit_map_size_rec(void *gcc_data, void *user_data) {
+
+  tree rec = build_decl(UNKNOWN_LOCATION, VAR_DECL,
+                        get_identifier("__afl_map_pow2_rec"), uint32_type_node);
+  TREE_STATIC(rec) = 1;
+  TREE_READONLY(rec) = 1;
+  TREE_USED(rec) = 1;
+  DECL_PRESERVE_P(rec) = 1;                           /* Keep, unreferenced */
+  DECL_ARTIFICIAL(rec) = 1;                         /* Injected by compiler */
+  DECL_INITIAL(rec) = build_int_cst(uint32_type_node, map_pow2);
+  set_decl_section_name(rec, MAP_SIZE_SECTION);
+  varpool_node::finalize_decl(rec);
+
+}
+
 /* -------------------------------------------------------------------------- */
 /* -- Initialization -------------------------------------------------------- */
 
@@ -561,6 +678,20 @@ int plugin_init(struct plugin_name_args *  plugin_info,
 
   }
 
+  /* Decide the first-level map size */
+  char *map_pow2_str = getenv("AFL_MAP_SIZE_POW2");
+
+  if (map_pow2_str) {
+
+    if (sscanf(map_pow2_str, "%u", &map_pow2) != 1 ||
+        map_pow2 < MAP_SIZE_POW2_MIN || map_pow2 > MAP_SIZE_POW2_MAX)
+      FATAL(G_("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)"),
+            MAP_SIZE_POW2_MIN, MAP_SIZE_POW2_MAX);
+
+    map_size = 1U << map_pow2;
+
+  }
+
   char *instWhiteListFilename = getenv("AFL_GCC_WHITELIST");
   if (instWhiteListFilename) {
 
@@ -587,6 +718,8 @@ int plugin_init(struct plugin_name_args *  plugin_info,
                     &afl_plugin_info);
   register_callback(plugin_info->base_name, PLUGIN_PASS_MANAGER_SETUP, NULL,
                     &afl_pass_info);
+  register_callback(plugin_info->base_name, PLUGIN_FINISH_UNIT,
+                    emit_map_size_rec, NULL);
   return 0;
 
 }
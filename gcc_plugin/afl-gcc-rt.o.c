@@ -24,6 +24,7 @@
 #endif
 #include "../config.h"
 #include "../types.h"
+#include "../include/bigmap.h"
 
 #include <stdlib.h>
 #include <signal.h>
@@ -46,20 +47,45 @@
 u8  __afl_area_initial[MAP_SIZE];
 u8 *__afl_area_ptr = __afl_area_initial;
 
+u32  __afl_idx_initial[MAP_SIZE];
+u32 *__afl_idx_ptr = __afl_idx_initial;
+
+/* Map sizes (as powers of two) recorded by afl-gcc-pass in MAP_SIZE_SECTION,
+   one per instrumented translation unit, see afl-llvm-rt.o.c. */
+
+extern u32 __start___afl_map_pow2[] __attribute__((weak));
+extern u32 __stop___afl_map_pow2[] __attribute__((weak));
+
+static u32 __afl_map_pow2, __afl_map_size = MAP_SIZE;
+
 #ifdef __ANDROID__
 u32 __afl_prev_loc;
 #else
 __thread u32 __afl_prev_loc;
 #endif
 
+/* Hand out the compact slot for edge hash h, see bigmap.h. Called by the
+   instrumentation the first time an edge is taken, or while another
+   thread is claiming it, so it does not have to be fast. */
+
+u32 __afl_claim_idx(const u32 h) {
+
+  return bigmap_claim_slot(__afl_idx_ptr, h, __afl_map_size);
+
+}
+
 /* Trace a basic block with some ID */
 void __afl_trace(const u32 x) {
 
+  u32 h = __afl_prev_loc ^ x;
+  u32 idx = __afl_idx_ptr[h];
+
+  if (__builtin_expect(idx >= IDX_CLAIMING, 0)) idx = __afl_claim_idx(h);
+
 #if 1                                      /* enable for neverZero feature. */
-  __afl_area_ptr[__afl_prev_loc ^ x] +=
-      1 + ((u8)(1 + __afl_area_ptr[__afl_prev_loc ^ x]) == 0);
+  __afl_area_ptr[idx] += 1 + ((u8)(1 + __afl_area_ptr[idx]) == 0);
 #else
-  ++__afl_area_ptr[__afl_prev_loc ^ x];
+  ++__afl_area_ptr[idx];
 #endif
 
   __afl_prev_loc = (x >> 1);
@@ -71,11 +97,52 @@ void __afl_trace(const u32 x) {
 
 static u8 is_persistent;
 
+/* Find out how many first-level slots this binary needs. */
+
+static void __afl_get_map_size(void) {
+
+  u32 *rec;
+
+  for (rec = __start___afl_map_pow2; rec < __stop___afl_map_pow2; ++rec)
+    if (*rec > __afl_map_pow2) __afl_map_pow2 = *rec;
+
+  if (__afl_map_pow2) __afl_map_size = 1U << __afl_map_pow2;
+
+}
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
 
   u8 *id_str = getenv(SHM_ENV_VAR);
+  u8 *size_str = getenv(MAP_SIZE_ENV_VAR);
+
+  __afl_get_map_size();
+
+  /* Stay off maps smaller than we were built for, afl-fuzz restarts us with
+     bigger ones after the handshake. */
+
+  if (id_str && (size_str ? (u32)atoi(size_str) : MAP_SIZE) < __afl_map_size)
+    id_str = NULL;
+
+  if (!id_str) {
+
+    /* Not attached: every index entry reads as zero, so all hits land in
+       __afl_area_initial[0]. Only the index table has to cover the whole
+       first-level range. */
+
+    if (__afl_map_size > MAP_SIZE) {
+
+      __afl_idx_ptr =
+          mmap(0, __afl_map_size * sizeof(u32), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (__afl_idx_ptr == MAP_FAILED) exit(1);
+
+    }
+
+    return;
+
+  }
 
   /* If we're running under AFL, attach to the appropriate region, replacing the
      early-stage __afl_area_initial region that is needed to allow some really
@@ -98,7 +165,8 @@ static void __afl_map_shm(void) {
     }
 
     /* map the shared memory segment to the address space of the process */
-    shm_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    shm_base = mmap(0, __afl_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    shm_fd, 0);
     if (shm_base == MAP_FAILED) {
 
       close(shm_fd);
@@ -120,10 +188,15 @@ static void __afl_map_shm(void) {
 
     if (__afl_area_ptr == (void *)-1) exit(1);
 
-    /* Write something into the bitmap so that even with low AFL_INST_RATIO,
-       our parent doesn't give up on us. */
+  }
+
+  /* The index table that maps edge hashes to compact slots. */
+
+  id_str = getenv(SHM_IDX_ENV_VAR);
+  if (id_str) {
 
-    __afl_area_ptr[0] = 1;
+    __afl_idx_ptr = shmat(atoi(id_str), NULL, 0);
+    if (__afl_idx_ptr == (void *)-1) exit(1);
 
   }
 
@@ -133,17 +206,21 @@ static void __afl_map_shm(void) {
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
-  s32       child_pid;
+  u32 hello = 0;
+  s32 child_pid;
 
   u8 child_stopped = 0;
 
   void (*old_sigchld_handler)(int) = signal(SIGCHLD, SIG_DFL);
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+     assume we're not running in forkserver mode and just execute program.
+     The hello message carries the map size we were built for, if known. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (__afl_map_pow2)
+    hello = FS_OPT_ENABLED | FS_OPT_MAPSIZE | FS_OPT_SET_MAPSIZE(__afl_map_pow2);
+
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
   while (1) {
 
@@ -230,8 +307,7 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE);
-      __afl_area_ptr[0] = 1;
+      memset(__afl_area_ptr, 0, __afl_idx_ptr[0]);
       __afl_prev_loc = 0;
 
     }
@@ -248,7 +324,6 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
       raise(SIGSTOP);
 
-      __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
 
       return 1;
@@ -257,9 +332,18 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
       /* When exiting __AFL_LOOP(), make sure that the subsequent code that
          follows the loop is not traced. We do that by pivoting back to the
-         dummy output region. */
+         dummy output region. Compact indices can go up to the map size, so
+         bigger maps need a bigger dummy. */
+
+      if (__afl_map_size > MAP_SIZE) {
+
+        __afl_area_ptr = mmap(0, __afl_map_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (__afl_area_ptr == MAP_FAILED) exit(1);
+
+      } else
 
-      __afl_area_ptr = __afl_area_initial;
+        __afl_area_ptr = __afl_area_initial;
 
     }
 
@@ -21,7 +21,9 @@
    programs. The instrumentation stores XORed pairs of data: identifiers of the
    currently executing branch and the one that executed immediately before.
 
-   TL;DR: the instrumentation does shm_trace_map[cur_loc ^ prev_loc]++
+   TL;DR: the instrumentation does shm_trace_map[idx[cur_loc ^ prev_loc]]++,
+   where idx is BigMap's index table; edges claim a compact map slot in it
+   the first time they are hit.
 
    The code is designed for 32-bit and 64-bit x86 systems. Both modes should
    work everywhere except for Apple systems. Apple does relocations differently
@@ -40,6 +42,8 @@
 #include "config.h"
 #include "types.h"
 
+#include <sys/mman.h>
+
 /*
    ------------------
    Performances notes
@@ -167,15 +171,16 @@ static const u8* main_payload_32 =
   "  lahf\n"
   "  seto %al\n"
   "\n"
-  "  /* Check if SHM region is already mapped. */\n"
+  "  /* Check if SHM regions are already mapped. The index table is mapped\n"
+  "     last, so its pointer stands for both. */\n"
   "\n"
-  "  movl  __afl_area_ptr, %edx\n"
+  "  movl  __afl_idx_ptr, %edx\n"
   "  testl %edx, %edx\n"
   "  je    __afl_setup\n"
   "\n"
   "__afl_store:\n"
   "\n"
-  "  /* Calculate and store hit for the code location specified in ecx. There\n"
+  "  /* Calculate the edge hash for the code location specified in ecx. There\n"
   "     is a double-XOR way of doing this without tainting another register,\n"
   "     and we use it on 64-bit systems; but it's slower for 32-bit ones. */\n"
   "\n"
@@ -188,11 +193,20 @@ static const u8* main_payload_32 =
   "  movl %ecx, %edi\n"
 #endif                                                   /* ^!COVERAGE_ONLY */
   "\n"
+  "  /* Look up the compact map slot of the edge; claim one if it has none. */\n"
+  "\n"
+  "  movl (%edx, %edi, 4), %edx\n"
+  "  cmpl $" STRINGIFY(IDX_CLAIMING) ", %edx\n"
+  "  jae  __afl_claim\n"
+  "\n"
+  "__afl_count:\n"
+  "\n"
+  "  movl __afl_area_ptr, %ecx\n"
 #ifdef SKIP_COUNTS
-  "  orb  $1, (%edx, %edi, 1)\n"
+  "  orb  $1, (%ecx, %edx, 1)\n"
 #else
-  "  incb (%edx, %edi, 1)\n"
-  "  adcb $0, (%edx, %edi, 1)\n" // never zero counter implementation. slightly better path discovery and little performance impact
+  "  addb $1, (%ecx, %edx, 1)\n"
+  "  adcb $0, (%ecx, %edx, 1)\n" // never zero counter implementation. slightly better path discovery and little performance impact
 #endif                                                      /* ^SKIP_COUNTS */
   "\n"
   "__afl_return:\n"
@@ -201,6 +215,67 @@ static const u8* main_payload_32 =
   "  sahf\n"
   "  ret\n"
   "\n"
+  "__afl_claim:\n"
+  "\n"
+  "  /* First hit of this edge, or another thread is claiming it. Same as\n"
+  "     bigmap_claim_slot(): mark the entry as being claimed, and only then\n"
+  "     take the next free slot from the counter in entry 0, clamp it to the\n"
+  "     map and publish it. Losers wait for the slot, and reset the entry if\n"
+  "     its claimer seems to be gone. The edge hash in edi is turned into a\n"
+  "     pointer to its entry. */\n"
+  "\n"
+  "  pushl %eax\n"
+  "  movl  __afl_idx_ptr, %edx\n"
+  "  leal  (%edx, %edi, 4), %edi\n"
+  "\n"
+  "__afl_claim_retry:\n"
+  "\n"
+  "  movl  $-1, %eax\n"
+  "  movl  $" STRINGIFY(IDX_CLAIMING) ", %edx\n"
+  "  lock cmpxchgl %edx, (%edi)\n"
+  "  jne   __afl_claim_wait\n"
+  "  movl  __afl_idx_ptr, %edx\n"
+  "  movl  $1, %eax\n"
+  "  lock xaddl %eax, (%edx)\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  %eax, %edx\n"
+  "  shrl  %cl, %edx\n"
+  "  je    __afl_claim_publish\n"
+  "  movl  $1, %eax\n"
+  "  shll  %cl, %eax\n"
+  "  decl  %eax\n"
+  "\n"
+  "__afl_claim_publish:\n"
+  "\n"
+  "  movl  %eax, (%edi)\n"
+  "  movl  %eax, %edx\n"
+  "  popl  %eax\n"
+  "  jmp   __afl_count\n"
+  "\n"
+  "__afl_claim_wait:\n"
+  "\n"
+  "  movl  $" STRINGIFY(IDX_CLAIM_SPINS) ", %ecx\n"
+  "\n"
+  "__afl_claim_spin:\n"
+  "\n"
+  "  cmpl  $" STRINGIFY(IDX_CLAIMING) ", %eax\n"
+  "  jne   __afl_claimed\n"
+  "  pause\n"
+  "  movl  (%edi), %eax\n"
+  "  decl  %ecx\n"
+  "  jne   __afl_claim_spin\n"
+  "  movl  $-1, %edx\n"
+  "  lock cmpxchgl %edx, (%edi)\n"
+  "  jmp   __afl_claim_retry\n"
+  "\n"
+  "__afl_claimed:\n"
+  "\n"
+  "  cmpl  $-1, %eax\n"
+  "  je    __afl_claim_retry\n"
+  "  movl  %eax, %edx\n"
+  "  popl  %eax\n"
+  "  jmp   __afl_count\n"
+  "\n"
   ".align 8\n"
   "\n"
   "__afl_setup:\n"
@@ -217,6 +292,30 @@ static const u8* main_payload_32 =
   "  pushl %eax\n"
   "  pushl %ecx\n"
   "\n"
+  "  /* Every object leaves the map size its IDs were drawn from in\n"
+  "     " MAP_SIZE_SECTION "; we need the largest of them. */\n"
+  "\n"
+  "  movl  $__start_" MAP_SIZE_SECTION ", %edi\n"
+  "  movl  $" STRINGIFY(MAP_SIZE_POW2_MIN) ", %ecx\n"
+  "\n"
+  "__afl_pow2_loop:\n"
+  "\n"
+  "  cmpl  $__stop_" MAP_SIZE_SECTION ", %edi\n"
+  "  jae   __afl_pow2_done\n"
+  "  movl  (%edi), %edx\n"
+  "  cmpl  %edx, %ecx\n"
+  "  jae   __afl_pow2_next\n"
+  "  movl  %edx, %ecx\n"
+  "\n"
+  "__afl_pow2_next:\n"
+  "\n"
+  "  addl  $4, %edi\n"
+  "  jmp   __afl_pow2_loop\n"
+  "\n"
+  "__afl_pow2_done:\n"
+  "\n"
+  "  movl  %ecx, __afl_map_bits\n"
+  "\n"
   "  pushl $.AFL_SHM_ENV\n"
   "  call  getenv\n"
   "  addl  $4, %esp\n"
@@ -224,30 +323,59 @@ static const u8* main_payload_32 =
   "  testl %eax, %eax\n"
   "  je    __afl_setup_abort\n"
   "\n"
+  "  movl  %eax, %edi   /* callee-saved */\n"
+  "\n"
+  "  /* If the parent set up smaller maps than we need, stay off them and run\n"
+  "     on scratch maps; the map size in our hello gets us restarted. */\n"
+  "\n"
+  "  pushl $.AFL_MAP_SIZE_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  movl  $" STRINGIFY(MAP_SIZE) ", %edx\n"
+  "  testl %eax, %eax\n"
+  "  je    __afl_setup_size\n"
+  "\n"
+  "  pushl %eax\n"
+  "  call  atoi\n"
+  "  addl  $4, %esp\n"
+  "  movl  %eax, %edx\n"
+  "\n"
+  "__afl_setup_size:\n"
+  "\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  shrl  %cl, %edx\n"
+  "  testl %edx, %edx\n"
+  "  je    __afl_setup_scratch\n"
+  "\n"
 #ifdef USEMMAP
   "  pushl $384        /* shm_open mode 0600 */\n"
   "  pushl $2          /* flags O_RDWR   */\n"
-  "  pushl %eax        /* SHM file path  */\n"
+  "  pushl %edi        /* SHM file path  */\n"
   "  call  shm_open\n"
   "  addl  $12, %esp\n"
   "\n"
   "  cmpl $-1, %eax\n"
   "  je   __afl_setup_abort\n"
   "\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  $1, %edx\n"
+  "  shll  %cl, %edx\n"
+  "\n"
   "  pushl $0          /* mmap off       */\n"
   "  pushl %eax        /* shm fd         */\n"
   "  pushl $1          /* mmap flags     */\n"
   "  pushl $3          /* mmap prot      */\n"
-  "  pushl $"STRINGIFY(MAP_SIZE)"          /* mmap len       */\n"
+  "  pushl %edx        /* mmap len       */\n"
   "  pushl $0          /* mmap addr      */\n"
   "  call  mmap\n"
-  "  addl  $12, %esp\n"
+  "  addl  $24, %esp\n"
   "\n"
   "  cmpl $-1, %eax\n"
   "  je   __afl_setup_abort\n"
   "\n"
 #else
-  "  pushl %eax\n"
+  "  pushl %edi\n"
   "  call  atoi\n"
   "  addl  $4, %esp\n"
   "\n"
@@ -264,7 +392,98 @@ static const u8* main_payload_32 =
   "  /* Store the address of the SHM region. */\n"
   "\n"
   "  movl %eax, __afl_area_ptr\n"
-  "  movl %eax, %edx\n"
+  "\n"
+  "  /* Map the index table the same way. */\n"
+  "\n"
+  "  pushl $.AFL_SHM_IDX_ENV\n"
+  "  call  getenv\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  testl %eax, %eax\n"
+  "  je    __afl_setup_identity\n"
+  "\n"
+  "  pushl %eax\n"
+  "  call  atoi\n"
+  "  addl  $4, %esp\n"
+  "\n"
+  "  pushl $0          /* shmat flags    */\n"
+  "  pushl $0          /* requested addr */\n"
+  "  pushl %eax        /* SHM ID         */\n"
+  "  call  shmat\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "  cmpl $-1, %eax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movl %eax, __afl_idx_ptr\n"
+  "  jmp  __afl_setup_done\n"
+  "\n"
+  "__afl_setup_identity:\n"
+  "\n"
+  "  /* No index table from the parent (USEMMAP builds of afl-fuzz do not\n"
+  "     have one): use a private identity table, so that edges index the map\n"
+  "     directly, like in classic AFL. */\n"
+  "\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  $4, %edx\n"
+  "  shll  %cl, %edx\n"
+  "\n"
+  "  pushl $0          /* mmap off       */\n"
+  "  pushl $-1         /* no fd          */\n"
+  "  pushl $" STRINGIFY(MAP_PRIVATE | MAP_ANONYMOUS) "  /* mmap flags */\n"
+  "  pushl $3          /* mmap prot      */\n"
+  "  pushl %edx        /* mmap len       */\n"
+  "  pushl $0          /* mmap addr      */\n"
+  "  call  mmap\n"
+  "  addl  $24, %esp\n"
+  "\n"
+  "  cmpl $-1, %eax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movl  %eax, __afl_idx_ptr\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  $1, %edx\n"
+  "  shll  %cl, %edx\n"
+  "\n"
+  "__afl_identity_loop:\n"
+  "\n"
+  "  decl  %edx\n"
+  "  movl  %edx, (%eax, %edx, 4)\n"
+  "  jnz   __afl_identity_loop\n"
+  "\n"
+  "  jmp   __afl_setup_done\n"
+  "\n"
+  "__afl_setup_scratch:\n"
+  "\n"
+  "  /* One private zero-filled mapping: the index table, followed by the\n"
+  "     compact map. Every entry reads as slot 0, so nothing is claimed. */\n"
+  "\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  $5, %edx\n"
+  "  shll  %cl, %edx\n"
+  "\n"
+  "  pushl $0          /* mmap off       */\n"
+  "  pushl $-1         /* no fd          */\n"
+  "  pushl $" STRINGIFY(MAP_PRIVATE | MAP_ANONYMOUS) "  /* mmap flags */\n"
+  "  pushl $3          /* mmap prot      */\n"
+  "  pushl %edx        /* mmap len       */\n"
+  "  pushl $0          /* mmap addr      */\n"
+  "  call  mmap\n"
+  "  addl  $24, %esp\n"
+  "\n"
+  "  cmpl $-1, %eax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movl  __afl_map_bits, %ecx\n"
+  "  movl  $4, %edx\n"
+  "  shll  %cl, %edx\n"
+  "  addl  %eax, %edx\n"
+  "  movl  %edx, __afl_area_ptr\n"
+  "  movl  %eax, __afl_idx_ptr\n"
+  "\n"
+  "__afl_setup_done:\n"
+  "\n"
+  "  movl __afl_idx_ptr, %edx\n"
   "\n"
   "  popl %ecx\n"
   "  popl %eax\n"
@@ -277,10 +496,16 @@ static const u8* main_payload_32 =
   "  pushl %ecx\n"
   "  pushl %edx\n"
   "\n"
-  "  /* Phone home and tell the parent that we're OK. (Note that signals with\n"
-  "     no SA_RESTART will mess it up). If this fails, assume that the fd is\n"
-  "     closed because we were execve()d from an instrumented binary, or because\n" 
-  "     the parent doesn't want to use the fork server. */\n"
+  "  /* Phone home and tell the parent that we're OK, and how big our maps\n"
+  "     need to be. (Note that signals with no SA_RESTART will mess it up).\n"
+  "     If this fails, assume that the fd is closed because we were execve()d\n"
+  "     from an instrumented binary, or because the parent doesn't want to use\n"
+  "     the fork server. */\n"
+  "\n"
+  "  movl  __afl_map_bits, %eax\n"
+  "  shll  $1, %eax\n"
+  "  orl   $" STRINGIFY(FS_OPT_ENABLED | FS_OPT_MAPSIZE) ", %eax\n"
+  "  movl  %eax, __afl_temp\n"
   "\n"
   "  pushl $4          /* length    */\n"
   "  pushl $__afl_temp /* data      */\n"
@@ -379,6 +604,8 @@ static const u8* main_payload_32 =
   ".AFL_VARS:\n"
   "\n"
   "  .comm   __afl_area_ptr, 4, 32\n"
+  "  .comm   __afl_idx_ptr, 4, 32\n"
+  "  .comm   __afl_map_bits, 4, 32\n"
   "  .comm   __afl_setup_failure, 1, 32\n"
 #ifndef COVERAGE_ONLY
   "  .comm   __afl_prev_loc, 4, 32\n"
@@ -389,6 +616,12 @@ static const u8* main_payload_32 =
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+  ".AFL_SHM_IDX_ENV:\n"
+  "  .asciz \"" SHM_IDX_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_MAP_SIZE_ENV:\n"
+  "  .asciz \"" MAP_SIZE_ENV_VAR "\"\n"
+  "\n"
   "/* --- END --- */\n"
   "\n";
 
@@ -425,15 +658,17 @@ static const u8* main_payload_64 =
 #endif                                                 /* ^__OpenBSD__, etc */
   "  seto  %al\n"
   "\n"
-  "  /* Check if SHM region is already mapped. */\n"
+  "  /* Check if SHM regions are already mapped. The index table is mapped\n"
+  "     last, so its pointer stands for both. */\n"
   "\n"
-  "  movq  __afl_area_ptr(%rip), %rdx\n"
+  "  movq  __afl_idx_ptr(%rip), %rdx\n"
   "  testq %rdx, %rdx\n"
   "  je    __afl_setup\n"
   "\n"
   "__afl_store:\n"
   "\n"
-  "  /* Calculate and store hit for the code location specified in rcx. */\n"
+  "  /* Calculate the edge hash for the code location specified in rcx, then\n"
+  "     look up its compact map slot; claim one if it has none. */\n"
   "\n"
 #ifndef COVERAGE_ONLY
   "  xorq __afl_prev_loc(%rip), %rcx\n"
@@ -441,11 +676,18 @@ static const u8* main_payload_64 =
   "  shrq $1, __afl_prev_loc(%rip)\n"
 #endif                                                   /* ^!COVERAGE_ONLY */
   "\n"
+  "  movl (%rdx, %rcx, 4), %edx\n"
+  "  cmpl $" STRINGIFY(IDX_CLAIMING) ", %edx\n"
+  "  jae  __afl_claim\n"
+  "\n"
+  "__afl_count:\n"
+  "\n"
+  "  movq __afl_area_ptr(%rip), %rcx\n"
 #ifdef SKIP_COUNTS
-  "  orb  $1, (%rdx, %rcx, 1)\n"
+  "  orb  $1, (%rcx, %rdx, 1)\n"
 #else
-  "  incb (%rdx, %rcx, 1)\n"
-  "  adcb $0, (%rdx, %rcx, 1)\n" // never zero counter implementation. slightly better path discovery and little performance impact
+  "  addb $1, (%rcx, %rdx, 1)\n"
+  "  adcb $0, (%rcx, %rdx, 1)\n" // never zero counter implementation. slightly better path discovery and little performance impact
 #endif                                                      /* ^SKIP_COUNTS */
   "\n"
   "__afl_return:\n"
@@ -458,6 +700,69 @@ static const u8* main_payload_64 =
 #endif                                                 /* ^__OpenBSD__, etc */
   "  ret\n"
   "\n"
+  "__afl_claim:\n"
+  "\n"
+  "  /* First hit of this edge, or another thread is claiming it. Same as\n"
+  "     bigmap_claim_slot(): mark the entry as being claimed, and only then\n"
+  "     take the next free slot from the counter in entry 0, clamp it to the\n"
+  "     map and publish it. Losers wait for the slot, and reset the entry if\n"
+  "     its claimer seems to be gone. The edge hash in rcx is turned into a\n"
+  "     pointer to its entry. */\n"
+  "\n"
+  "  pushq %rax\n"
+  "  movq  __afl_idx_ptr(%rip), %rdx\n"
+  "  leaq  (%rdx, %rcx, 4), %rcx\n"
+  "\n"
+  "__afl_claim_retry:\n"
+  "\n"
+  "  movl  $-1, %eax\n"
+  "  movl  $" STRINGIFY(IDX_CLAIMING) ", %edx\n"
+  "  lock cmpxchgl %edx, (%rcx)\n"
+  "  jne   __afl_claim_wait\n"
+  "  movq  __afl_idx_ptr(%rip), %rdx\n"
+  "  movl  $1, %eax\n"
+  "  lock xaddl %eax, (%rdx)\n"
+  "  pushq %rcx\n"
+  "  movl  __afl_map_bits(%rip), %ecx\n"
+  "  movl  %eax, %edx\n"
+  "  shrl  %cl, %edx\n"
+  "  je    __afl_claim_publish\n"
+  "  movl  $1, %eax\n"
+  "  shll  %cl, %eax\n"
+  "  decl  %eax\n"
+  "\n"
+  "__afl_claim_publish:\n"
+  "\n"
+  "  popq  %rcx\n"
+  "  movl  %eax, (%rcx)\n"
+  "  movl  %eax, %edx\n"
+  "  popq  %rax\n"
+  "  jmp   __afl_count\n"
+  "\n"
+  "__afl_claim_wait:\n"
+  "\n"
+  "  movl  $" STRINGIFY(IDX_CLAIM_SPINS) ", %edx\n"
+  "\n"
+  "__afl_claim_spin:\n"
+  "\n"
+  "  cmpl  $" STRINGIFY(IDX_CLAIMING) ", %eax\n"
+  "  jne   __afl_claimed\n"
+  "  pause\n"
+  "  movl  (%rcx), %eax\n"
+  "  decl  %edx\n"
+  "  jne   __afl_claim_spin\n"
+  "  movl  $-1, %edx\n"
+  "  lock cmpxchgl %edx, (%rcx)\n"
+  "  jmp   __afl_claim_retry\n"
+  "\n"
+  "__afl_claimed:\n"
+  "\n"
+  "  cmpl  $-1, %eax\n"
+  "  je    __afl_claim_retry\n"
+  "  movl  %eax, %edx\n"
+  "  popq  %rax\n"
+  "  jmp   __afl_count\n"
+  "\n"
   ".align 8\n"
   "\n"
   "__afl_setup:\n"
@@ -467,18 +772,29 @@ static const u8* main_payload_64 =
   "  cmpb $0, __afl_setup_failure(%rip)\n"
   "  jne __afl_return\n"
   "\n"
-  "  /* Check out if we have a global pointer on file. */\n"
+  "  /* Check out if we have global pointers on file. As above, the index\n"
+  "     table is published last. */\n"
   "\n"
 #ifndef __APPLE__
-  "  movq  __afl_global_area_ptr@GOTPCREL(%rip), %rdx\n"
+  "  movq  __afl_global_idx_ptr@GOTPCREL(%rip), %rdx\n"
   "  movq  (%rdx), %rdx\n"
 #else
-  "  movq  __afl_global_area_ptr(%rip), %rdx\n"
+  "  movq  __afl_global_idx_ptr(%rip), %rdx\n"
 #endif                                                       /* !^__APPLE__ */
   "  testq %rdx, %rdx\n"
   "  je    __afl_setup_first\n"
   "\n"
+  "  movq %rdx, __afl_idx_ptr(%rip)\n"
+  "\n"
+#ifndef __APPLE__
+  "  movq  __afl_global_area_ptr@GOTPCREL(%rip), %rdx\n"
+  "  movq  (%rdx), %rdx\n"
+#else
+  "  movq  __afl_global_area_ptr(%rip), %rdx\n"
+#endif                                                       /* !^__APPLE__ */
   "  movq %rdx, __afl_area_ptr(%rip)\n"
+  "\n"
+  "  movq __afl_idx_ptr(%rip), %rdx\n"
   "  jmp  __afl_store\n" 
   "\n"
   "__afl_setup_first:\n"
@@ -523,6 +839,31 @@ static const u8* main_payload_64 =
   "  movq  %rsp, %r12\n"
   "  subq  $16, %rsp\n"
   "  andq  $0xfffffffffffffff0, %rsp\n"
+  "\n"
+  "  /* Every object leaves the map size its IDs were drawn from in\n"
+  "     " MAP_SIZE_SECTION "; we need the largest of them. Apple has no\n"
+  "     section bounds, so it only gets the default. */\n"
+  "\n"
+#ifndef __APPLE__
+  "  movq  __start_" MAP_SIZE_SECTION "@GOTPCREL(%rip), %rsi\n"
+  "  movq  __stop_" MAP_SIZE_SECTION "@GOTPCREL(%rip), %rdi\n"
+  "  movl  $" STRINGIFY(MAP_SIZE_POW2_MIN) ", %edx\n"
+  "\n"
+  "__afl_pow2_loop:\n"
+  "\n"
+  "  cmpq  %rdi, %rsi\n"
+  "  jae   __afl_pow2_done\n"
+  "  cmpl  (%rsi), %edx\n"
+  "  cmovbl (%rsi), %edx\n"
+  "  addq  $4, %rsi\n"
+  "  jmp   __afl_pow2_loop\n"
+  "\n"
+  "__afl_pow2_done:\n"
+  "\n"
+  "  movl  %edx, __afl_map_bits(%rip)\n"
+#else
+  "  movl  $" STRINGIFY(MAP_SIZE_POW2) ", __afl_map_bits(%rip)\n"
+#endif                                                       /* !^__APPLE__ */
   "\n"
   "  leaq .AFL_SHM_ENV(%rip), %rdi\n"
   CALL_L64("getenv")
@@ -530,20 +871,45 @@ static const u8* main_payload_64 =
   "  testq %rax, %rax\n"
   "  je    __afl_setup_abort\n"
   "\n"
+  "  movq  %rax, 0(%rsp)\n"
+  "\n"
+  "  /* If the parent set up smaller maps than we need, stay off them and run\n"
+  "     on scratch maps; the map size in our hello gets us restarted. */\n"
+  "\n"
+  "  leaq .AFL_MAP_SIZE_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  movl  $" STRINGIFY(MAP_SIZE) ", %edx\n"
+  "  testq %rax, %rax\n"
+  "  je    __afl_setup_size\n"
+  "\n"
+  "  movq  %rax, %rdi\n"
+  CALL_L64("atoi")
+  "  movl  %eax, %edx\n"
+  "\n"
+  "__afl_setup_size:\n"
+  "\n"
+  "  movl  __afl_map_bits(%rip), %ecx\n"
+  "  shrl  %cl, %edx\n"
+  "  testl %edx, %edx\n"
+  "  je    __afl_setup_scratch\n"
+  "\n"
 #ifdef USEMMAP
   "  movl $384, %edx   /* shm_open mode 0600 */\n"
   "  movl $2,   %esi   /* flags O_RDWR   */\n"
-  "  movq %rax, %rdi   /* SHM file path  */\n"
+  "  movq 0(%rsp), %rdi /* SHM file path */\n"
   CALL_L64("shm_open")
   "\n"
   "  cmpq $-1, %rax\n"
   "  je   __afl_setup_abort\n"
   "\n"
+  "  movl    __afl_map_bits(%rip), %ecx\n"
+  "  movl    $1, %esi\n"
+  "  shll    %cl, %esi\n"
   "  movl    $0, %r9d\n"
   "  movl    %eax, %r8d\n"
   "  movl    $1, %ecx\n"
   "  movl    $3, %edx\n"
-  "  movl    $"STRINGIFY(MAP_SIZE)", %esi\n"
   "  movl    $0, %edi\n"
   CALL_L64("mmap")
   "\n"
@@ -551,7 +917,7 @@ static const u8* main_payload_64 =
   "  je   __afl_setup_abort\n"
   "\n"
 #else
-  "  movq  %rax, %rdi\n"
+  "  movq  0(%rsp), %rdi\n"
   CALL_L64("atoi")
   "\n"
   "  xorq %rdx, %rdx   /* shmat flags    */\n"
@@ -565,29 +931,126 @@ static const u8* main_payload_64 =
 #endif
   "  /* Store the address of the SHM region. */\n"
   "\n"
-  "  movq %rax, %rdx\n"
   "  movq %rax, __afl_area_ptr(%rip)\n"
   "\n"
+  "  /* Map the index table the same way. */\n"
+  "\n"
+  "  leaq .AFL_SHM_IDX_ENV(%rip), %rdi\n"
+  CALL_L64("getenv")
+  "\n"
+  "  testq %rax, %rax\n"
+  "  je    __afl_setup_identity\n"
+  "\n"
+  "  movq  %rax, %rdi\n"
+  CALL_L64("atoi")
+  "\n"
+  "  xorq %rdx, %rdx   /* shmat flags    */\n"
+  "  xorq %rsi, %rsi   /* requested addr */\n"
+  "  movq %rax, %rdi   /* SHM ID         */\n"
+  CALL_L64("shmat")
+  "\n"
+  "  cmpq $-1, %rax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movq %rax, __afl_idx_ptr(%rip)\n"
+  "  jmp  __afl_setup_done\n"
+  "\n"
+  "__afl_setup_identity:\n"
+  "\n"
+  "  /* No index table from the parent (USEMMAP builds of afl-fuzz do not\n"
+  "     have one): use a private identity table, so that edges index the map\n"
+  "     directly, like in classic AFL. */\n"
+  "\n"
+  "  movl    __afl_map_bits(%rip), %ecx\n"
+  "  movq    $4, %rsi\n"
+  "  shlq    %cl, %rsi\n"
+  "  movl    $0, %r9d\n"
+  "  movl    $-1, %r8d\n"
+  "  movl    $" STRINGIFY(MAP_PRIVATE | MAP_ANONYMOUS) ", %ecx\n"
+  "  movl    $3, %edx\n"
+  "  movl    $0, %edi\n"
+  CALL_L64("mmap")
+  "\n"
+  "  cmpq $-1, %rax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movq  %rax, __afl_idx_ptr(%rip)\n"
+  "  movl  __afl_map_bits(%rip), %ecx\n"
+  "  movl  $1, %edx\n"
+  "  shll  %cl, %edx\n"
+  "\n"
+  "__afl_identity_loop:\n"
+  "\n"
+  "  decl  %edx\n"
+  "  movl  %edx, (%rax, %rdx, 4)\n"
+  "  jnz   __afl_identity_loop\n"
+  "\n"
+  "  jmp   __afl_setup_done\n"
+  "\n"
+  "__afl_setup_scratch:\n"
+  "\n"
+  "  /* One private zero-filled mapping: the index table, followed by the\n"
+  "     compact map. Every entry reads as slot 0, so nothing is claimed. */\n"
+  "\n"
+  "  movl    __afl_map_bits(%rip), %ecx\n"
+  "  movq    $5, %rsi\n"
+  "  shlq    %cl, %rsi\n"
+  "  movl    $0, %r9d\n"
+  "  movl    $-1, %r8d\n"
+  "  movl    $" STRINGIFY(MAP_PRIVATE | MAP_ANONYMOUS) ", %ecx\n"
+  "  movl    $3, %edx\n"
+  "  movl    $0, %edi\n"
+  CALL_L64("mmap")
+  "\n"
+  "  cmpq $-1, %rax\n"
+  "  je   __afl_setup_abort\n"
+  "\n"
+  "  movl  __afl_map_bits(%rip), %ecx\n"
+  "  movq  $4, %rdx\n"
+  "  shlq  %cl, %rdx\n"
+  "  addq  %rax, %rdx\n"
+  "  movq  %rdx, __afl_area_ptr(%rip)\n"
+  "  movq  %rax, __afl_idx_ptr(%rip)\n"
+  "\n"
+  "__afl_setup_done:\n"
+  "\n"
+  "  /* Publish both pointers for the other instrumented objects, index\n"
+  "     table last. */\n"
+  "\n"
+  "  movq __afl_area_ptr(%rip), %rax\n"
 #ifdef __APPLE__
   "  movq %rax, __afl_global_area_ptr(%rip)\n"
 #else
   "  movq __afl_global_area_ptr@GOTPCREL(%rip), %rdx\n"
   "  movq %rax, (%rdx)\n"
+#endif                                                        /* ^__APPLE__ */
+  "  movq __afl_idx_ptr(%rip), %rax\n"
+#ifdef __APPLE__
+  "  movq %rax, __afl_global_idx_ptr(%rip)\n"
+#else
+  "  movq __afl_global_idx_ptr@GOTPCREL(%rip), %rdx\n"
+  "  movq %rax, (%rdx)\n"
 #endif                                                        /* ^__APPLE__ */
   "  movq %rax, %rdx\n"
   "\n"
   "__afl_forkserver:\n"
   "\n"
   "  /* Enter the fork server mode to avoid the overhead of execve() calls. We\n"
-  "     push rdx (area ptr) twice to keep stack alignment neat. */\n"
+  "     push rdx (index table ptr) twice to keep stack alignment neat. */\n"
   "\n"
   "  pushq %rdx\n"
   "  pushq %rdx\n"
   "\n"
-  "  /* Phone home and tell the parent that we're OK. (Note that signals with\n"
-  "     no SA_RESTART will mess it up). If this fails, assume that the fd is\n"
-  "     closed because we were execve()d from an instrumented binary, or because\n"
-  "     the parent doesn't want to use the fork server. */\n"
+  "  /* Phone home and tell the parent that we're OK, and how big our maps\n"
+  "     need to be. (Note that signals with no SA_RESTART will mess it up).\n"
+  "     If this fails, assume that the fd is closed because we were execve()d\n"
+  "     from an instrumented binary, or because the parent doesn't want to use\n"
+  "     the fork server. */\n"
+  "\n"
+  "  movl  __afl_map_bits(%rip), %eax\n"
+  "  shll  $1, %eax\n"
+  "  orl   $" STRINGIFY(FS_OPT_ENABLED | FS_OPT_MAPSIZE) ", %eax\n"
+  "  movl  %eax, __afl_temp(%rip)\n"
   "\n"
   "  movq $4, %rdx               /* length    */\n"
   "  leaq __afl_temp(%rip), %rsi /* data      */\n"
@@ -740,6 +1203,8 @@ static const u8* main_payload_64 =
 #ifdef __APPLE__
 
   "  .comm   __afl_area_ptr, 8\n"
+  "  .comm   __afl_idx_ptr, 8\n"
+  "  .comm   __afl_map_bits, 4\n"
 #ifndef COVERAGE_ONLY
   "  .comm   __afl_prev_loc, 8\n"
 #endif                                                    /* !COVERAGE_ONLY */
@@ -750,6 +1215,8 @@ static const u8* main_payload_64 =
 #else
 
   "  .lcomm   __afl_area_ptr, 8\n"
+  "  .lcomm   __afl_idx_ptr, 8\n"
+  "  .lcomm   __afl_map_bits, 4\n"
 #ifndef COVERAGE_ONLY
   "  .lcomm   __afl_prev_loc, 8\n"
 #endif                                                    /* !COVERAGE_ONLY */
@@ -760,12 +1227,37 @@ static const u8* main_payload_64 =
 #endif                                                        /* ^__APPLE__ */
 
   "  .comm    __afl_global_area_ptr, 8, 8\n"
+  "  .comm    __afl_global_idx_ptr, 8, 8\n"
   "\n"
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+  ".AFL_SHM_IDX_ENV:\n"
+  "  .asciz \"" SHM_IDX_ENV_VAR "\"\n"
+  "\n"
+  ".AFL_MAP_SIZE_ENV:\n"
+  "  .asciz \"" MAP_SIZE_ENV_VAR "\"\n"
+  "\n"
   "/* --- END --- */\n"
   "\n";
 
+/* Appended to every instrumented object: the map size (as a power of two)
+   its IDs were drawn from. The setup code above sizes the maps for the
+   largest record in the binary. */
+
+static const u8* map_size_rec_fmt =
+
+    "\n"
+    "/* --- AFL MAP SIZE RECORD --- */\n"
+    "\n"
+#ifndef __APPLE__
+    ".section " MAP_SIZE_SECTION ", \"a\"\n"
+    ".align 4\n"
+    ".long %u\n"
+#endif                                                       /* !__APPLE__ */
+    "\n"
+    "/* --- END --- */\n"
+    "\n";
+
 #endif                                                   /* !_HAVE_AFL_AS_H */
 
@@ -45,6 +45,7 @@
 #include "hash.h"
 #include "sharedmem.h"
 #include "forkserver.h"
+#include "batch.h"
 #include "common.h"
 
 #include <stdio.h>
@@ -69,6 +70,7 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/file.h>
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
@@ -324,7 +326,13 @@ extern u8 skip_deterministic,           /* Skip deterministic stages?       */
     no_cpu_meter_red,                   /* Feng shui on the status screen   */
     no_arith,                           /* Skip most arithmetic ops         */
     shuffle_queue,                      /* Shuffle input queue?             */
+    shared_virgin,                      /* Share virgin bits across fleet?  */
+    defrag_map,                         /* Re-layout slots by hit frequency?*/
     bitmap_changed,                     /* Time to update bitmap?           */
+    trace_cache_valid,                  /* Cached trace results current?    */
+    trace_sparse,                       /* trace_bits only has logged slots?*/
+    trace_dirty,                        /* trace_bits only has dirty lines? */
+    batch_stage,                        /* Queue execs for run_batch()?     */
     qemu_mode,                          /* Running in QEMU mode?            */
     unicorn_mode,                       /* Running in Unicorn mode?         */
     use_wine,                           /* Use WINE with QEMU mode          */
@@ -353,11 +361,12 @@ extern u8* trace_bits;                  /* SHM with instrumentation bitmap  */
 extern u32* trace_idx;
 extern u32 map_used;
 
-extern u8 virgin_bits[MAP_SIZE],        /* Regions yet untouched by fuzzing */
-    virgin_tmout[MAP_SIZE],             /* Bits we haven't seen in tmouts   */
-    virgin_crash[MAP_SIZE];             /* Bits we haven't seen in crashes  */
+extern u8 *virgin_bits,                 /* Regions yet untouched by fuzzing */
+    *virgin_tmout,                      /* Bits we haven't seen in tmouts   */
+    *virgin_crash,                      /* Bits we haven't seen in crashes  */
+    *global_virgin;                     /* Fleet-wide virgin bits (shared)  */
 
-extern u8 var_bytes[MAP_SIZE];          /* Bytes that appear to be variable */
+extern u8* var_bytes;                   /* Bytes that appear to be variable */
 
 extern volatile u8 stop_soon,           /* Ctrl-C pressed?                  */
     clear_screen,                       /* Window resized?                  */
@@ -387,6 +396,7 @@ extern u64 total_crashes,               /* Total number of crashes          */
     unique_hangs,                       /* Hangs with unique signatures     */
     total_execs,                        /* Total execve() calls             */
     slowest_exec_ms,                    /* Slowest testcase non hang in ms  */
+    last_exec_us,                       /* Duration of the last exec (us)   */
     start_time,                         /* Unix start time (ms)             */
     last_path_time,                     /* Time for most recent path (ms)   */
     last_crash_time,                    /* Time for most recent crash (ms)  */
@@ -449,8 +459,8 @@ extern struct queue_entry *queue,       /* Fuzzing queue (linked list)      */
     *queue_top,                         /* Top of the list                  */
     *q_prev100;                         /* Previous 100 marker              */
 
-extern struct queue_entry*
-    top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+extern struct queue_entry**
+    top_rated;                          /* Top entries for bitmap bytes     */
 
 extern struct extra_data* extras;       /* Extra tokens to fuzz with        */
 extern u32                extras_cnt;   /* Total number of tokens read      */
@@ -568,9 +578,14 @@ u32  calculate_score(struct queue_entry*);
 
 /* Bitmap */
 
+void setup_bitmaps(void);
 void write_bitmap(void);
 void read_bitmap(u8*);
+u8   read_index_table(u8*);
+void load_index_table(void);
+void check_index_table(void);
 u8   has_new_bits(u8*);
+u8   has_new_bits_global(void);
 u32  count_bits(u8*);
 u32  count_bytes(u8*);
 u32  count_non_255_bytes(u8*);
@@ -582,6 +597,13 @@ void simplify_trace(u32*);
 void classify_counts(u32*);
 #endif
 void init_count_class16(void);
+void init_bitmap_kernels(void);
+void classify_trace(void);
+void reset_trace_bits(void);
+u32  trace_cksum(void);
+void sample_slot_hits(void);
+void maybe_defrag_map(char**);
+void maybe_switch_laf(char**);
 void minimize_bits(u8*, u8*);
 #ifndef SIMPLE_FILES
 u8* describe_op(u8);
@@ -614,12 +636,22 @@ void show_init_stats(void);
 /* Run */
 
 u8   run_target(char**, u32);
+s32  read_status_timed(s32, s32*, u32, s32);
 void write_to_testcase(void*, u32);
 void write_with_gap(void*, u32, u32, u32);
 u8   calibrate_case(char**, struct queue_entry*, u8*, u32, u8);
 void sync_fuzzers(char**);
 u8   trim_case(char**, struct queue_entry*, u8*);
 u8   common_fuzz_stuff(char**, u8*, u32);
+u8   run_batch(char**);
+
+/* Executor pool */
+
+u8   pool_fuzz_stuff(char**, u8*, u32);
+u8   drain_pool(char**);
+u32  note_pool_finished(void);
+void kill_pool(void);
+void stop_pool(void);
 
 /* Fuzz one */
 
@@ -656,6 +688,8 @@ void   check_binary(u8*);
 void   fix_up_banner(u8*);
 void   check_if_tty(void);
 void   setup_signal_handlers(void);
+void   setup_forkserver_cleanup(void);
+void   stop_all_forkservers(void);
 char** get_qemu_argv(u8*, char**, int);
 char** get_wine_argv(u8*, char**, int);
 void   save_cmdline(u32, char**);
@@ -663,6 +697,7 @@ void   save_cmdline(u32, char**);
 /* CmpLog */
 
 void init_cmplog_forkserver(char** argv);
+void stop_cmplog_forkserver(void);
 u8   common_fuzz_cmplog_stuff(char** argv, u8* out_buf, u32 len);
 
 /* RedQueen */
@@ -742,6 +777,18 @@ static u64 get_cur_time_us(void) {
 
 }
 
+/* Get monotonic time in microseconds, for exec timings and deadlines */
+
+static inline u64 get_mono_time_us(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec * 1000000ULL) + ts.tv_nsec / 1000;
+
+}
+
 static inline u32 hash32_time(const void* key, u32 len, u32 seed){
 	//u64 ttt = get_cur_time_us();
 	return hash32(key, len, seed);
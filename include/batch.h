@@ -0,0 +1,53 @@
+/*
+   american fuzzy lop++ - batched persistent mode header
+   -----------------------------------------------------
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de> and
+                     Andrea Fioraldi <andreafioraldi@gmail.com>
+
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Layout of the SHM region afl-fuzz queues test cases in with
+   AFL_PERSISTENT_BATCH. A persistent target that takes its test cases from
+   shared memory runs all of them in one forkserver round trip, copying each
+   into the __AFL_FUZZ_TESTCASE_BUF buffer in turn, and flags the ones
+   afl-fuzz has to look at more closely.
+
+ */
+
+#ifndef _AFL_BATCH_H
+#define _AFL_BATCH_H
+
+#include "config.h"
+#include "types.h"
+
+/* Per test case results: */
+
+#define BATCH_NEW_BITS 1                /* Trace hits virgin[]              */
+#define BATCH_SLOW 2                    /* Ran longer than tmout_us         */
+
+struct fuzz_batch {
+
+  u32 cnt;                              /* Test cases queued, 0 if idle     */
+  u32 cur;                              /* One being run, cnt when done     */
+  u32 tmout_us;                         /* Timeout for each of them         */
+  u32 virgin_len;                       /* Valid bytes in virgin[]          */
+
+  u32 off[FUZZ_BATCH_MAX];              /* Test case offsets in data[]      */
+  u32 len[FUZZ_BATCH_MAX];              /* ...and their lengths             */
+  u8  res[FUZZ_BATCH_MAX];              /* BATCH_* flags of finished ones   */
+
+  u8 data[MAX_FILE];                    /* The test cases                   */
+  u8 virgin[];                          /* Copy of virgin_bits, map_size    */
+
+};
+
+#endif
+
@@ -0,0 +1,84 @@
+/*
+   american fuzzy lop++ - BigMap slot claiming
+   -------------------------------------------
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de> and
+                     Andrea Fioraldi <andreafioraldi@gmail.com>
+
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Hands out compact map slots to edges on their first hit. Entry 0 of the
+   index table counts the slots used so far, every other entry holds the
+   slot of one edge hash, or -1 if it has none yet. Shared by the runtimes
+   of all instrumentation modes; the afl-as payload in afl-as.h does the
+   same in assembly.
+
+ */
+
+#ifndef _AFL_BIGMAP_H
+#define _AFL_BIGMAP_H
+
+#include <sched.h>
+
+#include "config.h"
+#include "types.h"
+
+/* Return the slot of edge hash h, claiming one if the entry reads -1.
+
+   The entry is marked IDX_CLAIMING before the counter is touched, so that
+   threads (or processes on a shared table: AFL_EXEC_POOL executors and
+   AFL_SHARED_IDX instances) racing on the same new edge use up a single
+   slot between them: the losers wait until the winner has
+   published it. The counter is only bumped by winners, but the slot is
+   still clamped to the map, so that a table that was filled by some other
+   binary can never send us past its end.
+
+   A claimer killed between the two steps would leave the entry marked for
+   good, so a waiter that has yielded IDX_CLAIM_SPINS times puts it back to
+   -1 and starts over. */
+
+static inline u32 bigmap_claim_slot(u32 *idx, u32 h, u32 map_size) {
+
+  u32 slot, spins;
+
+  while (1) {
+
+    slot = (u32)-1;
+
+    if (__atomic_compare_exchange_n(idx + h, &slot, IDX_CLAIMING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+
+      slot = __atomic_fetch_add(idx, 1, __ATOMIC_RELAXED);
+      if (slot >= map_size) slot = map_size - 1;
+
+      __atomic_store_n(idx + h, slot, __ATOMIC_RELEASE);
+      return slot;
+
+    }
+
+    for (spins = 0; slot == IDX_CLAIMING && spins < IDX_CLAIM_SPINS; ++spins) {
+
+      sched_yield();
+      slot = __atomic_load_n(idx + h, __ATOMIC_ACQUIRE);
+
+    }
+
+    if (slot < IDX_CLAIMING) return slot;
+
+    if (slot == IDX_CLAIMING)
+      __atomic_compare_exchange_n(idx + h, &slot, (u32)-1, 0, __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED);
+
+  }
+
+}
+
+#endif
+
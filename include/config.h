@@ -297,6 +297,16 @@
 
 #define SHM_ENV_VAR "__AFL_SHM_ID"
 #define SHM_IDX_ENV_VAR "__AFL_SHM_IDX_ID"
+#define SHM_TOUCH_ENV_VAR "__AFL_SHM_TOUCH_ID"
+#define SHM_DIRTY_ENV_VAR "__AFL_SHM_DIRTY_ID"
+#define SHM_LAF_ENV_VAR "__AFL_SHM_LAF_ID"
+#define SHM_FUZZ_ENV_VAR "__AFL_SHM_FUZZ_ID"
+#define SHM_BATCH_ENV_VAR "__AFL_SHM_BATCH_ID"
+
+/* Environment variable used to tell the called program how large the SHM
+   regions are (number of first-level slots). */
+
+#define MAP_SIZE_ENV_VAR "__AFL_MAP_SIZE"
 
 /* Other less interesting, internal-only variables. */
 
@@ -304,6 +314,7 @@
 #define AS_LOOP_ENV_VAR "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR "__AFL_DEFER_FORKSRV"
+#define SNAPSHOT_ENV_VAR "__AFL_SNAPSHOT"
 
 /* In-code signatures for deferred and persistent mode. */
 
@@ -314,6 +325,11 @@
 
 #define EXEC_FAIL_SIG 0xfee1dead
 
+/* Bitmap signature left by targets built for a bigger map than the tool
+   running them set up, followed by the map size they need as a power of 2: */
+
+#define MAP_SIZE_FAIL_SIG 0xfee1b16a
+
 /* Distinctive exit code used to indicate MSAN trip condition: */
 
 #define MSAN_ERROR 86
@@ -323,6 +339,20 @@
 
 #define FORKSRV_FD 198
 
+/* Options the target may announce in its four-byte forkserver "hello"
+   message. Runtimes that predate them send zero, which means "no options".
+   The map size is transferred as a power of two. */
+
+#define FS_OPT_ENABLED 0x80000001
+#define FS_OPT_MAPSIZE 0x40000000
+#define FS_OPT_TOUCHLOG 0x20000000
+#define FS_OPT_DIRTYMAP 0x10000000
+#define FS_OPT_SHDMEM_FUZZ 0x08000000
+#define FS_OPT_BATCH 0x04000000
+#define FS_OPT_SNAPSHOT 0x02000000
+#define FS_OPT_SET_MAPSIZE(_pow2) (((_pow2)&0xff) << 1)
+#define FS_OPT_GET_MAPSIZE(_opt) (((_opt) >> 1) & 0xff)
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -339,15 +369,97 @@
 
 #define CAL_CHANCES 3
 
-/* Map size for the traced binary (2^MAP_SIZE_POW2). Must be greater than
-   2; you probably want to keep it under 18 or so for performance reasons
-   (adjusting AFL_INST_RATIO when compiling is probably a better way to solve
-   problems with complex programs). You need to recompile the target binary
-   after changing this - otherwise, SEGVs may ensue. */
+/* Default map size for the traced binary (2^MAP_SIZE_POW2). With BigMap
+   the actual size is picked per target: AFL_MAP_SIZE_POW2 at compile time
+   sets the number of first-level slots, the instrumented binary reports it
+   during the forkserver handshake, and afl-fuzz sizes its shared memory and
+   bitmaps to match. This default is used for binaries that do not report a
+   size, and it is also the size of the runtime's pre-SHM scratch regions. */
 
 #define MAP_SIZE_POW2 18
 #define MAP_SIZE (1 << MAP_SIZE_POW2)
 
+/* Range accepted for AFL_MAP_SIZE_POW2 and for sizes reported by targets: */
+
+#define MAP_SIZE_POW2_MIN 16
+#define MAP_SIZE_POW2_MAX 24
+
+/* ELF section that afl-llvm-pass uses to record the AFL_MAP_SIZE_POW2 each
+   module was built with. The runtime walks it through the linker-provided
+   __start_/__stop_ symbols, so it must be a valid C identifier. */
+
+#define MAP_SIZE_SECTION "__afl_map_pow2"
+
+/* Touched-slot log (AFL_TOUCH_LOG): instrumentation appends a compact index
+   to this log whenever its counter goes from 0 to 1, so that afl-fuzz only
+   has to look at those slots after each exec. Number of entries before the
+   log overflows and afl-fuzz falls back to scanning the whole map: */
+
+#define TOUCH_LOG_SIZE (1 << 16)
+
+/* Section used to mark modules built with AFL_TOUCH_LOG, same idea as
+   MAP_SIZE_SECTION. The log is only used if all modules carry the mark. */
+
+#define TOUCH_LOG_SECTION "__afl_touch_log"
+
+/* Dirty-line summary (AFL_DIRTY_MAP): one bit per 64-byte line of the map,
+   set when a counter in that line goes from 0 to 1, packed into u64 words.
+   Number of map bytes covered by one summary word, as a shift: */
+
+#define DIRTY_WORD_SHIFT 12
+
+/* Section used to mark modules built with AFL_DIRTY_MAP. */
+
+#define DIRTY_MAP_SECTION "__afl_dirty_map"
+
+/* Section holding the per-site slot caches of AFL_CACHE_IDX, which the
+   runtime resets to -1 once the real index table is attached: */
+
+#define IDX_CACHE_SECTION "__afl_idx_cache"
+
+/* Index entry of an edge whose slot is being handed out by another thread
+   (see bigmap.h), and the number of times to re-read such an entry before
+   assuming the claimer was killed halfway and claiming the edge anew: */
+
+#define IDX_CLAIMING 0xfffffffe
+#define IDX_CLAIM_SPINS (1 << 16)
+
+/* Switchable laf-intel sites (AFL_LLVM_LAF_SWITCH): number of per-site
+   flags afl-fuzz can set to send a site back to its original compare. They
+   are followed by as many bytes the split form ORs the outcomes it has
+   seen into, a site is saturated once its byte reads 0xff: */
+
+#define LAF_SITES (1 << 16)
+
+/* Batched persistent mode (AFL_PERSISTENT_BATCH): most test cases afl-fuzz
+   may queue for a single forkserver round trip. */
+
+#define FUZZ_BATCH_MAX 256
+
+/* Executor pool (AFL_EXEC_POOL): most fork servers afl-fuzz may run test
+   cases on concurrently. */
+
+#define EXEC_POOL_MAX 64
+
+/* Snapshot mode (AFL_SNAPSHOT): most fds a snapshot keeps track of, and
+   the most of /proc/self/maps it can take in at once. Targets beyond
+   either are forked for every exec as usual. */
+
+#define SNAPSHOT_FDS 256
+#define SNAPSHOT_MAPS_SIZE (1 << 20)
+
+/* Slot re-layout (AFL_DEFRAG_MAP): sample which slots a trace hits once
+   every this many execs (power of two)... */
+
+#define DEFRAG_SAMPLE_EXECS 64
+
+/* ...and renumber them hottest first at the start of a queue cycle once we
+   have this many samples, this many slots, and a quarter more slots than
+   at the last re-layout: */
+
+#define DEFRAG_MIN_SAMPLES 1024
+#define DEFRAG_MIN_SLOTS 1024
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC 0x40000000
@@ -30,6 +30,11 @@
 void handle_timeout(int sig);
 void init_forkserver(char **argv);
 
+extern u8 touch_log_on;
+extern u8 dirty_map_on;
+extern u8 shm_fuzz_on;
+extern u8 batch_on;
+
 #ifdef __APPLE__
 #define MSG_FORK_ON_APPLE                                                    \
   "    - On MacOS X, the semantics of fork() syscalls are non-standard and " \
@@ -27,11 +27,36 @@
 #ifndef __AFL_SHAREDMEM_H
 #define __AFL_SHAREDMEM_H
 
+#include "types.h"
+
 void setup_shm(unsigned char dumb_mode);
 void remove_shm(void);
+void resize_shm(u32 new_size);
+void init_map_size(void);
+void fit_map_size(u8* path);
+u8*  setup_shared_virgin(void);
+void set_pool_shm_env(s32 i);
+
+extern u32 map_size;
+extern u32* touch_log;
+extern u64* dirty_map;
+extern u8*  laf_flags;
+extern u8* shared_idx_dir;
+extern u8  shared_idx_fresh;
 
 extern int             cmplog_mode;
 extern struct cmp_map* cmp_map;
 
+extern u8   shm_fuzz_mode;
+extern u32* shm_fuzz_len;
+extern u8*  shm_fuzz_buf;
+
+extern u32                shm_batch_size;
+extern struct fuzz_batch* fuzz_batch;
+
+extern u32   shm_pool_size;
+extern u8**  pool_bits;
+extern u32** pool_fuzz_len;
+
 #endif
 
@@ -23,12 +23,14 @@ typedef long double max_align_t;
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/BasicBlock.h"
 #include <unordered_set>
 #include <random>
@@ -58,10 +60,11 @@ struct InsTrim : public ModulePass {
  private:
   std::mt19937 generator;
   int          total_instr = 0;
+  unsigned int map_size = MAP_SIZE;
 
   unsigned int genLabel() {
 
-    return generator() & (MAP_SIZE - 1);
+    return generator() & (map_size - 1);
 
   }
 
@@ -155,6 +158,24 @@ struct InsTrim : public ModulePass {
     // this is our default
     MarkSetOpt = true;
 
+    /* Decide the first-level map size, same as afl-llvm-pass */
+
+    char *       map_pow2_str = getenv("AFL_MAP_SIZE_POW2");
+    unsigned int map_pow2 = MAP_SIZE_POW2;
+
+    if (map_pow2_str) {
+
+      if (sscanf(map_pow2_str, "%u", &map_pow2) != 1 ||
+          map_pow2 < MAP_SIZE_POW2_MIN || map_pow2 > MAP_SIZE_POW2_MAX)
+        FATAL("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)",
+              MAP_SIZE_POW2_MIN, MAP_SIZE_POW2_MAX);
+
+    }
+
+    map_size = 1U << map_pow2;
+
+    bool threadsafe_idx = getenv("AFL_THREADSAFE_IDX") != NULL;
+
     LLVMContext &C = M.getContext();
     IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
     IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
@@ -163,6 +184,40 @@ struct InsTrim : public ModulePass {
         M, PointerType::getUnqual(Int8Ty), false, GlobalValue::ExternalLinkage,
         nullptr, "__afl_area_ptr");
 
+    /* The edge hash indexes the BigMap index table, which hands out the
+       compact slot in __afl_area_ptr, just like in afl-llvm-pass. */
+
+    GlobalVariable *CovIdxPtr = new GlobalVariable(
+        M, PointerType::getUnqual(Int32Ty), false,
+        GlobalValue::ExternalLinkage, nullptr, "__afl_idx_ptr");
+
+    /* New slots are claimed by __afl_claim_idx() with AFL_THREADSAFE_IDX,
+       else inline and clamped to the map size the runtime settled on. The
+       inline claim marks the entry with a compare-and-swap first, like
+       afl-llvm-pass; whoever loses waits in __afl_claim_idx(). */
+
+    GlobalVariable *CovMapSize =
+        new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage,
+                           nullptr, "__afl_map_size");
+
+#if LLVM_VERSION_MAJOR < 9
+    Constant *
+#else
+    FunctionCallee
+#endif
+        ClaimIdx = M.getOrInsertFunction("__afl_claim_idx", Int32Ty, Int32Ty
+#if LLVM_VERSION_MAJOR < 5
+                                       ,
+                                       NULL
+#endif
+      );
+
+    GlobalVariable *MapPow2 = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::PrivateLinkage,
+        ConstantInt::get(Int32Ty, map_pow2), "__afl_map_pow2_rec");
+    MapPow2->setSection(MAP_SIZE_SECTION);
+    appendToUsed(M, {MapPow2});
+
     GlobalVariable *OldPrev = new GlobalVariable(
         M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc", 0,
         GlobalVariable::GeneralDynamicTLSModel, 0, false);
@@ -399,13 +454,21 @@ struct InsTrim : public ModulePass {
 
       }
 
-      for (BasicBlock &BB : F) {
+      /* Instrumenting splits blocks, so pick them up beforehand. */
 
-        auto PI = pred_begin(&BB);
-        auto PE = pred_end(&BB);
+      std::vector<BasicBlock *> Blocks;
+      for (BasicBlock &BB : F)
+        Blocks.push_back(&BB);
+
+      for (BasicBlock *BBP : Blocks) {
+
+        BasicBlock &BB = *BBP;
+        auto        PI = pred_begin(&BB);
+        auto        PE = pred_end(&BB);
         if (MarkSetOpt && MS.find(&BB) == MS.end()) { continue; }
 
-        IRBuilder<> IRB(&*BB.getFirstInsertionPt());
+        Instruction *IP = &*BB.getFirstInsertionPt();
+        IRBuilder<>  IRB(IP);
         Value *     L = NULL;
         if (PI == PE) {
 
@@ -433,11 +496,85 @@ struct InsTrim : public ModulePass {
         PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
         Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
 
+        /* Look up the edge's compact slot */
+        LoadInst *IdxPtr = IRB.CreateLoad(CovIdxPtr);
+        IdxPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        Value *Hash = IRB.CreateXor(PrevLocCasted, L);
+        Value *IdxPtrIdx = IRB.CreateGEP(IdxPtr, Hash);
+
+        LoadInst *IdxVal = IRB.CreateLoad(IdxPtrIdx);
+        IdxVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+        /* First time through this edge, or another thread is claiming it
+           (IDX_CLAIMING): claim the next slot */
+        Value *Unassigned =
+            IRB.CreateICmpUGE(IdxVal, ConstantInt::get(Int32Ty, IDX_CLAIMING));
+        Instruction *Then = SplitBlockAndInsertIfThen(
+            Unassigned, IP, false, MDBuilder(C).createBranchWeights(1, 100000));
+
+        IRB.SetInsertPoint(Then);
+        Value *NewIdx;
+
+        if (threadsafe_idx) {
+
+          NewIdx = IRB.CreateCall(ClaimIdx, {Hash});
+
+        } else {
+
+          AtomicCmpXchgInst *Mark = IRB.CreateAtomicCmpXchg(
+              IdxPtrIdx, ConstantInt::get(Int32Ty, 0xffffffff),
+              ConstantInt::get(Int32Ty, IDX_CLAIMING),
+#if LLVM_VERSION_MAJOR >= 13
+              MaybeAlign(4),
+#endif
+              AtomicOrdering::Monotonic, AtomicOrdering::Monotonic);
+          Mark->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+          Instruction *Won, *Lost;
+          SplitBlockAndInsertIfThenElse(IRB.CreateExtractValue(Mark, 1), Then,
+                                        &Won, &Lost);
+
+          IRB.SetInsertPoint(Lost);
+          Value *WaitIdx = IRB.CreateCall(ClaimIdx, {Hash});
+
+          IRB.SetInsertPoint(Won);
+          AtomicRMWInst *NextIdx =
+              IRB.CreateAtomicRMW(AtomicRMWInst::Add, IdxPtr,
+                                  ConstantInt::get(Int32Ty, 1),
+#if LLVM_VERSION_MAJOR >= 13
+                                  MaybeAlign(4),
+#endif
+                                  AtomicOrdering::Monotonic);
+          NextIdx->setMetadata(M.getMDKindID("nosanitize"),
+                               MDNode::get(C, None));
+
+          LoadInst *MapSize = IRB.CreateLoad(CovMapSize);
+          MapSize->setMetadata(M.getMDKindID("nosanitize"),
+                               MDNode::get(C, None));
+          NewIdx = IRB.CreateSelect(
+              IRB.CreateICmpULT(NextIdx, MapSize), NextIdx,
+              IRB.CreateSub(MapSize, ConstantInt::get(Int32Ty, 1)));
+
+          IRB.CreateStore(NewIdx, IdxPtrIdx)
+              ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+          IRB.SetInsertPoint(Then);
+          PHINode *Claimed = IRB.CreatePHI(Int32Ty, 2);
+          Claimed->addIncoming(NewIdx, Won->getParent());
+          Claimed->addIncoming(WaitIdx, Lost->getParent());
+          NewIdx = Claimed;
+
+        }
+
+        IRB.SetInsertPoint(IP);
+        PHINode *Idx = IRB.CreatePHI(Int32Ty, 2);
+        Idx->addIncoming(IdxVal, IdxVal->getParent());
+        Idx->addIncoming(NewIdx, Then->getParent());
+
         /* Load SHM pointer */
         LoadInst *MapPtr = IRB.CreateLoad(CovMapPtr);
         MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *MapPtrIdx =
-            IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, L));
+        Value *MapPtrIdx = IRB.CreateGEP(MapPtr, Idx);
 
         /* Update bitmap */
         LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
@@ -480,14 +617,15 @@ struct InsTrim : public ModulePass {
 
     }
 
-    OKF("Instrumented %u locations (%llu, %llu) (%s mode)\n", total_instr,
-        total_rs, total_hs,
+    OKF("Instrumented %u locations (%llu, %llu) (%s mode, map 2^%u)\n",
+        total_instr, total_rs, total_hs,
         getenv("AFL_HARDEN")
             ? "hardened"
             : ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN"))
                    ? "ASAN/MSAN"
-                   : "non-hardened"));
-    return false;
+                   : "non-hardened"),
+        map_pow2);
+    return true;
 
   }
 
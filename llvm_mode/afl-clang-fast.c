@@ -396,6 +396,27 @@ static void edit_params(u32 argc, char** argv) {
 #endif                                                        /* ^__APPLE__ */
       "_I(); } while (0)";
 
+  /* Test cases through shared memory. __AFL_FUZZ_INIT() goes at file scope
+     and tells the runtime the harness wants them; _BUF and _LEN then work
+     under afl-fuzz as well as on stdin without it. */
+
+  cc_params[cc_par_cnt++] =
+      "-D__AFL_FUZZ_INIT()="
+      "int __afl_sharedmem_fuzzing = 1; "
+      "extern unsigned char *__afl_fuzz_ptr; "
+      "__attribute__((visibility(\"default\"))) "
+#ifdef __APPLE__
+      "unsigned int __afl_fuzz_testcase_len(void) "
+      "__asm__(\"___afl_fuzz_testcase_len\");";
+#else
+      "unsigned int __afl_fuzz_testcase_len(void) "
+      "__asm__(\"__afl_fuzz_testcase_len\");";
+#endif                                                        /* ^__APPLE__ */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF=__afl_fuzz_ptr";
+  cc_params[cc_par_cnt++] =
+      "-D__AFL_FUZZ_TESTCASE_LEN=__afl_fuzz_testcase_len()";
+
   //if (maybe_linking) {
 
     if (x_set) {
@@ -0,0 +1,258 @@
+/*
+   american fuzzy lop++ - switchable laf-intel sites
+   -------------------------------------------------
+
+   Shared by the laf-intel passes. With AFL_LLVM_LAF_SWITCH set, a compare
+   the passes are about to split is emitted twice: the split form, which
+   records the outcomes it has seen, and an untouched copy. A per-site flag
+   in a SHM region picks one, so afl-fuzz can send the sites it is done with
+   back to the single fast compare. See README.laf-intel.md.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ */
+
+#ifndef __AFL_LAF_SWITCH_H
+#define __AFL_LAF_SWITCH_H
+
+#include <set>
+#include <string>
+#include <limits.h>
+#include <unistd.h>
+
+#ifndef AFL_LLVM_PASS
+#define AFL_LLVM_PASS
+#endif
+
+#include "config.h"
+#include "types.h"
+
+/* Metadata kind marking the fast copies and our own bookkeeping, none of
+   which are to be split. */
+
+#define LAF_FAST_MD "afl.laf.fast"
+
+static inline bool isLafFast(Instruction *I) {
+
+  return I->getMetadata(LAF_FAST_MD) != nullptr;
+
+}
+
+static inline bool lafSwitchEnabled(void) {
+
+  return getenv("AFL_LLVM_LAF_SWITCH") != NULL;
+
+}
+
+static inline Instruction *lafMark(Value *V) {
+
+  Instruction *I = cast<Instruction>(V);
+  I->setMetadata(LAF_FAST_MD, MDNode::get(I->getContext(), None));
+  return I;
+
+}
+
+/* Site IDs are handed out in order within a module, starting at an offset
+   hashed from its path, so no two sites of a module ever share a flag and
+   modules only overlap if their ranges happen to. Each pass is a plugin of
+   its own, so the count lives in the module, as named metadata. Returns
+   false once a module has used up all LAF_SITES IDs; later sites are then
+   just split. */
+
+#define LAF_SITES_MD "afl.laf.sites"
+
+static inline bool lafSiteId(Module &M, unsigned &id) {
+
+  LLVMContext &C = M.getContext();
+  NamedMDNode *Sites = M.getOrInsertNamedMetadata(LAF_SITES_MD);
+  MDNode *     N;
+  unsigned     used = 0, base = 2166136261U;
+  char         cwd[PATH_MAX];
+
+  if (Sites->getNumOperands())
+    used = mdconst::extract<ConstantInt>(Sites->getOperand(0)->getOperand(0))
+               ->getZExtValue();
+
+  if (used >= LAF_SITES) return false;
+
+  /* FNV-1a, so the IDs don't change from one build to the next. */
+
+  std::string path = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+  path += "/" + M.getModuleIdentifier();
+
+  for (unsigned char c : path)
+    base = (base ^ c) * 16777619U;
+
+  id = (base + used) % LAF_SITES;
+
+  N = MDNode::get(C, ConstantAsMetadata::get(
+                         ConstantInt::get(Type::getInt32Ty(C), used + 1)));
+
+  if (Sites->getNumOperands())
+    Sites->setOperand(0, N);
+  else
+    Sites->addOperand(N);
+
+  return true;
+
+}
+
+/* Pointer to byte off of the SHM region, in front of IRB's insert point. */
+
+static inline Value *lafByte(IRBuilder<> &IRB, Module &M, unsigned off) {
+
+  Type * Int8PtrTy = IntegerType::getInt8PtrTy(M.getContext());
+  Value *LafVar = M.getOrInsertGlobal("__afl_laf_ptr", Int8PtrTy);
+  Value *LafPtr = IRB.CreateLoad(LafVar);
+
+  return IRB.CreateGEP(LafPtr, IRB.getInt32(off));
+
+}
+
+/* Branch on the flag of site id in front of Head's terminator: set means
+   Fast, clear means Split. */
+
+static inline void lafBranch(BasicBlock *Head, unsigned id, BasicBlock *Fast,
+                             BasicBlock *Split) {
+
+  IRBuilder<> IRB(Head->getTerminator());
+  Value *     FlagPtr = lafByte(IRB, *Head->getModule(), id);
+  Value *     Flag = IRB.CreateLoad(FlagPtr);
+
+  IRB.CreateCondBr(IRB.CreateIsNotNull(Flag), Fast, Split);
+  Head->getTerminator()->eraseFromParent();
+
+}
+
+/* OR bits into the outcome byte of site id, in front of Before. */
+
+static inline void lafRecord(Instruction *Before, unsigned id, Value *bits) {
+
+  IRBuilder<> IRB(Before);
+  Value *     SeenPtr = lafByte(IRB, *Before->getModule(), LAF_SITES + id);
+  Value *     Seen = IRB.CreateLoad(SeenPtr);
+
+  IRB.CreateStore(IRB.CreateOr(Seen, bits), SeenPtr);
+
+}
+
+/* Make I, a compare or a call to a compare function, switchable. I ends up
+   alone in a block of its own that the pass can split as usual; its users
+   see a PHI picking either I or its fast copy. */
+
+static inline void lafSwitchCompare(Instruction *I) {
+
+  LLVMContext &C = I->getContext();
+  unsigned     id;
+
+  if (!lafSiteId(*I->getModule(), id)) return;
+
+  BasicBlock * Head = I->getParent();
+  BasicBlock * Split = Head->splitBasicBlock(BasicBlock::iterator(I));
+  BasicBlock * Tail =
+      Split->splitBasicBlock(std::next(BasicBlock::iterator(I)));
+  BasicBlock * Fast =
+      BasicBlock::Create(C, "laf_fast", Head->getParent(), Tail);
+  Instruction *Copy = I->clone();
+
+  Fast->getInstList().push_back(lafMark(Copy));
+  BranchInst::Create(Tail, Fast);
+
+  PHINode *PN = PHINode::Create(I->getType(), 2, "", &Tail->front());
+  I->replaceAllUsesWith(PN);
+  PN->addIncoming(I, Split);
+  PN->addIncoming(Copy, Fast);
+
+  lafBranch(Head, id, Fast, Split);
+
+  /* Two outcomes, true (or zero for the compare functions) and false. */
+
+  IRBuilder<> IRB(Split->getTerminator());
+  Value *     Hit = I->getType()->isIntegerTy(1)
+                   ? I
+                   : lafMark(IRB.CreateICmpEQ(
+                         I, ConstantInt::get(I->getType(), 0)));
+
+  lafRecord(Split->getTerminator(), id,
+            IRB.CreateSelect(Hit, ConstantInt::get(IRB.getInt8Ty(), 0xfe),
+                             ConstantInt::get(IRB.getInt8Ty(), 0xfd)));
+
+}
+
+/* Same for a switch with up to seven cases, which has a bit for each
+   destination. The split form gets an edge block recording it in front of
+   every destination, the fast copy goes straight there. */
+
+static inline bool lafSwitchSwitch(SwitchInst *SI) {
+
+  LLVMContext &C = SI->getContext();
+  unsigned     n = SI->getNumSuccessors(), id, i;
+
+  if (n > 8 || !lafSiteId(*SI->getModule(), id)) return false;
+
+  BasicBlock * Head = SI->getParent();
+  Function *   F = Head->getParent();
+  BasicBlock * Split = Head->splitBasicBlock(BasicBlock::iterator(SI));
+  BasicBlock * Fast = BasicBlock::Create(C, "laf_fast", F);
+  Instruction *Copy = SI->clone();
+
+  Fast->getInstList().push_back(lafMark(Copy));
+
+  /* The copy's edges need the PHI entries of the original ones. */
+
+  std::set<BasicBlock *> done;
+
+  for (i = 0; i < n; ++i) {
+
+    BasicBlock *Dest = SI->getSuccessor(i);
+
+    if (!done.insert(Dest).second) continue;
+
+    for (auto &I : *Dest) {
+
+      PHINode *PN = dyn_cast<PHINode>(&I);
+      if (!PN) break;
+
+      unsigned e = PN->getNumIncomingValues(), j;
+      for (j = 0; j < e; ++j)
+        if (PN->getIncomingBlock(j) == Split)
+          PN->addIncoming(PN->getIncomingValue(j), Fast);
+
+    }
+
+  }
+
+  for (i = 0; i < n; ++i) {
+
+    BasicBlock *Dest = SI->getSuccessor(i);
+    BasicBlock *Rec = BasicBlock::Create(C, "laf_rec", F, Dest);
+
+    lafRecord(BranchInst::Create(Dest, Rec), id,
+              ConstantInt::get(IntegerType::getInt8Ty(C),
+                               ((1 << i) | ~((1 << n) - 1)) & 0xff));
+    SI->setSuccessor(i, Rec);
+
+    /* One PHI entry per edge, so move just one of them over. */
+
+    for (auto &I : *Dest) {
+
+      PHINode *PN = dyn_cast<PHINode>(&I);
+      if (!PN) break;
+
+      int j = PN->getBasicBlockIndex(Split);
+      if (j >= 0) PN->setIncomingBlock(j, Rec);
+
+    }
+
+  }
+
+  lafBranch(Head, id, Fast, Split);
+  return true;
+
+}
+
+#endif                                                /* !__AFL_LAF_SWITCH_H */
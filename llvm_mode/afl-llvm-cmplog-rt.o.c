@@ -63,6 +63,15 @@ u8* __afl_area_ptr;
 struct cmp_map* __afl_cmp_map;
 __thread u32    __afl_cmp_counter;
 
+/* Test case buffer, same as in afl-llvm-rt.o.c. */
+
+extern int __afl_sharedmem_fuzzing __attribute__((weak));
+
+static u8  __afl_fuzz_initial[MAX_FILE];
+static u32 __afl_fuzz_len_initial;
+u8*        __afl_fuzz_ptr = __afl_fuzz_initial;
+u32*       __afl_fuzz_len = &__afl_fuzz_len_initial;
+
 /* Running in persistent mode? */
 
 static u8 is_persistent;
@@ -135,14 +144,25 @@ static void __afl_map_shm(void) {
 
   }
 
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+  if (id_str && &__afl_sharedmem_fuzzing && __afl_sharedmem_fuzzing) {
+
+    u32* map = shmat(atoi(id_str), NULL, 0);
+    if (map == (void*)-1) _exit(1);
+
+    __afl_fuzz_len = map;
+    __afl_fuzz_ptr = (u8*)(map + 1);
+
+  }
+
 }
 
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
-  s32       child_pid;
+  u32 hello = 0;
+  s32 child_pid;
 
   u8 child_stopped = 0;
 
@@ -151,7 +171,10 @@ static void __afl_start_forkserver(void) {
   /* Phone home and tell the parent that we're OK. If parent isn't there,
      assume we're not running in forkserver mode and just execute program. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (__afl_fuzz_ptr != __afl_fuzz_initial)
+    hello = FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ;
+
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
   while (1) {
 
@@ -276,6 +299,25 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
 }
 
+/* __AFL_FUZZ_TESTCASE_LEN, see afl-llvm-rt.o.c. */
+
+u32 __afl_fuzz_testcase_len(void) {
+
+  s32 len;
+
+  if (__afl_fuzz_ptr != __afl_fuzz_initial) return *__afl_fuzz_len;
+
+  *__afl_fuzz_len = 0;
+
+  while (*__afl_fuzz_len < MAX_FILE &&
+         (len = read(0, __afl_fuzz_ptr + *__afl_fuzz_len,
+                     MAX_FILE - *__afl_fuzz_len)) > 0)
+    *__afl_fuzz_len += len;
+
+  return *__afl_fuzz_len;
+
+}
+
 /* This one can be called from user code when deferred forkserver mode
     is enabled. */
 
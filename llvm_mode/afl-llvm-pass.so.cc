@@ -33,6 +33,8 @@
 #include <unistd.h>
 
 #include <list>
+#include <map>
+#include <set>
 #include <string>
 #include <fstream>
 #include <sys/time.h>
@@ -42,14 +44,26 @@
 typedef long double max_align_t;
 #endif
 
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#if LLVM_VERSION_MAJOR >= 11
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#else
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#endif
 
 #if LLVM_VERSION_MAJOR > 3 || \
     (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR > 4)
@@ -111,6 +125,84 @@ class AFLCoverage : public ModulePass {
 
   }
 
+  /* Whether I may run other instrumented code, and so change
+     __afl_prev_loc. Intrinsics and inline asm do not count. */
+
+  static bool callsOut(Instruction &I) {
+
+    if (isa<InvokeInst>(I)) return true;
+
+    if (CallInst *CI = dyn_cast<CallInst>(&I))
+      return !CI->isInlineAsm() && !isa<IntrinsicInst>(CI);
+
+    return false;
+
+  }
+
+  /* Whether other instrumented code may run between the instrumentation at
+     the top of BB and its terminator, i.e. whether __afl_prev_loc can be
+     anything else than BB's own ID once we leave it. */
+
+  static bool mayChangePrevLoc(BasicBlock &BB) {
+
+    for (auto &I : BB)
+      if (callsOut(I)) return true;
+
+    return false;
+
+  }
+
+  /* Whether the AFL_HOIST_PTRS locals can be used in F. Values kept in
+     registers across setjmp() are not reliable, and we do not bother with
+     funclet-based EH. */
+
+  static bool canHoistPtrs(Function &F) {
+
+    if (F.callsFunctionThatReturnsTwice()) return false;
+
+    for (auto &BB : F)
+      if (BB.isEHPad() && !BB.isLandingPad()) return false;
+
+    return true;
+
+  }
+
+  /* Put a new block on the edges From -> To, and return it. All of them go
+     through it, a switch may well have several, and it has just the one
+     edge on to To. So each PHI in To keeps one of From's entries (they all
+     carry the same value) for it, and drops the rest. */
+
+  static BasicBlock *insertEdgeBlock(BasicBlock *From, BasicBlock *To) {
+
+    BasicBlock *E =
+        BasicBlock::Create(To->getContext(), "", To->getParent(), To);
+
+    BranchInst::Create(To, E);
+    From->getTerminator()->replaceUsesOfWith(To, E);
+
+    for (auto &PN : To->phis()) {
+
+      int i;
+
+      PN.setIncomingBlock(PN.getBasicBlockIndex(From), E);
+      while ((i = PN.getBasicBlockIndex(From)) >= 0)
+        PN.removeIncomingValue(i, false);
+
+    }
+
+    return E;
+
+  }
+
+  /* AFL_COUNT_LOOPS needs the trip counts. */
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+
+  }
+
   bool runOnModule(Module &M) override;
 
   // StringRef getPassName() const override {
@@ -132,6 +224,7 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   IntegerType *   Int8Ty = IntegerType::getInt8Ty(C);
   IntegerType *   Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *   Int64Ty = IntegerType::getInt64Ty(C);
   struct timeval  tv;
   struct timezone tz;
   u32             rand_seed;
@@ -166,6 +259,22 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   }
 
+  /* Decide the first-level map size */
+
+  char *       map_pow2_str = getenv("AFL_MAP_SIZE_POW2");
+  unsigned int map_pow2 = MAP_SIZE_POW2;
+
+  if (map_pow2_str) {
+
+    if (sscanf(map_pow2_str, "%u", &map_pow2) != 1 ||
+        map_pow2 < MAP_SIZE_POW2_MIN || map_pow2 > MAP_SIZE_POW2_MAX)
+      FATAL("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)",
+            MAP_SIZE_POW2_MIN, MAP_SIZE_POW2_MAX);
+
+  }
+
+  unsigned int map_size = 1U << map_pow2;
+
   /* Get globals for the SHM region and the previous location. Note that
      __afl_prev_loc is thread-local. */
 
@@ -181,6 +290,117 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc", 0,
       GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
+  /* Record the map size for the runtime, which reports the largest one
+     across all modules to afl-fuzz during the forkserver handshake. */
+
+  GlobalVariable *AFLMapPow2 = new GlobalVariable(
+      M, Int32Ty, true, GlobalValue::PrivateLinkage,
+      ConstantInt::get(Int32Ty, map_pow2), "__afl_map_pow2_rec");
+  AFLMapPow2->setSection(MAP_SIZE_SECTION);
+  appendToUsed(M, {AFLMapPow2});
+
+  /* With AFL_TOUCH_LOG, every 0 -> 1 transition of a counter also appends
+     its slot to a log that afl-fuzz walks instead of the whole map. The
+     runtime only turns it on if every module was built this way. */
+
+  bool            touch_log = getenv("AFL_TOUCH_LOG") != NULL;
+  GlobalVariable *AFLTouchPtr = NULL;
+
+  if (touch_log) {
+
+    AFLTouchPtr =
+        new GlobalVariable(M, PointerType::get(Int32Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_touch_ptr");
+
+    GlobalVariable *AFLTouchRec = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::PrivateLinkage,
+        ConstantInt::get(Int32Ty, 1), "__afl_touch_log_rec");
+    AFLTouchRec->setSection(TOUCH_LOG_SECTION);
+    appendToUsed(M, {AFLTouchRec});
+
+  }
+
+  /* A new edge is claimed by marking its index entry IDX_CLAIMING with a
+     compare-and-swap before taking a slot from the counter, so that
+     threads, pool executors and AFL_SHARED_IDX instances racing on the
+     same edge agree on its slot and use up only one. The winner does that
+     inline, the others wait for its slot in __afl_claim_idx(). With
+     AFL_THREADSAFE_IDX, the whole claim is left to __afl_claim_idx(), which
+     keeps the instrumented code smaller. Edges that already have a slot
+     are not affected. */
+
+  bool threadsafe_idx = getenv("AFL_THREADSAFE_IDX") != NULL;
+
+#if LLVM_VERSION_MAJOR < 9
+  Constant *
+#else
+  FunctionCallee
+#endif
+      AFLClaimIdx = M.getOrInsertFunction("__afl_claim_idx", Int32Ty, Int32Ty
+#if LLVM_VERSION_MAJOR < 5
+                                        ,
+                                        NULL
+#endif
+    );
+
+  /* New slots are clamped to the map size the runtime settled on. */
+
+  GlobalVariable *AFLMapSize = new GlobalVariable(
+      M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_map_size");
+
+  /* AFL_DIRTY_MAP is the lighter variant: on the same 0 -> 1 transitions it
+     only marks the 64-byte line of the map the counter lives in. */
+
+  bool            dirty_map = getenv("AFL_DIRTY_MAP") != NULL;
+  GlobalVariable *AFLDirtyPtr = NULL;
+
+  if (dirty_map) {
+
+    AFLDirtyPtr =
+        new GlobalVariable(M, PointerType::get(Int64Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_dirty_ptr");
+
+    GlobalVariable *AFLDirtyRec = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::PrivateLinkage,
+        ConstantInt::get(Int32Ty, 1), "__afl_dirty_map_rec");
+    AFLDirtyRec->setSection(DIRTY_MAP_SECTION);
+    appendToUsed(M, {AFLDirtyRec});
+
+  }
+
+  /* With AFL_CACHE_IDX, blocks that can only be reached from one other
+     instrumented block get their slot from a per-site cache instead of going
+     through __afl_prev_loc and the index table. */
+
+  bool cache_idx = getenv("AFL_CACHE_IDX") != NULL;
+
+  /* With AFL_PRUNE_EDGES, blocks whose edges can be told from those of their
+     neighbours are not instrumented at all. */
+
+  bool prune_edges = getenv("AFL_PRUNE_EDGES") != NULL;
+
+  /* With AFL_COUNT_LOOPS, simple counted loops add their back-edge count to
+     the map once when they are done, instead of once per iteration. */
+
+  bool count_loops = getenv("AFL_COUNT_LOOPS") != NULL;
+
+  /* With AFL_HOIST_PTRS, __afl_prev_loc and the map pointers are kept in
+     locals for the whole function instead of being reloaded in every block.
+     The map accesses also get their own alias scope, which the function's
+     loads and stores are marked as not aliasing with. */
+
+  bool    hoist_ptrs = getenv("AFL_HOIST_PTRS") != NULL;
+  MDNode *AFLScope = NULL;
+
+  if (hoist_ptrs) {
+
+    MDBuilder MDB(C);
+    MDNode *  Domain = MDB.createAnonymousAliasScopeDomain("__afl");
+    AFLScope =
+        MDNode::get(C, MDB.createAnonymousAliasScope(Domain, "__afl_maps"));
+
+  }
+
   //ConstantInt *zero8 = ConstantInt::get(Int8Ty, 0);
   //ConstantInt *one8 = ConstantInt::get(Int8Ty, 1);
   //ConstantInt *one32 = ConstantInt::get(Int32Ty, 1);
@@ -188,82 +408,481 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   /* Instrument all the things! */
 
-  int inst_blocks = 0;
+  int inst_blocks = 0, cached_blocks = 0, pruned_blocks = 0, counted_loops = 0;
 
   for (auto &F : M){
-  		std::vector<BasicBlock::iterator> ips;
+  		//pick the blocks and their IDs first, so that the ID of a block's
+  		//predecessor is known by the time we get to the block
+  		std::map<BasicBlock*, unsigned int> locs;
   		for(auto &bb : F){
-  			ips.push_back(bb.getFirstInsertionPt());
-  		}
-
-  		for (auto &IP : ips) {
-
-  			//BasicBlock::iterator IP = BB.getFirstInsertionPt();
-  			//Instruction * firstInstOrig = &(*IP);
-  			IRBuilder<> IRB(&(*IP));
 
   			if (AFL_R(100) >= inst_ratio)
   				continue;
 
   			/* Make up cur_loc */
 
-  			unsigned int cur_loc = AFL_R(MAP_SIZE);
+  			unsigned int cur_loc = AFL_R(map_size);
   			while((cur_loc ^ (cur_loc >> 1)) == 0){
-  				cur_loc = AFL_R(MAP_SIZE);
+  				cur_loc = AFL_R(map_size);
   			}
 
-  			ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+  			locs[&bb] = cur_loc;
+  		}
 
-  			/* Load prev_loc */
-  			LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-  			PrevLoc->setMetadata(M.getMDKindID("nosanitize"),
-  					MDNode::get(C, None));
-  			Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+  		//with AFL_PRUNE_EDGES, leave out blocks that are only entered from P
+  		//and only left for S. P dominates them and S post-dominates them, so
+  		//with P and S instrumented, the pair (P, S) stands for P -> B -> S,
+  		//as long as P cannot jump to S directly, B does not call out, and no
+  		//other block between P and S was left out. Hit counts are the same
+  		std::set<BasicBlock*> pruned;
+  		if (prune_edges) {
+  			std::set<std::pair<BasicBlock*, BasicBlock*>> paths;
+  			for (auto &bb : F) {
+  				BasicBlock* pred = bb.getSinglePredecessor();
+  				BasicBlock* succ = bb.getSingleSuccessor();
+  				if (!pred || !succ || pred == &bb || succ == &bb ||
+  						!locs.count(&bb) || !locs.count(pred) || !locs.count(succ) ||
+  						pruned.count(pred) || pruned.count(succ) ||
+  						paths.count({pred, succ}) || mayChangePrevLoc(bb))
+  					continue;
+  				bool direct = false;
+  				for (auto s : successors(pred))
+  					if (s == succ) direct = true;
+  				if (direct)
+  					continue;
+  				pruned.insert(&bb);
+  				paths.insert({pred, succ});
+  			}
+  			for (auto bb : pruned)
+  				locs.erase(bb);
+  			pruned_blocks += pruned.size();
+  		}
 
-  			/*load idx*/
-  			LoadInst *IdxPtr = IRB.CreateLoad(AFLIdxPtr);
-  			IdxPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  			Value *idxAddr = IRB.CreateGEP(Int32Ty, IdxPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+  		//with AFL_CACHE_IDX, a block whose only predecessor is instrumented
+  		//(or was left out, with an instrumented one in turn) and does not
+  		//call out sees a known prev_loc, so its edge hash is a constant and
+  		//its slot can be kept in a per-site cache
+  		std::map<BasicBlock*, unsigned int> hashes;
+  		if (cache_idx) {
+  			for (auto &L : locs) {
+  				BasicBlock* pred = L.first->getSinglePredecessor();
+  				if (pred && pruned.count(pred))
+  					pred = pred->getSinglePredecessor();
+  				if (!pred || pred == L.first || !locs.count(pred) ||
+  						mayChangePrevLoc(*pred))
+  					continue;
+  				hashes[L.first] = (locs[pred] >> 1) ^ L.second;
+  			}
+  		}
+
+  		//with AFL_COUNT_LOOPS, a loop that is a single block H without calls,
+  		//whose back-edge count ScalarEvolution knows on entry, no longer
+  		//bumps the H -> H counter on every iteration. H's own instrumentation
+  		//moves to the way in, and the back-edge count gets added to the
+  		//H -> H counter on the way out. The counter wraps just the same, so
+  		//afl-fuzz sees the same byte
+  		std::map<BasicBlock*, Instruction*> entries;
+  		std::vector<std::pair<BasicBlock*, std::pair<Instruction*, Value*>>> loopExits;
+
+  		if (count_loops && !F.isDeclaration()) {
+
+  			LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+  			ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+  			SCEVExpander Expander(SE, M.getDataLayout(), "afl_loop");
+  			std::vector<std::pair<Loop*, const SCEV*>> loops;
+
+  			//look at everything before the CFG changes under SE's feet
+  			for (auto &bb : F) {
+  				Loop* L = LI.getLoopFor(&bb);
+  				if (!L || L->getHeader() != &bb || L->getNumBlocks() != 1 ||
+  						!L->getLoopPredecessor() || !L->getExitBlock() ||
+  						!locs.count(&bb) || mayChangePrevLoc(bb))
+  					continue;
+  				unsigned int edges = 0;
+  				for (auto s : successors(L->getLoopPredecessor()))
+  					if (s == &bb) edges++;
+  				if (edges != 1)
+  					continue;
+  				const SCEV* BTC = SE.getBackedgeTakenCount(L);
+  				if (isa<SCEVCouldNotCompute>(BTC) ||
+#if LLVM_VERSION_MAJOR >= 15
+  						!Expander.isSafeToExpand(BTC))
+#else
+  						!isSafeToExpand(BTC, SE))
+#endif
+  					continue;
+  				loops.push_back({L, BTC});
+  			}
+
+  			for (auto &LB : loops) {
+  				BasicBlock* H = LB.first->getHeader();
+  				BasicBlock* in = insertEdgeBlock(LB.first->getLoopPredecessor(), H);
+  				BasicBlock* out = insertEdgeBlock(H, LB.first->getExitBlock());
+  				Value* btc = Expander.expandCodeFor(LB.second, LB.second->getType(), in->getTerminator());
+  				entries[H] = in->getTerminator();
+  				loopExits.push_back({H, {out->getTerminator(), btc}});
+  			}
+
+  			counted_loops += loops.size();
+
+  		}
+
+  		std::vector<BasicBlock::iterator> ips;
+  		for (auto &bb : F)
+  			if (locs.count(&bb))
+  				ips.push_back(entries.count(&bb) ? entries[&bb]->getIterator() : bb.getFirstInsertionPt());
+
+  		//with AFL_HOIST_PTRS, prev_loc and the base pointers live in allocas
+  		//that are loaded at entry and after every call, and prev_loc is only
+  		//written back to TLS before calls and returns. They get promoted to
+  		//SSA values once the function is instrumented
+  		AllocaInst *PrevSlot = NULL, *IdxSlot = NULL, *AreaSlot = NULL;
+  		std::vector<Instruction*> calls, exits;
+
+  		if (hoist_ptrs && !ips.empty() && canHoistPtrs(F)) {
+
+  			std::vector<Instruction*> mem;
+  			std::vector<BasicBlock*> pads;
+
+  			for (auto &bb : F) {
+  				if (bb.isLandingPad())
+  					pads.push_back(&bb);
+  				for (auto &I : bb) {
+  					if (callsOut(I))
+  						calls.push_back(&I);
+  					else if (isa<ReturnInst>(I) || isa<ResumeInst>(I))
+  						exits.push_back(&I);
+  					else if (isa<LoadInst>(I) || isa<StoreInst>(I) ||
+  							isa<AtomicRMWInst>(I) || isa<AtomicCmpXchgInst>(I) ||
+  							isa<MemIntrinsic>(I))
+  						mem.push_back(&I);
+  				}
+  			}
+
+  			Instruction* entry = &*F.getEntryBlock().getFirstInsertionPt();
+  			IRBuilder<> EB(entry);
+  			PrevSlot = EB.CreateAlloca(Int32Ty);
+  			IdxSlot = EB.CreateAlloca(PointerType::get(Int32Ty, 0));
+  			AreaSlot = EB.CreateAlloca(PointerType::get(Int8Ty, 0));
+
+  			//the callee may also have set up the maps (__AFL_INIT())
+  			auto reload = [&](Instruction* Before) {
+  				IRBuilder<> B(Before);
+  				LoadInst* L = B.CreateLoad(AFLPrevLoc);
+  				L->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				B.CreateStore(L, PrevSlot);
+  				L = B.CreateLoad(AFLIdxPtr);
+  				L->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				B.CreateStore(L, IdxSlot);
+  				L = B.CreateLoad(AFLMapPtr);
+  				L->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				B.CreateStore(L, AreaSlot);
+  			};
+
+  			//these go in before the instrumentation, which is inserted right
+  			//in front of the same instructions
+  			reload(entry);
+  			for (auto pad : pads)
+  				reload(&*pad->getFirstInsertionPt());
+
+  			for (auto I : calls) {
+
+  				if (InvokeInst* II = dyn_cast<InvokeInst>(I)) {
+
+  					//reload on the normal edge, in a block of its own unless
+  					//we are the only way into the destination
+  					BasicBlock* dest = II->getNormalDest();
+  					if (dest->getSinglePredecessor() != II->getParent())
+  						dest = insertEdgeBlock(II->getParent(), dest);
+  					reload(&*dest->getFirstInsertionPt());
+
+  				} else if (!cast<CallInst>(I)->isMustTailCall())
+
+  					reload(I->getNextNode());
+
+  			}
+
+  			for (auto I : mem)
+  				I->setMetadata(LLVMContext::MD_noalias,
+  						MDNode::concatenate(I->getMetadata(LLVMContext::MD_noalias), AFLScope));
+
+  		}
+
+  		//look up the slot of edge hash h in the index table at IdxPtr,
+  		//claiming a new one if the edge has none yet. The PHI that picks
+  		//the result goes right before Before
+  		auto lookupSlot = [&](Instruction* Before, Value* IdxPtr, Value* h) -> Value* {
+
+  			IRBuilder<> IRB(Before);
+  			Value *idxAddr = IRB.CreateGEP(Int32Ty, IdxPtr, h);
 
   			//load index value
   			LoadInst* idxVal = IRB.CreateLoad(idxAddr);
   			idxVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			if (PrevSlot) idxVal->setMetadata(LLVMContext::MD_alias_scope, AFLScope);
 
-  			//check if index value is -1
-  			Value* cond = IRB.CreateICmpEQ(ConstantInt::get(Int32Ty, -1), idxVal);
+  			//check if index value is -1, or IDX_CLAIMING while another
+  			//thread hands out the slot
+  			Value* cond = IRB.CreateICmpUGE(idxVal, ConstantInt::get(Int32Ty, IDX_CLAIMING));
 
   			//create then block
-  			Instruction* then = SplitBlockAndInsertIfThen(cond, &(*IP), false, MDBuilder(C).createBranchWeights(1, 100000));
+  			Instruction* then = SplitBlockAndInsertIfThen(cond, Before, false, MDBuilder(C).createBranchWeights(1, 100000));
   			assert(dyn_cast<BranchInst>(then)->isUnconditional());
 
-  			//instrument then block
   			IRB.SetInsertPoint(then);
-  			LoadInst* cntVal = IRB.CreateLoad(IdxPtr);
-  			cntVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  			IRB.CreateStore(cntVal, idxAddr)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  			IRB.CreateStore(IRB.CreateAdd(cntVal, ConstantInt::get(Int32Ty, 1)), IdxPtr)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			Value* newIdx;
 
+  			if (threadsafe_idx) {
 
-  			//instrument tail
-  			IRB.SetInsertPoint(&(*IP));
-  			PHINode* idx = IRB.CreatePHI(Int32Ty, 2);
-  			idx->addIncoming(idxVal, idxVal->getParent());
-  			idx->addIncoming(cntVal, cntVal->getParent());
+  				newIdx = IRB.CreateCall(AFLClaimIdx, {h});
+
+  			} else {
+
+  				//mark the entry as being claimed. Only if we got it from -1, take
+  				//the slot ourselves, else wait for it in the runtime
+  				AtomicCmpXchgInst* mark = IRB.CreateAtomicCmpXchg(idxAddr,
+  						ConstantInt::get(Int32Ty, 0xffffffff),
+  						ConstantInt::get(Int32Ty, IDX_CLAIMING),
+#if LLVM_VERSION_MAJOR >= 13
+  						MaybeAlign(4),
+#endif
+  						AtomicOrdering::Monotonic, AtomicOrdering::Monotonic);
+  				mark->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  				Instruction *won, *lost;
+  				SplitBlockAndInsertIfThenElse(IRB.CreateExtractValue(mark, 1), then, &won, &lost);
+
+  				IRB.SetInsertPoint(lost);
+  				Value* waitIdx = IRB.CreateCall(AFLClaimIdx, {h});
+
+  				//the slot counter in idx[0] may be shared by all instances on
+  				//the box (AFL_SHARED_IDX), so take the next slot with an atomic
+  				//fetch-and-add instead of load + store
+  				IRB.SetInsertPoint(won);
+  				AtomicRMWInst* cntVal = IRB.CreateAtomicRMW(AtomicRMWInst::Add,
+  						IdxPtr, ConstantInt::get(Int32Ty, 1),
+#if LLVM_VERSION_MAJOR >= 13
+  						MaybeAlign(4),
+#endif
+  						AtomicOrdering::Monotonic);
+  				cntVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  				//never hand out a slot past the end of the map
+  				LoadInst* mapSize = IRB.CreateLoad(AFLMapSize);
+  				mapSize->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				newIdx = IRB.CreateSelect(IRB.CreateICmpULT(cntVal, mapSize), cntVal,
+  						IRB.CreateSub(mapSize, ConstantInt::get(Int32Ty, 1)));
+
+  				IRB.CreateStore(newIdx, idxAddr)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  				IRB.SetInsertPoint(then);
+  				PHINode* claimed = IRB.CreatePHI(Int32Ty, 2);
+  				claimed->addIncoming(newIdx, won->getParent());
+  				claimed->addIncoming(waitIdx, lost->getParent());
+  				newIdx = claimed;
+
+  			}
+
+  			IRB.SetInsertPoint(Before);
+  			PHINode* slot = IRB.CreatePHI(Int32Ty, 2);
+  			slot->addIncoming(idxVal, idxVal->getParent());
+  			slot->addIncoming(newIdx, then->getParent());
+  			return slot;
+
+  		};
 
-  			LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+  		//add inc to the counter in slot idx, and log the slot if the counter
+  		//was zero
+  		auto bumpSlot = [&](Instruction* Before, Value* idx, Value* inc) {
+
+  			IRBuilder<> IRB(Before);
+
+  			LoadInst *MapPtr = IRB.CreateLoad(AreaSlot ? AreaSlot : (Value*)AFLMapPtr);
   			MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
   			Value *mapAddr = IRB.CreateGEP(Int8Ty, MapPtr, idx);
 
   			LoadInst *mapVal = IRB.CreateLoad(mapAddr);
   			mapVal->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  			IRB.CreateStore(IRB.CreateAdd(mapVal, ConstantInt::get(Int8Ty, 1)), mapAddr)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			StoreInst *mapInc = IRB.CreateStore(IRB.CreateAdd(mapVal, inc), mapAddr);
+  			mapInc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  			if (PrevSlot) {
+  				mapVal->setMetadata(LLVMContext::MD_alias_scope, AFLScope);
+  				mapInc->setMetadata(LLVMContext::MD_alias_scope, AFLScope);
+  			}
+
+  			//log the slot the first time its counter is hit in this run;
+  			//entries past the end of the log land in the scratch word and
+  			//afl-fuzz falls back to scanning the map
+  			Instruction* logIt = NULL;
+
+  			if (touch_log || dirty_map) {
+
+  				Value* isNew = IRB.CreateICmpEQ(mapVal, ConstantInt::get(Int8Ty, 0));
+  				logIt = SplitBlockAndInsertIfThen(isNew, Before, false, MDBuilder(C).createBranchWeights(1, 1000));
+
+  			}
+
+  			if (touch_log) {
+
+  				IRB.SetInsertPoint(logIt);
+  				LoadInst *TouchPtr = IRB.CreateLoad(AFLTouchPtr);
+  				TouchPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				AtomicRMWInst* logCnt = IRB.CreateAtomicRMW(AtomicRMWInst::Add,
+  						TouchPtr, ConstantInt::get(Int32Ty, 1),
+#if LLVM_VERSION_MAJOR >= 13
+  						MaybeAlign(4),
+#endif
+  						AtomicOrdering::Monotonic);
+  				logCnt->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				Value* inLog = IRB.CreateICmpULT(logCnt, ConstantInt::get(Int32Ty, TOUCH_LOG_SIZE));
+  				Value* logSlot = IRB.CreateSelect(inLog,
+  						IRB.CreateAdd(logCnt, ConstantInt::get(Int32Ty, 1)),
+  						ConstantInt::get(Int32Ty, TOUCH_LOG_SIZE + 1));
+  				IRB.CreateStore(idx, IRB.CreateGEP(Int32Ty, TouchPtr, logSlot))->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  			}
+
+  			//mark the line in the dirty summary, one bit per 64 bytes
+  			if (dirty_map) {
+
+  				IRB.SetInsertPoint(logIt);
+  				LoadInst *DirtyPtr = IRB.CreateLoad(AFLDirtyPtr);
+  				DirtyPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				Value* word = IRB.CreateLShr(idx, ConstantInt::get(Int32Ty, DIRTY_WORD_SHIFT));
+  				Value* bit = IRB.CreateAnd(IRB.CreateLShr(idx, ConstantInt::get(Int32Ty, 6)), ConstantInt::get(Int32Ty, 63));
+  				Value* mask = IRB.CreateShl(ConstantInt::get(Int64Ty, 1), IRB.CreateZExt(bit, Int64Ty));
+  				AtomicRMWInst* mark = IRB.CreateAtomicRMW(AtomicRMWInst::Or,
+  						IRB.CreateGEP(Int64Ty, DirtyPtr, word), mask,
+#if LLVM_VERSION_MAJOR >= 13
+  						MaybeAlign(8),
+#endif
+  						AtomicOrdering::Monotonic);
+  				mark->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  			}
+
+  		};
+
+  		for (auto &IP : ips) {
+
+  			//BasicBlock::iterator IP = BB.getFirstInsertionPt();
+  			//Instruction * firstInstOrig = &(*IP);
+  			IRBuilder<> IRB(&(*IP));
+
+  			//sites moved to the way into a loop are on an edge of their own
+  			BasicBlock* BB = IP->getParent();
+  			if (!locs.count(BB))
+  				BB = BB->getSingleSuccessor();
+  			unsigned int cur_loc = locs[BB];
+
+  			Value* idx;
+
+  			if (hashes.count(BB)) {
+
+  				//cached site: one load of the cache on the hot path. It starts
+  				//out as -1 and is filled from the index table on the first hit;
+  				//the runtime resets the whole section once the real table is
+  				//attached
+  				GlobalVariable* Cache = new GlobalVariable(M, Int32Ty, false,
+  						GlobalValue::PrivateLinkage, ConstantInt::get(Int32Ty, -1),
+  						"__afl_idx_cache");
+  				Cache->setSection(IDX_CACHE_SECTION);
+  				Cache->setAlignment(
+#if LLVM_VERSION_MAJOR >= 10
+  						MaybeAlign(4)
+#else
+  						4
+#endif
+  						);
+
+  				LoadInst* cached = IRB.CreateLoad(Cache);
+  				cached->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				Value* cond = IRB.CreateICmpEQ(ConstantInt::get(Int32Ty, -1), cached);
+  				Instruction* fill = SplitBlockAndInsertIfThen(cond, &(*IP), false, MDBuilder(C).createBranchWeights(1, 100000));
+
+  				IRB.SetInsertPoint(fill);
+  				LoadInst *IdxPtr = IRB.CreateLoad(IdxSlot ? IdxSlot : (Value*)AFLIdxPtr);
+  				IdxPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  				Value* slot = lookupSlot(fill, IdxPtr, ConstantInt::get(Int32Ty, hashes[BB]));
+  				IRB.SetInsertPoint(fill);
+  				IRB.CreateStore(slot, Cache)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  				IRB.SetInsertPoint(&(*IP));
+  				PHINode* phi = IRB.CreatePHI(Int32Ty, 2);
+  				phi->addIncoming(cached, cached->getParent());
+  				phi->addIncoming(slot, fill->getParent());
+  				idx = phi;
+
+  				cached_blocks++;
+
+  			} else {
+
+  				ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+
+  				/* Load prev_loc */
+  				LoadInst *PrevLoc = IRB.CreateLoad(PrevSlot ? PrevSlot : (Value*)AFLPrevLoc);
+  				PrevLoc->setMetadata(M.getMDKindID("nosanitize"),
+  						MDNode::get(C, None));
+  				Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+
+  				/*load idx*/
+  				LoadInst *IdxPtr = IRB.CreateLoad(IdxSlot ? IdxSlot : (Value*)AFLIdxPtr);
+  				IdxPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  				idx = lookupSlot(&(*IP), IdxPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+
+  			}
 
   			/* Set prev_loc to cur_loc >> 1 */
-  			IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			IRB.SetInsertPoint(&(*IP));
+  			IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), PrevSlot ? PrevSlot : (Value*)AFLPrevLoc)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  			bumpSlot(&(*IP), idx, ConstantInt::get(Int8Ty, 1));
 
   			inst_blocks++;
 
   		}
+
+  		for (auto &LE : loopExits) {
+
+  			unsigned int cur_loc = locs[LE.first];
+  			Instruction* out = LE.second.first;
+  			Value* btc = LE.second.second;
+
+  			IRBuilder<> IRB(out);
+  			Value* taken = IRB.CreateICmpNE(btc, ConstantInt::get(btc->getType(), 0));
+  			Instruction* then = SplitBlockAndInsertIfThen(taken, out, false);
+
+  			IRB.SetInsertPoint(then);
+  			Value* inc = IRB.CreateZExtOrTrunc(btc, Int8Ty);
+  			LoadInst *IdxPtr = IRB.CreateLoad(IdxSlot ? IdxSlot : (Value*)AFLIdxPtr);
+  			IdxPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			Value* idx = lookupSlot(then, IdxPtr, ConstantInt::get(Int32Ty, (cur_loc >> 1) ^ cur_loc));
+  			bumpSlot(then, idx, inc);
+
+  		}
+
+  		if (PrevSlot) {
+
+  			//write prev_loc back only now, a call or return may well be the
+  			//first instruction of an instrumented block. Nothing may go
+  			//between a musttail call and its return, and the callee has set
+  			//prev_loc by then anyway
+  			for (auto I : exits) {
+  				CallInst* CI = dyn_cast_or_null<CallInst>(I->getPrevNode());
+  				if (!CI || !CI->isMustTailCall())
+  					calls.push_back(I);
+  			}
+
+  			for (auto I : calls) {
+  				IRBuilder<> B(I);
+  				B.CreateStore(B.CreateLoad(PrevSlot), AFLPrevLoc)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  			}
+
+  			DominatorTree DT(F);
+  			PromoteMemToReg({PrevSlot, IdxSlot, AreaSlot}, DT);
+  		}
   	}
 
   /* Say something nice. */
@@ -273,13 +892,25 @@ bool AFLCoverage::runOnModule(Module &M) {
     if (!inst_blocks)
       WARNF("No instrumentation targets found.");
     else
-      OKF("Instrumented %u locations (%s mode, ratio %u%%).", inst_blocks,
+      OKF("Instrumented %u locations (%s mode, ratio %u%%, map 2^%u%s).",
+          inst_blocks,
           getenv("AFL_HARDEN")
               ? "hardened"
               : ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN"))
                      ? "ASAN/MSAN"
                      : "non-hardened"),
-          inst_ratio);
+          inst_ratio, map_pow2,
+          touch_log ? ", touch log" : (dirty_map ? ", dirty map" : ""));
+
+    if (prune_edges)
+      OKF("Left out %u blocks whose edges follow from their neighbours'.",
+          pruned_blocks);
+
+    if (count_loops)
+      OKF("Counted %u loops on the way out.", counted_loops);
+
+    if (inst_blocks && cache_idx)
+      OKF("%u of them get their slot from a per-site cache.", cached_blocks);
 
   }
 
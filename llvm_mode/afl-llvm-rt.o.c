@@ -26,6 +26,8 @@
 #include "config.h"
 #include "types.h"
 #include "cmplog.h"
+#include "batch.h"
+#include "bigmap.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,11 +36,17 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <setjmp.h>
+#include <alloca.h>
+#endif
 
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
@@ -64,6 +72,69 @@ u8* __afl_area_ptr = __afl_area_initial;
 u32  __afl_idx_initial[MAP_SIZE];
 u32* __afl_idx_ptr = __afl_idx_initial;
 
+/* Touched-slot log for modules built with AFL_TOUCH_LOG: entry [0] is the
+   count, followed by TOUCH_LOG_SIZE slots and one scratch entry that takes
+   the writes once the log has overflowed. */
+
+u32  __afl_touch_initial[TOUCH_LOG_SIZE + 2];
+u32* __afl_touch_ptr = __afl_touch_initial;
+
+/* Dirty-line summary for modules built with AFL_DIRTY_MAP. The scratch copy
+   has to cover the largest map, since the index table may get attached
+   without it. */
+
+u64  __afl_dirty_initial[(1 << MAP_SIZE_POW2_MAX) >> DIRTY_WORD_SHIFT];
+u64* __afl_dirty_ptr = __afl_dirty_initial;
+
+/* Site switches and outcomes of laf-intel sites built with
+   AFL_LLVM_LAF_SWITCH. All zero, i.e. split, without afl-fuzz. */
+
+u8  __afl_laf_initial[LAF_SITES * 2];
+u8* __afl_laf_ptr = __afl_laf_initial;
+
+/* Test case buffer behind __AFL_FUZZ_TESTCASE_BUF and _LEN. Harnesses that
+   define __afl_sharedmem_fuzzing through __AFL_FUZZ_INIT() get afl-fuzz's
+   SHM copy, everybody else reads stdin into the scratch one. */
+
+extern int __afl_sharedmem_fuzzing __attribute__((weak));
+
+static u8  __afl_fuzz_initial[MAX_FILE];
+static u32 __afl_fuzz_len_initial;
+u8*        __afl_fuzz_ptr = __afl_fuzz_initial;
+u32*       __afl_fuzz_len = &__afl_fuzz_len_initial;
+
+/* Test cases afl-fuzz queued with AFL_PERSISTENT_BATCH, for persistent
+   harnesses that use the buffer above, and when the current one started. */
+
+static struct fuzz_batch* __afl_batch;
+static u64                __afl_batch_start_us;
+
+/* Map sizes (as powers of two) recorded by afl-llvm-pass in MAP_SIZE_SECTION,
+   one per instrumented module. Weak, so that binaries without any records
+   still link. __afl_map_pow2 ends up as the largest of them, or zero, and
+   __afl_map_size is what the instrumentation clamps new slots to. */
+
+extern u32 __start___afl_map_pow2[] __attribute__((weak));
+extern u32 __stop___afl_map_pow2[] __attribute__((weak));
+
+static u32 __afl_map_pow2;
+u32        __afl_map_size = MAP_SIZE;
+
+/* Same for the AFL_TOUCH_LOG and AFL_DIRTY_MAP marks. */
+
+extern u32 __start___afl_touch_log[] __attribute__((weak));
+extern u32 __stop___afl_touch_log[] __attribute__((weak));
+extern u32 __start___afl_dirty_map[] __attribute__((weak));
+extern u32 __stop___afl_dirty_map[] __attribute__((weak));
+
+static u8 __afl_touch_log, __afl_dirty_map;
+
+/* Per-site slot caches of modules built with AFL_CACHE_IDX. Sites hit before
+   the index table is attached cache slots of __afl_idx_initial. */
+
+extern u32 __start___afl_idx_cache[] __attribute__((weak));
+extern u32 __stop___afl_idx_cache[] __attribute__((weak));
+
 #ifdef __ANDROID__
 u32 __afl_prev_loc;
 #else
@@ -74,11 +145,108 @@ __thread u32 __afl_prev_loc;
 
 static u8 is_persistent;
 
+/* Restoring snapshots instead of forking (AFL_SNAPSHOT)? */
+
+static u8 __afl_snapshot_on;
+
+/* Find out how many first-level slots this binary needs. */
+
+static void __afl_get_map_size(void) {
+
+  u32* rec;
+
+  for (rec = __start___afl_map_pow2; rec < __stop___afl_map_pow2; ++rec)
+    if (*rec > __afl_map_pow2) __afl_map_pow2 = *rec;
+
+  if (__afl_map_pow2) __afl_map_size = 1U << __afl_map_pow2;
+
+  /* The touched-slot log and the dirty-line summary are only complete if
+     every module writes to them. */
+
+  __afl_touch_log =
+      __stop___afl_touch_log - __start___afl_touch_log ==
+          __stop___afl_map_pow2 - __start___afl_map_pow2 &&
+      (uintptr_t)__stop___afl_touch_log > (uintptr_t)__start___afl_touch_log;
+
+  __afl_dirty_map =
+      __stop___afl_dirty_map - __start___afl_dirty_map ==
+          __stop___afl_map_pow2 - __start___afl_map_pow2 &&
+      (uintptr_t)__stop___afl_dirty_map > (uintptr_t)__start___afl_dirty_map;
+
+}
+
 /* SHM setup. */
 
+/* Tools that run us without a forkserver (afl-showmap, afl-analyze) never
+   see the handshake. Leave MAP_SIZE_FAIL_SIG and our size at the start of
+   their map, so that they can tell the user instead of showing an empty
+   trace. Whoever does read the handshake clears the map before using it. */
+
+static void __afl_map_too_small(u8* id_str) {
+
+  u32* sig;
+
+#ifdef USEMMAP
+  int shm_fd = shm_open(id_str, O_RDWR, 0600);
+  if (shm_fd == -1) return;
+
+  sig = mmap(0, 2 * sizeof(u32), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
+             0);
+  close(shm_fd);
+  if (sig == MAP_FAILED) return;
+#else
+  sig = shmat(atoi(id_str), NULL, 0);
+  if (sig == (void*)-1) return;
+#endif
+
+  sig[0] = MAP_SIZE_FAIL_SIG;
+  sig[1] = __afl_map_pow2;
+
+#ifdef USEMMAP
+  munmap(sig, 2 * sizeof(u32));
+#else
+  shmdt(sig);
+#endif
+
+}
+
 static void __afl_map_shm(void) {
 
   u8* id_str = getenv(SHM_ENV_VAR);
+  u8* size_str = getenv(MAP_SIZE_ENV_VAR);
+
+  __afl_get_map_size();
+
+  /* If the parent set up smaller maps than we were built for, stay off them.
+     We run on private scratch maps instead and report our size in the
+     forkserver handshake, so that afl-fuzz can restart us with bigger ones. */
+
+  if (id_str && (size_str ? (u32)atoi(size_str) : MAP_SIZE) < __afl_map_size) {
+
+    __afl_map_too_small(id_str);
+    id_str = NULL;
+
+  }
+
+  if (!id_str) {
+
+    /* Not attached: every index entry reads as zero, so all hits land in
+       __afl_area_initial[0]. Only the index table has to cover the whole
+       first-level range. */
+
+    if (__afl_map_size > MAP_SIZE) {
+
+      __afl_idx_ptr =
+          mmap(0, __afl_map_size * sizeof(u32), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (__afl_idx_ptr == MAP_FAILED) _exit(1);
+
+    }
+
+    __afl_touch_log = __afl_dirty_map = 0;
+    return;
+
+  }
 
   /* If we're running under AFL, attach to the appropriate region, replacing the
      early-stage __afl_area_initial region that is needed to allow some really
@@ -101,7 +269,8 @@ static void __afl_map_shm(void) {
     }
 
     /* map the shared memory segment to the address space of the process */
-    shm_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    shm_base = mmap(0, __afl_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    shm_fd, 0);
     if (shm_base == MAP_FAILED) {
 
       close(shm_fd);
@@ -130,28 +299,591 @@ static void __afl_map_shm(void) {
 
   id_str = getenv(SHM_IDX_ENV_VAR);
   if (id_str) {
+
     u32 shm_id = atoi(id_str);
     __afl_idx_ptr = shmat(shm_id, NULL, 0);
     if (__afl_idx_ptr == (void*)-1) _exit(1);
+
+    if ((uintptr_t)__stop___afl_idx_cache > (uintptr_t)__start___afl_idx_cache)
+      memset(__start___afl_idx_cache, 255,
+             (u8*)__stop___afl_idx_cache - (u8*)__start___afl_idx_cache);
+
+  }
+
+  id_str = getenv(SHM_TOUCH_ENV_VAR);
+  if (id_str && __afl_touch_log) {
+
+    __afl_touch_ptr = shmat(atoi(id_str), NULL, 0);
+    if (__afl_touch_ptr == (void*)-1) _exit(1);
+
+  } else
+
+    __afl_touch_log = 0;
+
+  id_str = getenv(SHM_DIRTY_ENV_VAR);
+  if (id_str && __afl_dirty_map) {
+
+    __afl_dirty_ptr = shmat(atoi(id_str), NULL, 0);
+    if (__afl_dirty_ptr == (void*)-1) _exit(1);
+
+  } else
+
+    __afl_dirty_map = 0;
+
+  id_str = getenv(SHM_LAF_ENV_VAR);
+  if (id_str) {
+
+    __afl_laf_ptr = shmat(atoi(id_str), NULL, 0);
+    if (__afl_laf_ptr == (void*)-1) _exit(1);
+
+  }
+
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+  if (id_str && &__afl_sharedmem_fuzzing && __afl_sharedmem_fuzzing) {
+
+    u32* map = shmat(atoi(id_str), NULL, 0);
+    if (map == (void*)-1) _exit(1);
+
+    __afl_fuzz_len = map;
+    __afl_fuzz_ptr = (u8*)(map + 1);
+
+    id_str = getenv(SHM_BATCH_ENV_VAR);
+    if (id_str && is_persistent) {
+
+      __afl_batch = shmat(atoi(id_str), NULL, 0);
+      if (__afl_batch == (void*)-1) _exit(1);
+
+    }
+
+  }
+
+}
+
+#ifdef __linux__
+
+/* Snapshot mode. Rather than forking a child for every exec, the fork
+   server's child copies its writable memory aside once. When the target
+   calls exit(), the child puts back just the pages the run dirtied, as
+   told by their soft-dirty bits in /proc/self/pagemap, and stops the way
+   a persistent child does; SIGCONT resumes it at the snapshot. Mappings
+   made during the run are dropped, fds opened during the run closed and
+   the others rewound. Anything we can't undo, like a second thread or a
+   lost fd, just lets the exit go on, and the next exec forks anew. Our
+   bookkeeping lives in shared mappings, which snapshots leave alone. */
+
+#define SNAP_PRESENT (3ULL << 62)          /* pagemap: present or swapped */
+#define SNAP_SOFT_DIRTY (1ULL << 55)       /* pagemap: soft-dirty         */
+#define SNAP_PAGEMAP_CHUNK 4096            /* Entries read at once        */
+#define SNAP_MAPS_MAX (SNAPSHOT_MAPS_SIZE / 32) /* Lines in maps[] below  */
+#define SNAP_STACK_GAP 4096                /* Below the saved stack       */
+
+struct snap_map {
+
+  uintptr_t start, end;                 /* Address range                    */
+  u8*       copy;                       /* Saved contents, if private & rw  */
+  char      perms[4];                   /* As in /proc/self/maps            */
+  u8        anon;                       /* Not backed by a file?            */
+  u8        stack;                      /* The [stack]?                     */
+
+};
+
+struct snap {
+
+  pid_t     pid;                        /* Process the snapshot is of       */
+  uintptr_t brk;                        /* Its program break                */
+  u32       page_size;
+
+  s32 maps_fd, pagemap_fd, clear_refs_fd;
+
+  s32   fd_cnt;                         /* Open fds, ascending...           */
+  s32   fd[SNAPSHOT_FDS];
+  off_t fd_off[SNAPSHOT_FDS];           /* ...their offsets, or -1          */
+  s32   cur_fd[SNAPSHOT_FDS];           /* Scratch for the ones open now    */
+
+  s32              map_cnt;             /* Mappings, ascending              */
+  struct snap_map* map;
+  struct snap_map  cur[SNAP_MAPS_MAX];  /* Scratch for the current ones     */
+
+  u64  pagemap[SNAP_PAGEMAP_CHUNK];
+  char maps[SNAPSHOT_MAPS_SIZE];
+
+};
+
+static struct snap* __afl_snap;
+static sigjmp_buf   __afl_snap_env;
+
+static char* __afl_snap_hex(char* p, uintptr_t* v) {
+
+  *v = 0;
+
+  while (1) {
+
+    u8 c = *p;
+
+    if (c >= '0' && c <= '9')
+      c -= '0';
+    else if (c >= 'a' && c <= 'f')
+      c -= 'a' - 10;
+    else
+      return p;
+
+    *v = (*v << 4) | c;
+    ++p;
+
+  }
+
+}
+
+/* Read /proc/self/maps into up to max entries of m. Returns how many
+   there are, or -1 if they don't fit. */
+
+static s32 __afl_snap_maps(struct snap* s, struct snap_map* m, u32 max) {
+
+  char *p = s->maps, *end;
+  u32   len = 0, cnt = 0;
+  s32   res;
+
+  if (lseek(s->maps_fd, 0, SEEK_SET)) return -1;
+
+  while ((res = read(s->maps_fd, s->maps + len, SNAPSHOT_MAPS_SIZE - len)) > 0)
+    len += res;
+
+  if (res < 0 || len == SNAPSHOT_MAPS_SIZE) return -1;
+
+  end = s->maps + len;
+
+  while (p < end) {
+
+    char*     eol = memchr(p, '\n', end - p);
+    uintptr_t skip;
+
+    if (!eol) eol = end;
+    if (cnt == max) return -1;
+
+    /* start-end perms offset major:minor inode path */
+
+    p = __afl_snap_hex(p, &m[cnt].start);
+    p = __afl_snap_hex(p + 1, &m[cnt].end);
+    memcpy(m[cnt].perms, p + 1, 4);
+    p = __afl_snap_hex(p + 6, &skip);
+    p = __afl_snap_hex(p + 1, &skip);
+    p = __afl_snap_hex(p + 1, &skip);
+
+    m[cnt].copy = NULL;
+    m[cnt].anon = p[1] == '0' && (p[2] == ' ' || p[2] == '\n');
+    m[cnt].stack = eol - p >= 7 && !memcmp(eol - 7, "[stack]", 7);
+
+    ++cnt;
+    p = eol + 1;
+
+  }
+
+  return cnt;
+
+}
+
+/* Mappings that get saved and restored. */
+
+static u8 __afl_snap_saved(struct snap_map* m) {
+
+  return m->perms[0] == 'r' && m->perms[1] == 'w' && m->perms[3] == 'p';
+
+}
+
+/* Numbered entries of a /proc directory, leaving out the fd we read it
+   with. Puts up to max of them into out, returns how many there are. */
+
+struct snap_dirent {
+
+  u64            ino;
+  s64            off;
+  unsigned short reclen;
+  u8             type;
+  char           name[];
+
+};
+
+static s32 __afl_snap_list(const char* path, s32* out, s32 max) {
+
+  char buf[4096];
+  s32  dir_fd = open(path, O_RDONLY | O_DIRECTORY), cnt = 0, len, i;
+
+  if (dir_fd < 0) return -1;
+
+  while ((len = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+
+    for (i = 0; i < len; i += ((struct snap_dirent*)(buf + i))->reclen) {
+
+      char* name = ((struct snap_dirent*)(buf + i))->name;
+      s32   n = 0;
+
+      if (*name < '0' || *name > '9') continue;
+      while (*name >= '0' && *name <= '9')
+        n = n * 10 + *name++ - '0';
+
+      if (n == dir_fd) continue;
+      if (cnt < max) out[cnt] = n;
+      ++cnt;
+
+    }
+
+  }
+
+  close(dir_fd);
+  return len < 0 ? -1 : cnt;
+
+}
+
+/* Copy the pages of m with any of bits set in their pagemap entries (or
+   all of them, for zero), into the snapshot or, with restore, back out of
+   it. */
+
+static s32 __afl_snap_pages(struct snap* s, struct snap_map* m, u64 bits,
+                            u8 restore) {
+
+  uintptr_t addr = m->start;
+
+  while (addr < m->end) {
+
+    u32 n = (m->end - addr) / s->page_size, i;
+
+    if (n > SNAP_PAGEMAP_CHUNK) n = SNAP_PAGEMAP_CHUNK;
+
+    if (pread(s->pagemap_fd, s->pagemap, n * sizeof(u64),
+              addr / s->page_size * sizeof(u64)) != (ssize_t)(n * sizeof(u64)))
+      return -1;
+
+    for (i = 0; i < n; ++i, addr += s->page_size) {
+
+      u8* copy = m->copy + (addr - m->start);
+
+      if (bits && !(s->pagemap[i] & bits)) continue;
+
+      if (restore)
+        memcpy((void*)addr, copy, s->page_size);
+      else
+        memcpy(copy, (void*)addr, s->page_size);
+
+    }
+
+  }
+
+  return 0;
+
+}
+
+/* See whether the kernel keeps soft-dirty bits for us, on a page of our
+   own: they are clear after writing 4 to clear_refs, set after a write. */
+
+static u8 __afl_snapshot_probe(void) {
+
+  s32 pagemap_fd = open("/proc/self/pagemap", O_RDONLY),
+      clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+  u32 page_size = getpagesize();
+  u8* page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u64 before = SNAP_SOFT_DIRTY, after = 0;
+
+  if (pagemap_fd >= 0 && clear_refs_fd >= 0 && page != MAP_FAILED) {
+
+    off_t off = (uintptr_t)page / page_size * sizeof(u64);
+
+    *(volatile u8*)page = 1;
+
+    if (write(clear_refs_fd, "4", 1) == 1 &&
+        pread(pagemap_fd, &before, sizeof(u64), off) == sizeof(u64)) {
+
+      *(volatile u8*)page = 2;
+      if (pread(pagemap_fd, &after, sizeof(u64), off) != sizeof(u64))
+        after = 0;
+
+    }
+
+  }
+
+  if (pagemap_fd >= 0) close(pagemap_fd);
+  if (clear_refs_fd >= 0) close(clear_refs_fd);
+  if (page != MAP_FAILED) munmap(page, page_size);
+
+  return !(before & SNAP_SOFT_DIRTY) && (after & SNAP_SOFT_DIRTY);
+
+}
+
+/* Put the snapshot back and stop, then resume at it. Runs on a stack below
+   the saved one. Returns only if the target is in a state we can't undo,
+   before changing a thing; past that point, failures end the process. */
+
+static void __afl_snapshot_restore(struct snap* s) {
+
+  s32 cnt, kept = 0, i, j;
+
+  if (__afl_snap_list("/proc/self/task", NULL, 0) != 1) return;
+
+  /* Close the fds opened since, but keep all of the others. */
+
+  cnt = __afl_snap_list("/proc/self/fd", s->cur_fd, SNAPSHOT_FDS);
+  if (cnt < 0 || cnt > SNAPSHOT_FDS) return;
+
+  for (i = 0, j = 0; i < cnt; ++i) {
+
+    while (j < s->fd_cnt && s->fd[j] < s->cur_fd[i])
+      ++j;
+
+    if (j < s->fd_cnt && s->fd[j] == s->cur_fd[i])
+      ++kept;
+    else
+      close(s->cur_fd[i]);
+
+  }
+
+  if (kept != s->fd_cnt) return;
+
+  if ((uintptr_t)syscall(SYS_brk, s->brk) != s->brk) return;
+
+  /* Drop what was mapped since, except for stack growth, and map what went
+     missing or changed since, for its pages to show up soft-dirty. */
+
+  cnt = __afl_snap_maps(s, s->cur, SNAP_MAPS_MAX);
+  if (cnt < 0) _exit(0);
+
+  for (i = 0, j = 0; i < cnt; ++i) {
+
+    struct snap_map* c = &s->cur[i];
+    uintptr_t        from = c->start;
+
+    if (c->stack) continue;
+
+    while (from < c->end) {
+
+      while (j < s->map_cnt && s->map[j].end <= from)
+        ++j;
+
+      if (j == s->map_cnt || s->map[j].start >= c->end) {
+
+        munmap((void*)from, c->end - from);
+        break;
+
+      }
+
+      if (s->map[j].start > from)
+        munmap((void*)from, s->map[j].start - from);
+
+      from = s->map[j].end;
+
+    }
+
+  }
+
+  for (i = 0, j = 0; i < s->map_cnt; ++i) {
+
+    struct snap_map* m = &s->map[i];
+    uintptr_t        from = m->start, to;
+    u8               remap;
+
+    if (!m->copy) continue;
+
+    while (from < m->end) {
+
+      while (j < cnt && s->cur[j].end <= from)
+        ++j;
+
+      if (j < cnt && s->cur[j].start <= from) {
+
+        to = s->cur[j].end < m->end ? s->cur[j].end : m->end;
+        remap = memcmp(s->cur[j].perms, m->perms, 4);
+
+      } else {
+
+        to = j < cnt && s->cur[j].start < m->end ? s->cur[j].start : m->end;
+        remap = 1;
+
+      }
+
+      if (remap &&
+          mmap((void*)from, to - from,
+               PROT_READ | PROT_WRITE | (m->perms[2] == 'x' ? PROT_EXEC : 0),
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+               0) == MAP_FAILED)
+        _exit(0);
+
+      from = to;
+
+    }
+
   }
 
+  for (i = 0; i < s->map_cnt; ++i)
+    if (s->map[i].copy &&
+        __afl_snap_pages(s, &s->map[i], SNAP_SOFT_DIRTY, 1) < 0)
+      _exit(0);
+
+  for (i = 0; i < s->fd_cnt; ++i)
+    if (s->fd_off[i] >= 0) lseek(s->fd[i], s->fd_off[i], SEEK_SET);
+
+  if (write(s->clear_refs_fd, "4", 1) != 1) _exit(0);
+
+  raise(SIGSTOP);
+
+  siglongjmp(__afl_snap_env, 1);
+
 }
 
+/* Registered with atexit() in the snapshot, so that runs end here. */
+
+static void __afl_snapshot_exit(void) {
+
+  struct snap* s = __afl_snap;
+  uintptr_t    sp = (uintptr_t)&s, below = 0;
+  u8*          pad;
+  s32          i;
+
+  if (!s || getpid() != s->pid) return;
+
+  /* Get out of the way of the saved stack first. */
+
+  for (i = 0; i < s->map_cnt; ++i) {
+
+    struct snap_map* m = &s->map[i];
+
+    if (!m->copy || sp < m->start || sp >= m->end) continue;
+    if (!m->stack) return;
+
+    below = sp - m->start + SNAP_STACK_GAP;
+
+  }
+
+  pad = alloca(below);
+  __asm__ volatile("" : : "r"(pad) : "memory");
+
+  __afl_snapshot_restore(s);
+
+}
+
+/* Take the snapshot, in the fork server's child. If that does not work
+   out, the child just runs as a forked one. */
+
+static void __afl_snapshot_take(void) {
+
+  struct snap* s;
+  u8*          copy = MAP_FAILED;
+  u64          copy_len = 0, map_len = 0;
+  s32          cnt, i;
+
+  s = mmap(NULL, sizeof(struct snap), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED) return;
+
+  s->pid = getpid();
+  s->brk = (uintptr_t)sbrk(0);
+  s->page_size = getpagesize();
+
+  s->maps_fd = open("/proc/self/maps", O_RDONLY);
+  s->pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  s->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+
+  if (s->maps_fd < 0 || s->pagemap_fd < 0 || s->clear_refs_fd < 0) goto fail;
+
+  if (atexit(__afl_snapshot_exit)) goto fail;
+
+  cnt = __afl_snap_list("/proc/self/fd", s->fd, SNAPSHOT_FDS);
+  if (cnt < 0 || cnt > SNAPSHOT_FDS) goto fail;
+
+  s->fd_cnt = cnt;
+  for (i = 0; i < cnt; ++i)
+    s->fd_off[i] = lseek(s->fd[i], 0, SEEK_CUR);
+
+  /* Size up the copy, map it, then list the mappings again, with it. The
+     pages of anonymous mappings that are not there yet read as zeroes, so
+     only the ones that are get copied. */
+
+  cnt = __afl_snap_maps(s, s->cur, SNAP_MAPS_MAX);
+  if (cnt < 0) goto fail;
+
+  for (i = 0; i < cnt; ++i)
+    if (__afl_snap_saved(&s->cur[i]))
+      copy_len += s->cur[i].end - s->cur[i].start;
+
+  map_len = (cnt + 16) * sizeof(struct snap_map);
+
+  copy = mmap(NULL, map_len + copy_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (copy == MAP_FAILED) goto fail;
+
+  s->map = (struct snap_map*)copy;
+
+  cnt = __afl_snap_maps(s, s->map, cnt + 16);
+  if (cnt < 0) goto fail;
+
+  s->map_cnt = cnt;
+
+  for (i = 0; i < cnt; ++i) {
+
+    struct snap_map* m = &s->map[i];
+
+    if (!__afl_snap_saved(m)) continue;
+    if (m->end - m->start > copy_len) goto fail;
+
+    m->copy = copy + map_len;
+    map_len += m->end - m->start;
+    copy_len -= m->end - m->start;
+
+  }
+
+  __afl_snap = s;
+
+  for (i = 0; i < cnt; ++i)
+    if (s->map[i].copy &&
+        __afl_snap_pages(s, &s->map[i], s->map[i].anon ? SNAP_PRESENT : 0, 0) <
+            0)
+      break;
+
+  if (i == cnt && write(s->clear_refs_fd, "4", 1) == 1) return;
+
+  __afl_snap = NULL;
+
+fail:
+
+  if (copy != MAP_FAILED) munmap(copy, map_len + copy_len);
+  if (s->maps_fd >= 0) close(s->maps_fd);
+  if (s->pagemap_fd >= 0) close(s->pagemap_fd);
+  if (s->clear_refs_fd >= 0) close(s->clear_refs_fd);
+  munmap(s, sizeof(struct snap));
+
+}
+
+#endif                                                        /* __linux__ */
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
-  s32       child_pid;
+  u32 hello = 0;
+  s32 child_pid;
 
   u8 child_stopped = 0;
 
   void (*old_sigchld_handler)(int) = 0;  // = signal(SIGCHLD, SIG_DFL);
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+     assume we're not running in forkserver mode and just execute program.
+     The hello message carries the map size we were built for, if known. */
+
+  if (__afl_map_pow2)
+    hello = FS_OPT_ENABLED | FS_OPT_MAPSIZE | FS_OPT_SET_MAPSIZE(__afl_map_pow2);
+
+  if (__afl_touch_log) hello |= FS_OPT_TOUCHLOG;
+  if (__afl_dirty_map) hello |= FS_OPT_DIRTYMAP;
+  if (__afl_fuzz_ptr != __afl_fuzz_initial)
+    hello |= FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ;
+  if (__afl_batch) hello |= FS_OPT_BATCH;
+
+#ifdef __linux__
+  if (getenv(SNAPSHOT_ENV_VAR) && !is_persistent)
+    __afl_snapshot_on = __afl_snapshot_probe();
+  if (__afl_snapshot_on) hello |= FS_OPT_ENABLED | FS_OPT_SNAPSHOT;
+#endif
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
   while (1) {
 
@@ -188,6 +920,12 @@ static void __afl_start_forkserver(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+
+#ifdef __linux__
+        if (__afl_snapshot_on && !sigsetjmp(__afl_snap_env, 1))
+          __afl_snapshot_take();
+#endif
+
         return;
 
       }
@@ -206,12 +944,13 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
+    if (waitpid(child_pid, &status,
+                is_persistent || __afl_snapshot_on ? WUNTRACED : 0) < 0)
       _exit(1);
 
-    /* In persistent mode, the child stops itself with SIGSTOP to indicate
-       a successful run. In this case, we want to wake it up without forking
-       again. */
+    /* In persistent and snapshot mode, the child stops itself with SIGSTOP
+       to indicate a successful run. In this case, we want to wake it up
+       without forking again. */
 
     if (WIFSTOPPED(status)) child_stopped = 1;
 
@@ -223,13 +962,112 @@ static void __afl_start_forkserver(void) {
 
 }
 
-/* A simplified persistent mode handler, used as explained in README.llvm. */
+/* Erase the trace of the last iteration, as afl-fuzz would. */
+
+static void __afl_clear_map(void) {
+
+  memset(__afl_area_ptr, 0, __afl_idx_ptr[0]);
+  __afl_touch_ptr[0] = 0;
+  memset(__afl_dirty_ptr, 0,
+         ((__afl_idx_ptr[0] + (1 << DIRTY_WORD_SHIFT) - 1) >>
+          DIRTY_WORD_SHIFT) * sizeof(u64));
+  __afl_prev_loc = 0;
+
+}
+
+static u64 __afl_now_us(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+/* Hand the harness batch entry i. */
+
+static void __afl_batch_load(u32 i) {
+
+  __afl_batch->cur = i;
+  *__afl_fuzz_len = __afl_batch->len[i];
+  memcpy(__afl_fuzz_ptr, __afl_batch->data + __afl_batch->off[i],
+         __afl_batch->len[i]);
+
+  __afl_batch_start_us = __afl_now_us();
+
+}
+
+/* Hit count buckets, same as count_class_lookup8 in afl-fuzz. */
+
+static u8 __afl_count_class(u8 v) {
+
+  if (v <= 2) return v;
+  if (v == 3) return 4;
+  if (v < 8) return 8;
+  if (v < 16) return 16;
+  if (v < 32) return 32;
+  if (v < 128) return 64;
+  return 128;
+
+}
+
+/* Flag the batch entry that just finished if its trace has bits afl-fuzz
+   has not seen yet, with hit counts bucketed the way afl-fuzz does, or if
+   it ran too long. Slots handed out after afl-fuzz took its copy of
+   virgin_bits are new by definition. */
+
+static void __afl_batch_check(void) {
+
+  u32 used = __afl_idx_ptr[0], i = 0;
+  u8  res = 0;
+
+  while (i < used) {
+
+    u8 v;
+
+    if (!(i & 7) && i + 8 <= used && !*(u64*)(__afl_area_ptr + i)) {
+
+      i += 8;
+      continue;
+
+    }
+
+    v = __afl_area_ptr[i];
+
+    if (v) {
+
+      if (i >= __afl_batch->virgin_len ||
+          (__afl_count_class(v) & __afl_batch->virgin[i])) {
+
+        res = BATCH_NEW_BITS;
+        break;
+
+      }
+
+    }
+
+    ++i;
+
+  }
+
+  if (__afl_now_us() - __afl_batch_start_us > __afl_batch->tmout_us)
+    res |= BATCH_SLOW;
+
+  __afl_batch->res[__afl_batch->cur] = res;
+
+}
+
+/* A simplified persistent mode handler, used as explained in README.llvm.
+   With a batch queued, the iterations in between its entries skip the round
+   trip through the fork server. */
 
 int __afl_persistent_loop(unsigned int max_cnt) {
 
   static u8  first_pass = 1;
   static u32 cycle_cnt;
 
+  u8 batched = __afl_batch && __afl_batch->cnt;
+
   if (first_pass) {
 
     /* Make sure that every iteration of __AFL_LOOP() starts with a clean slate.
@@ -237,12 +1075,8 @@ int __afl_persistent_loop(unsigned int max_cnt) {
        iteration, it's our job to erase any trace of whatever happened
        before the loop. */
 
-    if (is_persistent) {
-
-      memset(__afl_area_ptr, 0, __afl_idx_ptr[0]);
-      __afl_prev_loc = 0;
-
-    }
+    if (is_persistent) __afl_clear_map();
+    if (batched) __afl_batch_load(0);
 
     cycle_cnt = max_cnt;
     first_pass = 0;
@@ -252,11 +1086,29 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
   if (is_persistent) {
 
+    if (batched) {
+
+      __afl_batch_check();
+
+      if (__afl_batch->cur + 1 < __afl_batch->cnt && cycle_cnt > 1) {
+
+        --cycle_cnt;
+        __afl_clear_map();
+        __afl_batch_load(__afl_batch->cur + 1);
+        return 1;
+
+      }
+
+      ++__afl_batch->cur;
+
+    }
+
     if (--cycle_cnt) {
 
       raise(SIGSTOP);
 
       __afl_prev_loc = 0;
+      if (__afl_batch && __afl_batch->cnt) __afl_batch_load(0);
 
       return 1;
 
@@ -264,9 +1116,18 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
       /* When exiting __AFL_LOOP(), make sure that the subsequent code that
          follows the loop is not traced. We do that by pivoting back to the
-         dummy output region. */
+         dummy output region. Compact indices can go up to the map size, so
+         bigger maps need a bigger dummy. */
 
-      __afl_area_ptr = __afl_area_initial;
+      if (__afl_map_size > MAP_SIZE) {
+
+        __afl_area_ptr = mmap(0, __afl_map_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (__afl_area_ptr == MAP_FAILED) _exit(1);
+
+      } else
+
+        __afl_area_ptr = __afl_area_initial;
 
     }
 
@@ -276,6 +1137,36 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
 }
 
+/* AFL_THREADSAFE_IDX instrumentation calls this when the edge with hash h
+   has no slot yet, or another thread is busy claiming one for it. */
+
+u32 __afl_claim_idx(u32 h) {
+
+  return bigmap_claim_slot(__afl_idx_ptr, h, __afl_map_size);
+
+}
+
+/* __AFL_FUZZ_TESTCASE_LEN. Under afl-fuzz the test case is already in
+   place; otherwise read all of stdin into the scratch buffer, once per
+   call. */
+
+u32 __afl_fuzz_testcase_len(void) {
+
+  s32 len;
+
+  if (__afl_fuzz_ptr != __afl_fuzz_initial) return *__afl_fuzz_len;
+
+  *__afl_fuzz_len = 0;
+
+  while (*__afl_fuzz_len < MAX_FILE &&
+         (len = read(0, __afl_fuzz_ptr + *__afl_fuzz_len,
+                     MAX_FILE - *__afl_fuzz_len)) > 0)
+    *__afl_fuzz_len += len;
+
+  return *__afl_fuzz_len;
+
+}
+
 /* This one can be called from user code when deferred forkserver mode
     is enabled. */
 
@@ -49,6 +49,8 @@
 
 using namespace llvm;
 
+#include "afl-laf-switch.h"
+
 namespace {
 
 class CompareTransform : public ModulePass {
@@ -263,7 +265,7 @@ bool CompareTransform::transformCmps(Module &M, const bool processStrcmp,
           bool isStrncasecmp = processStrncasecmp;
 
           Function *Callee = callInst->getCalledFunction();
-          if (!Callee) continue;
+          if (!Callee || isLafFast(callInst)) continue;
           if (callInst->getCallingConv() != llvm::CallingConv::C) continue;
           StringRef FuncName = Callee->getName();
           isStrcmp &= !FuncName.compare(StringRef("strcmp"));
@@ -411,6 +413,9 @@ bool CompareTransform::transformCmps(Module &M, const bool processStrcmp,
     errs() << callInst->getCalledFunction()->getName() << ": len " << constLen
            << ": " << ConstStr << "\n";
 
+    /* keep the plain call around for when afl-fuzz switches the site */
+    if (lafSwitchEnabled()) lafSwitchCompare(callInst);
+
     /* split before the call instruction */
     BasicBlock *bb = callInst->getParent();
     BasicBlock *end_bb = bb->splitBasicBlock(BasicBlock::iterator(callInst));
@@ -46,6 +46,8 @@
 
 using namespace llvm;
 
+#include "afl-laf-switch.h"
+
 namespace {
 
 class SplitComparesTransform : public ModulePass {
@@ -110,6 +112,7 @@ class SplitComparesTransform : public ModulePass {
   int enableFPSplit;
 
   size_t splitIntCompares(Module &M, unsigned bitw);
+  size_t makeSwitchable(Module &M, unsigned bitw);
   size_t splitFPCompares(Module &M);
   bool   simplifyCompares(Module &M);
   bool   simplifyIntSignedness(Module &M);
@@ -253,7 +256,8 @@ bool SplitComparesTransform::simplifyCompares(Module &M) {
 
         CmpInst *selectcmpInst = nullptr;
 
-        if ((selectcmpInst = dyn_cast<CmpInst>(&IN))) {
+        if ((selectcmpInst = dyn_cast<CmpInst>(&IN)) &&
+            !isLafFast(selectcmpInst)) {
 
           if (selectcmpInst->getPredicate() == CmpInst::ICMP_UGE ||
               selectcmpInst->getPredicate() == CmpInst::ICMP_SGE ||
@@ -456,7 +460,8 @@ bool SplitComparesTransform::simplifyIntSignedness(Module &M) {
 
         CmpInst *selectcmpInst = nullptr;
 
-        if ((selectcmpInst = dyn_cast<CmpInst>(&IN))) {
+        if ((selectcmpInst = dyn_cast<CmpInst>(&IN)) &&
+            !isLafFast(selectcmpInst)) {
 
           if (selectcmpInst->getPredicate() == CmpInst::ICMP_SGT ||
               selectcmpInst->getPredicate() == CmpInst::ICMP_SLT) {
@@ -642,7 +647,8 @@ size_t SplitComparesTransform::splitFPCompares(Module &M) {
 
         CmpInst *selectcmpInst = nullptr;
 
-        if ((selectcmpInst = dyn_cast<CmpInst>(&IN))) {
+        if ((selectcmpInst = dyn_cast<CmpInst>(&IN)) &&
+            !isLafFast(selectcmpInst)) {
 
           if (selectcmpInst->getPredicate() == CmpInst::FCMP_OEQ ||
               selectcmpInst->getPredicate() == CmpInst::FCMP_ONE ||
@@ -1045,7 +1051,8 @@ size_t SplitComparesTransform::splitIntCompares(Module &M, unsigned bitw) {
 
         CmpInst *selectcmpInst = nullptr;
 
-        if ((selectcmpInst = dyn_cast<CmpInst>(&IN))) {
+        if ((selectcmpInst = dyn_cast<CmpInst>(&IN)) &&
+            !isLafFast(selectcmpInst)) {
 
           if (selectcmpInst->getPredicate() == CmpInst::ICMP_EQ ||
               selectcmpInst->getPredicate() == CmpInst::ICMP_NE ||
@@ -1229,6 +1236,63 @@ size_t SplitComparesTransform::splitIntCompares(Module &M, unsigned bitw) {
 
 }
 
+/* Keep a plain copy of every compare we are going to split below, see
+ * afl-laf-switch.h */
+size_t SplitComparesTransform::makeSwitchable(Module &M, unsigned bitw) {
+
+  std::vector<Instruction *> comps;
+
+  for (auto &F : M) {
+
+    if (isBlacklisted(&F)) continue;
+
+    for (auto &BB : F) {
+
+      for (auto &IN : BB) {
+
+        CmpInst *cmpInst = dyn_cast<CmpInst>(&IN);
+
+        if (!cmpInst || isLafFast(cmpInst)) continue;
+
+        Type *TyOp0 = cmpInst->getOperand(0)->getType();
+
+        if (isa<ICmpInst>(cmpInst)) {
+
+          IntegerType *intTyOp0 = dyn_cast<IntegerType>(TyOp0);
+
+          if (!intTyOp0) continue;
+
+          unsigned w = intTyOp0->getBitWidth();
+          if (w != 16 && w != 32 && w != 64) continue;
+          if (w > bitw) continue;
+
+        } else {
+
+          if (!enableFPSplit || !TyOp0->isFloatingPointTy()) continue;
+
+          CmpInst::Predicate pred = cmpInst->getPredicate();
+          if (pred == CmpInst::FCMP_FALSE || pred == CmpInst::FCMP_TRUE ||
+              pred == CmpInst::FCMP_ORD || pred == CmpInst::FCMP_UNO ||
+              pred == CmpInst::FCMP_UEQ)
+            continue;
+
+        }
+
+        comps.push_back(cmpInst);
+
+      }
+
+    }
+
+  }
+
+  for (auto &I : comps)
+    lafSwitchCompare(I);
+
+  return comps.size();
+
+}
+
 bool SplitComparesTransform::runOnModule(Module &M) {
 
   int bitw = 64;
@@ -1239,6 +1303,10 @@ bool SplitComparesTransform::runOnModule(Module &M) {
 
   enableFPSplit = getenv("AFL_LLVM_LAF_SPLIT_FLOATS") != NULL;
 
+  if (lafSwitchEnabled() && (bitw == 16 || bitw == 32 || bitw == 64))
+    errs() << "Split-compare-pass: " << makeSwitchable(M, bitw)
+           << " compares made switchable\n";
+
   simplifyCompares(M);
 
   simplifyIntSignedness(M);
@@ -51,6 +51,8 @@
 
 using namespace llvm;
 
+#include "afl-laf-switch.h"
+
 namespace {
 
 class SplitSwitchesTransform : public ModulePass {
@@ -462,7 +464,7 @@ bool SplitSwitchesTransform::splitSwitches(Module &M) {
 
       if ((switchInst = dyn_cast<SwitchInst>(BB.getTerminator()))) {
 
-        if (switchInst->getNumCases() < 1) continue;
+        if (switchInst->getNumCases() < 1 || isLafFast(switchInst)) continue;
         switches.push_back(switchInst);
 
       }
@@ -496,6 +498,14 @@ bool SplitSwitchesTransform::splitSwitches(Module &M) {
 
     }
 
+    /* keep the plain switch around for when afl-fuzz switches the site */
+    if (lafSwitchEnabled() && lafSwitchSwitch(SI)) {
+
+      CurBlock = OrigBlock = SI->getParent();
+      Default = SI->getDefaultDest();
+
+    }
+
     /* Create a new, empty default block so that the new hierarchy of
      * if-then statements go to this and the PHI nodes are happy.
      * if the default block is set as an unreachable we avoid creating one
@@ -47,6 +47,9 @@ static void *__compcov_code_start, *__compcov_code_end;
 
 static u8* __compcov_afl_map;
 
+static u32* __compcov_afl_idx;                /* BigMap index table       */
+static u32  __compcov_map_size = MAP_SIZE;
+
 static u32 __compcov_level;
 
 static int (*__libc_strcmp)(const char*, const char*);
@@ -86,6 +89,25 @@ static size_t __strlen2(const char* s1, const char* s2, size_t max_length) {
 
 }
 
+/* Look up the compact map slot of hash h, claiming one on first use. */
+
+static u32 __compcov_slot(u32 h) {
+
+  u32 slot = __compcov_afl_idx[h];
+  u32 unassigned = (u32)-1;
+
+  if (__builtin_expect(slot != (u32)-1, 1)) return slot;
+
+  slot = __atomic_fetch_add(__compcov_afl_idx, 1, __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(__compcov_afl_idx + h, &unassigned, slot, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    slot = unassigned;
+
+  return slot;
+
+}
+
 /* Identify the binary boundaries in the memory mapping */
 
 static void __compcov_load(void) {
@@ -113,12 +135,36 @@ static void __compcov_load(void) {
 
     if (__compcov_afl_map == (void*)-1) exit(1);
 
+    id_str = getenv(SHM_IDX_ENV_VAR);
+
+    if (id_str) {
+
+      __compcov_afl_idx = shmat(atoi(id_str), NULL, 0);
+
+      if (__compcov_afl_idx == (void*)-1) exit(1);
+
+      if (getenv(MAP_SIZE_ENV_VAR)) {
+
+        u32 size = atoi(getenv(MAP_SIZE_ENV_VAR));
+
+        if (size >= (1U << MAP_SIZE_POW2_MIN) &&
+            size <= (1U << MAP_SIZE_POW2_MAX) && !(size & (size - 1)))
+          __compcov_map_size = size;
+
+      }
+
+    }
+
   } else {
 
     __compcov_afl_map = calloc(1, MAP_SIZE);
 
   }
 
+  /* Without the parent's index table, every entry reads as slot 0. */
+
+  if (!__compcov_afl_idx) __compcov_afl_idx = calloc(MAP_SIZE, sizeof(u32));
+
   if (getenv("AFL_INST_LIBS")) {
 
     __compcov_code_start = (void*)0;
@@ -175,7 +221,8 @@ static void __compcov_trace(u64 cur_loc, const u8* v0, const u8* v1, size_t n) {
 
   for (i = 0; i < n && v0[i] == v1[i]; ++i) {
 
-    __compcov_afl_map[cur_loc + i]++;
+    __compcov_afl_map[__compcov_slot((cur_loc + i) &
+                                     (__compcov_map_size - 1))]++;
 
   }
 
@@ -208,7 +255,7 @@ int strcmp(const char* str1, const char* str2) {
 
       u64 cur_loc = (u64)retaddr;
       cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-      cur_loc &= MAP_SIZE - 1;
+      cur_loc &= __compcov_map_size - 1;
 
       __compcov_trace(cur_loc, str1, str2, n);
 
@@ -237,7 +284,7 @@ int strncmp(const char* str1, const char* str2, size_t len) {
 
       u64 cur_loc = (u64)retaddr;
       cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-      cur_loc &= MAP_SIZE - 1;
+      cur_loc &= __compcov_map_size - 1;
 
       __compcov_trace(cur_loc, str1, str2, n);
 
@@ -267,7 +314,7 @@ int strcasecmp(const char* str1, const char* str2) {
 
       u64 cur_loc = (u64)retaddr;
       cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-      cur_loc &= MAP_SIZE - 1;
+      cur_loc &= __compcov_map_size - 1;
 
       __compcov_trace(cur_loc, str1, str2, n);
 
@@ -298,7 +345,7 @@ int strncasecmp(const char* str1, const char* str2, size_t len) {
 
       u64 cur_loc = (u64)retaddr;
       cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-      cur_loc &= MAP_SIZE - 1;
+      cur_loc &= __compcov_map_size - 1;
 
       __compcov_trace(cur_loc, str1, str2, n);
 
@@ -326,7 +373,7 @@ int memcmp(const void* mem1, const void* mem2, size_t len) {
 
       u64 cur_loc = (u64)retaddr;
       cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-      cur_loc &= MAP_SIZE - 1;
+      cur_loc &= __compcov_map_size - 1;
 
       __compcov_trace(cur_loc, mem1, mem2, n);
 
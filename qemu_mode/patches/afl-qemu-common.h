@@ -35,6 +35,7 @@
 #define __AFL_QEMU_COMMON
 
 #include "../../config.h"
+#include "../../include/bigmap.h"
 
 #ifndef CPU_NB_REGS
 #define AFL_REGS_NUM 1000
@@ -47,7 +48,7 @@
 #if (defined(__x86_64__) || defined(__i386__)) && defined(AFL_QEMU_NOT_ZERO)
 #define INC_AFL_AREA(loc)           \
   asm volatile(                     \
-      "incb (%0, %1, 1)\n"          \
+      "addb $1, (%0, %1, 1)\n"      \
       "adcb $0, (%0, %1, 1)\n"      \
       : /* no out */                \
       : "r"(afl_area_ptr), "r"(loc) \
@@ -56,9 +57,16 @@
 #define INC_AFL_AREA(loc) afl_area_ptr[loc]++
 #endif
 
+/* BigMap: edge hashes go through the index table to a compact map slot.
+   The hash is wrapped to the map size, so compcov may use h + k freely. */
+
+#define INC_AFL_EDGE(h) INC_AFL_AREA(afl_edge_slot((h) & (afl_map_size - 1)))
+
 /* Declared in afl-qemu-cpu-inl.h */
 
 extern unsigned char *afl_area_ptr;
+extern u32 *          afl_idx_ptr;
+extern u32            afl_map_size;
 extern unsigned int   afl_inst_rms;
 extern abi_ulong      afl_start_code, afl_end_code;
 extern abi_ulong      afl_persistent_addr;
@@ -91,6 +99,21 @@ void afl_float_compcov_log_64(target_ulong cur_loc, float64 arg1, float64 arg2,
 void afl_float_compcov_log_80(target_ulong cur_loc, floatx80 arg1,
                               floatx80 arg2);
 
+/* First hit of an edge: guest threads translate and run concurrently, so
+   the slot is claimed with bigmap_claim_slot(), which also waits for an
+   entry another thread is claiming (IDX_CLAIMING). */
+
+static inline u32 afl_edge_slot(uintptr_t h) {
+
+  u32 slot = afl_idx_ptr[h];
+
+  if (unlikely(slot >= IDX_CLAIMING))
+    slot = bigmap_claim_slot(afl_idx_ptr, h, afl_map_size);
+
+  return slot;
+
+}
+
 /* Check if an address is valid in the current mapping */
 
 static inline int is_valid_addr(target_ulong addr) {
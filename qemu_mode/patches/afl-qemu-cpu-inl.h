@@ -68,6 +68,14 @@ static unsigned char
                dummy[MAP_SIZE]; /* costs MAP_SIZE but saves a few instructions */
 unsigned char *afl_area_ptr = dummy;          /* Exported for afl_gen_trace */
 
+/* BigMap index table. The dummy one reads as slot 0 for every edge, so it
+   only has to cover MAP_SIZE hashes; afl_map_size grows once we attach to
+   the parent's table. */
+
+static u32 dummy_idx[MAP_SIZE];
+u32 *      afl_idx_ptr = dummy_idx;
+u32        afl_map_size = MAP_SIZE;
+
 /* Exported variables populated by the code patched into elfload.c: */
 
 abi_ulong afl_entry_point,                      /* ELF entry point (_start) */
@@ -151,34 +159,56 @@ static inline void              tb_add_jump(TranslationBlock *tb, int n,
 
 static void afl_setup(void) {
 
-  char *id_str = getenv(SHM_ENV_VAR), *inst_r = getenv("AFL_INST_RATIO");
+  char *id_str = getenv(SHM_ENV_VAR), *inst_r = getenv("AFL_INST_RATIO"),
+       *size_str = getenv(MAP_SIZE_ENV_VAR);
 
   int shm_id;
 
-  if (inst_r) {
+  if (id_str) {
 
-    unsigned int r;
+    shm_id = atoi(id_str);
+    afl_area_ptr = shmat(shm_id, NULL, 0);
 
-    r = atoi(inst_r);
+    if (afl_area_ptr == (void *)-1) exit(1);
 
-    if (r > 100) r = 100;
-    if (!r) r = 1;
+    /* Edges land wherever the index table says. Without one, they all end
+       up in slot 0, like with the dummy table. We are not compiled for a
+       map size, so just take whatever the parent set up. */
+
+    id_str = getenv(SHM_IDX_ENV_VAR);
+
+    if (id_str) {
+
+      afl_idx_ptr = shmat(atoi(id_str), NULL, 0);
+
+      if (afl_idx_ptr == (void *)-1) exit(1);
+
+      if (size_str) {
+
+        u32 size = atoi(size_str);
+
+        if (size >= (1U << MAP_SIZE_POW2_MIN) &&
+            size <= (1U << MAP_SIZE_POW2_MAX) && !(size & (size - 1)))
+          afl_map_size = size;
 
-    afl_inst_rms = MAP_SIZE * r / 100;
+      }
+
+    }
 
   }
 
-  if (id_str) {
+  afl_inst_rms = afl_map_size;
 
-    shm_id = atoi(id_str);
-    afl_area_ptr = shmat(shm_id, NULL, 0);
+  if (inst_r) {
 
-    if (afl_area_ptr == (void *)-1) exit(1);
+    unsigned int r;
 
-    /* With AFL_INST_RATIO set to a low value, we want to touch the bitmap
-       so that the parent doesn't give up on us. */
+    r = atoi(inst_r);
 
-    if (inst_r) afl_area_ptr[0] = 1;
+    if (r > 100) r = 100;
+    if (!r) r = 1;
+
+    afl_inst_rms = afl_map_size / 100 * r;
 
   }
 
@@ -362,6 +392,16 @@ static void afl_forkserver(CPUState *cpu) {
 
 }
 
+/* Stop touching the parent's maps, e.g. while exiting. */
+
+static void afl_use_dummy_maps(void) {
+
+  afl_map_size = MAP_SIZE;
+  afl_idx_ptr = dummy_idx;
+  afl_area_ptr = dummy;
+
+}
+
 /* A simplified persistent mode handler, used as explained in README.llvm. */
 
 void afl_persistent_loop() {
@@ -380,8 +420,7 @@ void afl_persistent_loop() {
 
     if (is_persistent) {
 
-      memset(afl_area_ptr, 0, MAP_SIZE);
-      afl_area_ptr[0] = 1;
+      memset(afl_area_ptr, 0, afl_idx_ptr[0]);
       afl_prev_loc = 0;
 
     }
@@ -402,19 +441,18 @@ void afl_persistent_loop() {
           sizeof(struct afl_tsl)) {
 
         /* Exit the persistent loop on pipe error */
-        afl_area_ptr = dummy;
+        afl_use_dummy_maps();
         exit(0);
 
       }
 
       raise(SIGSTOP);
 
-      afl_area_ptr[0] = 1;
       afl_prev_loc = 0;
 
     } else {
 
-      afl_area_ptr = dummy;
+      afl_use_dummy_maps();
       exit(0);
 
     }
@@ -40,7 +40,7 @@ static void afl_compcov_log_16(target_ulong cur_loc, target_ulong arg1,
 
   register uintptr_t idx = cur_loc;
 
-  if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(idx); }
+  if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(idx); }
 
 }
 
@@ -51,11 +51,11 @@ static void afl_compcov_log_32(target_ulong cur_loc, target_ulong arg1,
 
   if ((arg1 & 0xff000000) == (arg2 & 0xff000000)) {
 
-    INC_AFL_AREA(idx + 2);
+    INC_AFL_EDGE(idx + 2);
     if ((arg1 & 0xff0000) == (arg2 & 0xff0000)) {
 
-      INC_AFL_AREA(idx + 1);
-      if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(idx); }
+      INC_AFL_EDGE(idx + 1);
+      if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(idx); }
 
     }
 
@@ -70,23 +70,23 @@ static void afl_compcov_log_64(target_ulong cur_loc, target_ulong arg1,
 
   if ((arg1 & 0xff00000000000000) == (arg2 & 0xff00000000000000)) {
 
-    INC_AFL_AREA(idx + 6);
+    INC_AFL_EDGE(idx + 6);
     if ((arg1 & 0xff000000000000) == (arg2 & 0xff000000000000)) {
 
-      INC_AFL_AREA(idx + 5);
+      INC_AFL_EDGE(idx + 5);
       if ((arg1 & 0xff0000000000) == (arg2 & 0xff0000000000)) {
 
-        INC_AFL_AREA(idx + 4);
+        INC_AFL_EDGE(idx + 4);
         if ((arg1 & 0xff00000000) == (arg2 & 0xff00000000)) {
 
-          INC_AFL_AREA(idx + 3);
+          INC_AFL_EDGE(idx + 3);
           if ((arg1 & 0xff000000) == (arg2 & 0xff000000)) {
 
-            INC_AFL_AREA(idx + 2);
+            INC_AFL_EDGE(idx + 2);
             if ((arg1 & 0xff0000) == (arg2 & 0xff0000)) {
 
-              INC_AFL_AREA(idx + 1);
-              if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(idx); }
+              INC_AFL_EDGE(idx + 1);
+              if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(idx); }
 
             }
 
@@ -122,7 +122,7 @@ static void afl_gen_compcov(target_ulong cur_loc, TCGv_i64 arg1, TCGv_i64 arg2,
   }
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 7;
+  cur_loc &= afl_map_size - 7;
 
   if (cur_loc >= afl_inst_rms) return;
 
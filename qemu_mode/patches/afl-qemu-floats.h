@@ -67,7 +67,7 @@ void afl_float_compcov_log_32(target_ulong cur_loc, float32 arg1, float32 arg2,
                               void* status) {
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 7;
+  cur_loc &= afl_map_size - 7;
 
   if (cur_loc >= afl_inst_rms) return;
 
@@ -82,14 +82,14 @@ void afl_float_compcov_log_32(target_ulong cur_loc, float32 arg1, float32 arg2,
   register uintptr_t idx = cur_loc;
 
   if (a.sign != b.sign) return;
-  INC_AFL_AREA(idx);
+  INC_AFL_EDGE(idx);
   if (a.exp != b.exp) return;
-  INC_AFL_AREA(idx + 1);
+  INC_AFL_EDGE(idx + 1);
 
   if ((a.frac & 0xff0000) == (b.frac & 0xff0000)) {
 
-    INC_AFL_AREA(idx + 2);
-    if ((a.frac & 0xff00) == (b.frac & 0xff00)) { INC_AFL_AREA(idx + 3); }
+    INC_AFL_EDGE(idx + 2);
+    if ((a.frac & 0xff00) == (b.frac & 0xff00)) { INC_AFL_EDGE(idx + 3); }
 
   }
 
@@ -99,7 +99,7 @@ void afl_float_compcov_log_64(target_ulong cur_loc, float64 arg1, float64 arg2,
                               void* status) {
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 7;
+  cur_loc &= afl_map_size - 7;
 
   if (cur_loc >= afl_inst_rms) return;
 
@@ -113,30 +113,30 @@ void afl_float_compcov_log_64(target_ulong cur_loc, float64 arg1, float64 arg2,
 
   register uintptr_t idx = cur_loc;
 
-  if (a.sign == b.sign) INC_AFL_AREA(idx);
+  if (a.sign == b.sign) INC_AFL_EDGE(idx);
   if ((a.exp & 0xff00) == (b.exp & 0xff00)) {
 
-    INC_AFL_AREA(idx + 1);
-    if ((a.exp & 0xff) == (b.exp & 0xff)) INC_AFL_AREA(idx + 2);
+    INC_AFL_EDGE(idx + 1);
+    if ((a.exp & 0xff) == (b.exp & 0xff)) INC_AFL_EDGE(idx + 2);
 
   }
 
   if ((a.frac & 0xff000000000000) == (b.frac & 0xff000000000000)) {
 
-    INC_AFL_AREA(idx + 3);
+    INC_AFL_EDGE(idx + 3);
     if ((a.frac & 0xff0000000000) == (b.frac & 0xff0000000000)) {
 
-      INC_AFL_AREA(idx + 4);
+      INC_AFL_EDGE(idx + 4);
       if ((a.frac & 0xff00000000) == (b.frac & 0xff00000000)) {
 
-        INC_AFL_AREA(idx + 5);
+        INC_AFL_EDGE(idx + 5);
         if ((a.frac & 0xff000000) == (b.frac & 0xff000000)) {
 
-          INC_AFL_AREA(idx + 6);
+          INC_AFL_EDGE(idx + 6);
           if ((a.frac & 0xff0000) == (b.frac & 0xff0000)) {
 
-            INC_AFL_AREA(idx + 7);
-            if ((a.frac & 0xff00) == (b.frac & 0xff00)) INC_AFL_AREA(idx + 8);
+            INC_AFL_EDGE(idx + 7);
+            if ((a.frac & 0xff00) == (b.frac & 0xff00)) INC_AFL_EDGE(idx + 8);
 
           }
 
@@ -154,7 +154,7 @@ void afl_float_compcov_log_80(target_ulong cur_loc, floatx80 arg1,
                               floatx80 arg2) {
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 7;
+  cur_loc &= afl_map_size - 7;
 
   if (cur_loc >= afl_inst_rms) return;
 
@@ -172,38 +172,38 @@ void afl_float_compcov_log_80(target_ulong cur_loc, floatx80 arg1,
 
   register uintptr_t idx = cur_loc;
 
-  if (a_sign == b_sign) INC_AFL_AREA(idx);
+  if (a_sign == b_sign) INC_AFL_EDGE(idx);
 
   if ((arg1.high & 0x7f00) == (arg2.high & 0x7f00)) {
 
-    INC_AFL_AREA(idx + 1);
-    if ((arg1.high & 0xff) == (arg2.high & 0xff)) INC_AFL_AREA(idx + 2);
+    INC_AFL_EDGE(idx + 1);
+    if ((arg1.high & 0xff) == (arg2.high & 0xff)) INC_AFL_EDGE(idx + 2);
 
   }
 
   if ((arg1.low & 0xff00000000000000) == (arg2.low & 0xff00000000000000)) {
 
-    INC_AFL_AREA(idx + 3);
+    INC_AFL_EDGE(idx + 3);
     if ((arg1.low & 0xff000000000000) == (arg2.low & 0xff000000000000)) {
 
-      INC_AFL_AREA(idx + 4);
+      INC_AFL_EDGE(idx + 4);
       if ((arg1.low & 0xff0000000000) == (arg2.low & 0xff0000000000)) {
 
-        INC_AFL_AREA(idx + 5);
+        INC_AFL_EDGE(idx + 5);
         if ((arg1.low & 0xff00000000) == (arg2.low & 0xff00000000)) {
 
-          INC_AFL_AREA(idx + 6);
+          INC_AFL_EDGE(idx + 6);
           if ((arg1.low & 0xff000000) == (arg2.low & 0xff000000)) {
 
-            INC_AFL_AREA(idx + 7);
+            INC_AFL_EDGE(idx + 7);
             if ((arg1.low & 0xff0000) == (arg2.low & 0xff0000)) {
 
-              INC_AFL_AREA(idx + 8);
+              INC_AFL_EDGE(idx + 8);
               if ((arg1.low & 0xff00) == (arg2.low & 0xff00)) {
 
-                INC_AFL_AREA(idx + 9);
+                INC_AFL_EDGE(idx + 9);
                 // if ((arg1.low & 0xff) == (arg2.low & 0xff))
-                //  INC_AFL_AREA(idx + 10);
+                //  INC_AFL_EDGE(idx + 10);
 
               }
 
@@ -38,7 +38,7 @@ void afl_maybe_log(target_ulong cur_loc) {
 
   register uintptr_t afl_idx = cur_loc ^ afl_prev_loc;
 
-  INC_AFL_AREA(afl_idx);
+  INC_AFL_EDGE(afl_idx);
 
   afl_prev_loc = cur_loc >> 1;
 
@@ -60,7 +60,7 @@ static void afl_gen_trace(target_ulong cur_loc) {
      the value to get something quasi-uniform. */
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 1;
+  cur_loc &= afl_map_size - 1;
 
   /* Implement probabilistic instrumentation by looking at scrambled block
      address. This keeps the instrumented locations stable across runs. */
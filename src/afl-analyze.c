@@ -116,7 +116,7 @@ static u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -145,7 +145,7 @@ static void classify_counts(u8* mem) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i = (MAP_SIZE >> 2);
+  u32  i = (map_size >> 2);
 
   while (i--)
     if (*(ptr++)) return 1;
@@ -227,7 +227,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -302,6 +302,10 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
     FATAL("Unable to execute '%s'", argv[0]);
 
+  if (*(u32*)trace_bits == MAP_SIZE_FAIL_SIG)
+    FATAL("Target needs a map of 2^%u entries, set AFL_MAP_SIZE_POW2=%u",
+          ((u32*)trace_bits)[1], ((u32*)trace_bits)[1]);
+
   classify_counts(trace_bits);
   total_execs++;
 
@@ -321,7 +325,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   /* We don't actually care if the target is crashing or not,
      except that when it does, the checksum should be different. */
@@ -987,6 +991,7 @@ int main(int argc, char** argv) {
 
   use_hex_offsets = !!getenv("AFL_ANALYZE_HEX");
 
+  init_map_size();
   setup_shm(0);
   atexit(at_exit_handler);
   setup_signal_handlers();
@@ -994,6 +999,7 @@ int main(int argc, char** argv) {
   set_up_environment();
 
   find_binary(argv[optind]);
+  fit_map_size(target_path);
   detect_file_args(argv + optind, prog_in);
 
   if (qemu_mode) {
@@ -65,7 +65,9 @@ static u8 be_quiet,                 /* Quiet mode (no stderr output)        */
     sanitizer;                      /* Using ASAN / MSAN                    */
 
 static u32 inst_ratio = 100,        /* Instrumentation probability (%)      */
-    as_par_cnt = 1;                 /* Number of params to 'as'             */
+    as_par_cnt = 1,                 /* Number of params to 'as'             */
+    map_pow2 = MAP_SIZE_POW2,       /* Map size the IDs are drawn for       */
+    map_size = MAP_SIZE;            /* 1 << map_pow2                        */
 
 /* If we don't find --32 or --64 in the command line, default to
    instrumentation for whichever mode we were compiled with. This is not
@@ -276,7 +278,7 @@ static void add_instrumentation(void) {
         instrument_next && line[0] == '\t' && isalpha(line[1])) {
 
       fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-              R(MAP_SIZE));
+              R(map_size));
 
       instrument_next = 0;
       ins_lines++;
@@ -387,7 +389,7 @@ static void add_instrumentation(void) {
       if (line[1] == 'j' && line[2] != 'm' && R(100) < inst_ratio) {
 
         fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-                R(MAP_SIZE));
+                R(map_size));
 
         ins_lines++;
 
@@ -468,7 +470,12 @@ static void add_instrumentation(void) {
 
   }
 
-  if (ins_lines) fputs(use_64bit ? main_payload_64 : main_payload_32, outf);
+  if (ins_lines) {
+
+    fputs(use_64bit ? main_payload_64 : main_payload_32, outf);
+    fprintf(outf, map_size_rec_fmt, map_pow2);
+
+  }
 
   if (input_file) fclose(inf);
   fclose(outf);
@@ -497,6 +504,7 @@ int main(int argc, char** argv) {
   u32 rand_seed;
   int status;
   u8* inst_ratio_str = getenv("AFL_INST_RATIO");
+  u8* map_pow2_str = getenv("AFL_MAP_SIZE_POW2");
 
   struct timeval  tv;
   struct timezone tz;
@@ -546,6 +554,23 @@ int main(int argc, char** argv) {
 
   }
 
+  if (map_pow2_str) {
+
+    if (sscanf(map_pow2_str, "%u", &map_pow2) != 1 ||
+        map_pow2 < MAP_SIZE_POW2_MIN || map_pow2 > MAP_SIZE_POW2_MAX)
+      FATAL("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)",
+            MAP_SIZE_POW2_MIN, MAP_SIZE_POW2_MAX);
+
+#ifdef __APPLE__
+    /* No section bounds to collect the map size records with. */
+    if (map_pow2 != MAP_SIZE_POW2)
+      FATAL("AFL_MAP_SIZE_POW2 is not supported by afl-as on this platform");
+#endif                                                        /* __APPLE__ */
+
+    map_size = 1U << map_pow2;
+
+  }
+
   if (getenv(AS_LOOP_ENV_VAR))
     FATAL("Endless loop when calling 'as' (remove '.' from your PATH)");
 
@@ -28,6 +28,7 @@
 #include "types.h"
 #include "debug.h"
 #include "forkserver.h"
+#include "sharedmem.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -58,6 +59,10 @@ extern FILE *plot_file;
 /* we need this internally but can be defined and read extern in the main source
  */
 u8 child_timed_out;
+u8 touch_log_on;                        /* Target fills the touch log?      */
+u8 dirty_map_on;                        /* Target marks dirty map lines?    */
+u8 shm_fuzz_on;                         /* Target reads test cases from SHM?*/
+u8 batch_on;                            /* ...and runs them in batches?     */
 
 /* Describe integer as memory size. */
 
@@ -311,6 +316,69 @@ void init_forkserver(char **argv) {
 
   if (rlen == 4) {
 
+    /* BigMap runtimes announce the map size they were built for. If it is
+       not what we set up, the target is running on private scratch maps, so
+       resize the SHM regions and start over. This is only honored when the
+       target actually gets our SHM (i.e., not in dumb mode). */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_MAPSIZE) && getenv(SHM_ENV_VAR)) {
+
+      u32 pow2 = FS_OPT_GET_MAPSIZE(status);
+
+      if (pow2 < MAP_SIZE_POW2_MIN || pow2 > MAP_SIZE_POW2_MAX)
+        FATAL("Target requested an unsupported map size (2^%u)", pow2);
+
+      if ((1U << pow2) != map_size) {
+
+        ACTF("Target wants %u map slots (we have %u), restarting...",
+             1U << pow2, map_size);
+
+        kill(forksrv_pid, SIGKILL);
+        if (waitpid(forksrv_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+        close(fsrv_ctl_fd);
+        close(fsrv_st_fd);
+
+        resize_shm(1U << pow2);
+        init_forkserver(argv);
+        return;
+
+      }
+
+    }
+
+    /* Targets built with AFL_TOUCH_LOG log the slots they touch, which lets
+       afl-fuzz skip the rest of the map after each exec. */
+
+    touch_log_on = (status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+                   (status & FS_OPT_TOUCHLOG) && touch_log;
+    dirty_map_on = (status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+                   (status & FS_OPT_DIRTYMAP) && dirty_map;
+
+    /* Harnesses built with __AFL_FUZZ_INIT() that got our test case buffer
+       read from it rather than from the file or stdin. */
+
+    shm_fuzz_on = (status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+                  (status & FS_OPT_SHDMEM_FUZZ) && shm_fuzz_buf;
+
+    if (shm_fuzz_on) OKF("Target takes its test cases from shared memory.");
+
+    /* Persistent ones among them also attach the batch region. */
+
+    batch_on = shm_fuzz_on && (status & FS_OPT_BATCH) && fuzz_batch;
+
+    if (batch_on)
+      OKF("Target runs up to %u test cases per round trip.", shm_batch_size);
+
+    /* With AFL_SNAPSHOT, targets that can restore their memory say so. */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_SNAPSHOT))
+      OKF("Target restores its dirty pages instead of forking.");
+    else if (getenv(SNAPSHOT_ENV_VAR))
+      WARNF("AFL_SNAPSHOT is set, but the target does not take snapshots.");
+
     OKF("All right - fork server is up.");
     return;
 
@@ -25,41 +25,951 @@
 
 #include "afl-fuzz.h"
 
+static u32 trace_cksum_cached;         /* Checksum of the classified trace  */
+static u8  trace_hits_virgin;          /* Trace overlaps virgin_bits?       */
+static u32 trace_nonzero;              /* Non-zero slots, if trace_sparse   */
+
+/* Allocate the host-side maps. This has to wait until the forkserver
+   handshake is done, since the target may ask for a map size other than
+   the default. */
+
+void setup_bitmaps(void) {
+
+  virgin_bits = ck_alloc_nozero(map_size);
+  virgin_tmout = ck_alloc_nozero(map_size);
+  virgin_crash = ck_alloc_nozero(map_size);
+  var_bytes = ck_alloc(map_size);
+  top_rated = ck_alloc(map_size * sizeof(struct queue_entry*));
+
+  if (in_bitmap)
+    read_bitmap(in_bitmap);
+  else
+    memset(virgin_bits, 255, map_size);
+
+  memset(virgin_tmout, 255, map_size);
+  memset(virgin_crash, 255, map_size);
+
+  if (shared_virgin) global_virgin = setup_shared_virgin();
+
+}
+
+/* A saved index table (fuzz_bitmap.idx) starts with this header. The slots
+   it hands out are only good for the binary that claimed them, at the map
+   size it was built for, so both are recorded and checked on load. */
+
+#define IDX_TABLE_MAGIC 0x58444941              /* "AIDX"                    */
+
+struct idx_table_hdr {
+
+  u32 magic;                            /* IDX_TABLE_MAGIC                  */
+  u32 map_pow2;                         /* Map size of the table, as pow2   */
+  u32 target_hash;                      /* hash32() of the target binary    */
+  u32 reserved;
+
+};
+
+static u32 idx_table_loaded;           /* Size of the table we loaded      */
+
+/* Hash the target binary, once. */
+
+static u32 hash_target(void) {
+
+  static u32 cksum;
+  static u8  done;
+
+  struct stat st;
+  u8*         data;
+  s32         fd;
+
+  if (done) return cksum;
+  done = 1;
+
+  fd = open(target_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) PFATAL("Unable to open '%s'", target_path);
+
+  if (st.st_size) {
+
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) PFATAL("Unable to mmap file '%s'", target_path);
+
+    cksum = hash32(data, st.st_size, HASH_CONST);
+    munmap(data, st.st_size);
+
+  }
+
+  close(fd);
+  return cksum;
+
+}
+
 /* Write bitmap to file. The bitmap is useful mostly for the secret
    -B option, to focus a separate fuzzing session on a particular
    interesting input without rediscovering all the others. */
 
-void write_bitmap(void) {
+void write_bitmap(void) {
+
+  struct idx_table_hdr hdr;
+
+  u8* fname;
+  s32 fd;
+
+  if (!bitmap_changed) return;
+  bitmap_changed = 0;
+
+  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  ck_write(fd, virgin_bits, map_size, fname);
+
+  close(fd);
+  ck_free(fname);
+
+  /* The bitmap is indexed by compact slot, so it is only meaningful together
+     with the index table that handed out those slots. trace_idx[0] is the
+     slot counter and gets saved along with the rest. */
+
+  if (!trace_idx) return;
+
+  fname = alloc_printf("%s/fuzz_bitmap.idx", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  hdr.magic = IDX_TABLE_MAGIC;
+  hdr.map_pow2 = __builtin_ctz(map_size);
+  hdr.target_hash = hash_target();
+  hdr.reserved = 0;
+
+  ck_write(fd, &hdr, sizeof(hdr), fname);
+  ck_write(fd, trace_idx, map_size * sizeof(u32), fname);
+
+  close(fd);
+  ck_free(fname);
+
+}
+
+/* Load a saved index table into the SHM region, so that the target keeps
+   handing out the same compact slots it did in the earlier session. Must be
+   called before the forkserver starts. Returns 0 if there is no table, or
+   if it was saved for some other binary. */
+
+u8 read_index_table(u8* fname) {
+
+  struct idx_table_hdr hdr;
+  struct stat          st;
+
+  s32 fd = open(fname, O_RDONLY);
+
+  if (fd < 0) {
+
+    if (errno != ENOENT) PFATAL("Unable to open '%s'", fname);
+    return 0;
+
+  }
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size < sizeof(hdr)) FATAL("Index table '%s' is corrupted", fname);
+
+  ck_read(fd, &hdr, sizeof(hdr), fname);
+
+  if (hdr.magic != IDX_TABLE_MAGIC) {
+
+    WARNF("Index table '%s' is in an old format, ignoring it.", fname);
+    close(fd);
+    return 0;
+
+  }
+
+  if (hdr.map_pow2 < MAP_SIZE_POW2_MIN || hdr.map_pow2 > MAP_SIZE_POW2_MAX ||
+      st.st_size != sizeof(hdr) + (sizeof(u32) << hdr.map_pow2))
+    FATAL("Index table '%s' is corrupted", fname);
+
+  if (hdr.target_hash != hash_target()) {
+
+    WARNF("Index table '%s' was saved for a different binary, ignoring it.",
+          fname);
+    close(fd);
+    return 0;
+
+  }
+
+  if ((1U << hdr.map_pow2) != map_size) resize_shm(1U << hdr.map_pow2);
+
+  ck_read(fd, trace_idx, map_size * sizeof(u32), fname);
+
+  close(fd);
+
+  /* The counter runs past the map once slots are clamped to it. */
+
+  map_used = MIN(((trace_idx[0] + 63) / 64) * 64, map_size);
+  idx_table_loaded = map_size;
+
+  return 1;
+
+}
+
+/* The forkserver handshake may have asked for another map size than the
+   loaded table has, and resize_shm() starts over with a fresh one. */
+
+void check_index_table(void) {
+
+  if (idx_table_loaded && idx_table_loaded != map_size)
+    WARNF("Target wants %u map slots, but the index table has %u, dropped "
+          "it.", map_size, idx_table_loaded);
+
+}
+
+/* Figure out whether there is an index table to pick up: the one next to the
+   -B bitmap, or the one from the session we are resuming. */
+
+void load_index_table(void) {
+
+  u8* fn;
+
+  /* Somebody else is already using the shared table, leave it alone. */
+
+  if (!trace_idx || (shared_idx_dir && !shared_idx_fresh)) return;
+
+  if (in_bitmap)
+    fn = alloc_printf("%s.idx", in_bitmap);
+  else if (in_place_resume)
+    fn = alloc_printf("%s/fuzz_bitmap.idx", out_dir);
+  else if (resuming_fuzz)
+    fn = alloc_printf("%s/../fuzz_bitmap.idx", in_dir);
+  else
+    return;
+
+  if (read_index_table(fn))
+    OKF("Loaded index table with %u used slots from '%s'.", trace_idx[0], fn);
+  else if (in_bitmap)
+    WARNF("No usable index table next to '%s', the bitmap will not line "
+          "up!", in_bitmap);
+
+  ck_free(fn);
+
+}
+
+/* Read bitmap from file. This is for the -B option again. */
+
+void read_bitmap(u8* fname) {
+
+  struct stat st;
+  s32         fd = open(fname, O_RDONLY);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size != map_size)
+    FATAL("Bitmap '%s' does not match the target's map size (%u bytes)",
+          fname, map_size);
+
+  ck_read(fd, virgin_bits, map_size, fname);
+
+  close(fd);
+
+}
+
+/* Vectorized versions of the per-exec bitmap routines below. The build may
+   well target a baseline x86-64, so the kernels carry their own target
+   attributes and init_bitmap_kernels() picks the widest set the CPU
+   supports. map_used is always a multiple of 64, so every kernel can walk
+   the map in full vectors. The host-side maps come from ck_alloc() and are
+   not vector-aligned, hence the unaligned loads. The scalar code stays as
+   the fallback. */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <immintrin.h>
+
+#define HAVE_BITMAP_SIMD
+
+static u8 (*has_new_bits_vec)(u8*, u8*, u32);
+static void (*classify_counts_vec)(u8*, u32);
+static u32 (*count_bytes_vec)(u8*, u32);
+static u32 (*count_non_255_bytes_vec)(u8*, u32);
+static void (*simplify_trace_vec)(u8*, u32);
+static void (*minimize_bits_vec)(u8*, u8*, u32);
+static u8 (*classify_scan_vec)(u8*, u8*, u32, u32*);
+
+/* Bucket lookups for classify_counts(), split by nibble so they fit in a
+   shuffle: bytes below 16 map through the low table, the rest through the
+   high table indexed by the upper nibble. */
+
+#define CLASS_LUT_LO \
+  0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+#define CLASS_LUT_HI \
+  0, 32, 64, 64, 64, 64, 64, 64, 128, 128, 128, 128, 128, 128, 128, 128
+
+/* SSE4.2 */
+
+__attribute__((target("sse4.2"))) static u8 has_new_bits_sse42(u8* cur,
+                                                                u8* vir,
+                                                                u32 len) {
+
+  __m128i ones = _mm_set1_epi8(-1), zero = _mm_setzero_si128();
+  u8      ret = 0;
+  u32     i;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i c = _mm_loadu_si128((__m128i*)(cur + i));
+    __m128i v = _mm_loadu_si128((__m128i*)(vir + i));
+
+    if (likely(_mm_testz_si128(c, v))) continue;
+
+    if (likely(ret < 2)) {
+
+      __m128i fresh = _mm_andnot_si128(_mm_cmpeq_epi8(c, zero),
+                                       _mm_cmpeq_epi8(v, ones));
+      ret = _mm_testz_si128(fresh, fresh) ? 1 : 2;
+
+    }
+
+    _mm_storeu_si128((__m128i*)(vir + i), _mm_andnot_si128(c, v));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("sse4.2"))) static void classify_counts_sse42(u8* mem,
+                                                                    u32 len) {
+
+  __m128i lut_lo = _mm_setr_epi8(CLASS_LUT_LO);
+  __m128i lut_hi = _mm_setr_epi8(CLASS_LUT_HI);
+  __m128i nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+  u32     i;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(mem + i));
+
+    if (likely(_mm_testz_si128(v, v))) continue;
+
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+    __m128i r_lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, nib));
+    __m128i r_hi = _mm_shuffle_epi8(lut_hi, hi);
+
+    _mm_storeu_si128((__m128i*)(mem + i),
+                    _mm_blendv_epi8(r_hi, r_lo, _mm_cmpeq_epi8(hi, zero)));
+
+  }
+
+}
+
+__attribute__((target("sse4.2,popcnt"))) static u32 count_bytes_sse42(u8* mem,
+                                                                      u32 len) {
+
+  __m128i zero = _mm_setzero_si128();
+  u32     i, ret = 0;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(mem + i));
+
+    if (likely(_mm_testz_si128(v, v))) continue;
+    ret += 16 - _mm_popcnt_u32(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("sse4.2,popcnt"))) static u32 count_non_255_bytes_sse42(
+    u8* mem, u32 len) {
+
+  __m128i ones = _mm_set1_epi8(-1);
+  u32     i, ret = 0;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(mem + i));
+    ret += 16 - _mm_popcnt_u32(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("sse4.2"))) static void simplify_trace_sse42(u8* mem,
+                                                                   u32 len) {
+
+  __m128i hit = _mm_set1_epi8(0x80), miss = _mm_set1_epi8(1);
+  __m128i zero = _mm_setzero_si128();
+  u32     i;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(mem + i));
+    _mm_storeu_si128((__m128i*)(mem + i),
+                    _mm_blendv_epi8(hit, miss, _mm_cmpeq_epi8(v, zero)));
+
+  }
+
+}
+
+__attribute__((target("sse4.2"))) static void minimize_bits_sse42(u8* dst,
+                                                                  u8* src,
+                                                                  u32 len) {
+
+  __m128i zero = _mm_setzero_si128();
+  u32     i;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(src + i));
+    u16     m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+    if (m) *(u16*)(dst + (i >> 3)) |= m;
+
+  }
+
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2"))) static u8 has_new_bits_avx2(u8* cur, u8* vir,
+                                                             u32 len) {
+
+  __m256i ones = _mm256_set1_epi8(-1), zero = _mm256_setzero_si256();
+  u8      ret = 0;
+  u32     i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i c = _mm256_loadu_si256((__m256i*)(cur + i));
+    __m256i v = _mm256_loadu_si256((__m256i*)(vir + i));
+
+    if (likely(_mm256_testz_si256(c, v))) continue;
+
+    if (likely(ret < 2)) {
+
+      __m256i fresh = _mm256_andnot_si256(_mm256_cmpeq_epi8(c, zero),
+                                          _mm256_cmpeq_epi8(v, ones));
+      ret = _mm256_testz_si256(fresh, fresh) ? 1 : 2;
+
+    }
+
+    _mm256_storeu_si256((__m256i*)(vir + i), _mm256_andnot_si256(c, v));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("avx2"))) static void classify_counts_avx2(u8* mem,
+                                                                 u32 len) {
+
+  __m256i lut_lo = _mm256_setr_epi8(CLASS_LUT_LO, CLASS_LUT_LO);
+  __m256i lut_hi = _mm256_setr_epi8(CLASS_LUT_HI, CLASS_LUT_HI);
+  __m256i nib = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+  u32     i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+    __m256i r_lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, nib));
+    __m256i r_hi = _mm256_shuffle_epi8(lut_hi, hi);
+
+    _mm256_storeu_si256(
+        (__m256i*)(mem + i),
+        _mm256_blendv_epi8(r_hi, r_lo, _mm256_cmpeq_epi8(hi, zero)));
+
+  }
+
+}
+
+__attribute__((target("avx2,popcnt"))) static u32 count_bytes_avx2(u8* mem,
+                                                                   u32 len) {
+
+  __m256i zero = _mm256_setzero_si256();
+  u32     i, ret = 0;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+    ret += 32 - _mm_popcnt_u32(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("avx2,popcnt"))) static u32 count_non_255_bytes_avx2(
+    u8* mem, u32 len) {
+
+  __m256i ones = _mm256_set1_epi8(-1);
+  u32     i, ret = 0;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+    ret += 32 - _mm_popcnt_u32(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target("avx2"))) static void simplify_trace_avx2(u8* mem,
+                                                                u32 len) {
+
+  __m256i hit = _mm256_set1_epi8(0x80), miss = _mm256_set1_epi8(1);
+  __m256i zero = _mm256_setzero_si256();
+  u32     i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+    _mm256_storeu_si256((__m256i*)(mem + i),
+                       _mm256_blendv_epi8(hit, miss, _mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+}
+
+__attribute__((target("avx2"))) static void minimize_bits_avx2(u8* dst,
+                                                               u8* src,
+                                                               u32 len) {
+
+  __m256i zero = _mm256_setzero_si256();
+  u32     i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(src + i));
+    u32     m = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+
+    if (m) *(u32*)(dst + (i >> 3)) |= m;
+
+  }
+
+}
+
+/* AVX-512 (BW) */
+
+#define AVX512_TARGET "avx512f,avx512bw,popcnt"
+
+__attribute__((target(AVX512_TARGET))) static u8 has_new_bits_avx512(u8* cur,
+                                                                     u8* vir,
+                                                                     u32 len) {
+
+  __m512i ones = _mm512_set1_epi8(-1);
+  u8      ret = 0;
+  u32     i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i c = _mm512_loadu_si512(cur + i);
+    __m512i v = _mm512_loadu_si512(vir + i);
+
+    if (likely(!_mm512_test_epi64_mask(c, v))) continue;
+
+    if (likely(ret < 2))
+      ret = (_mm512_test_epi8_mask(c, c) & _mm512_cmpeq_epi8_mask(v, ones))
+                ? 2
+                : 1;
+
+    _mm512_storeu_si512(vir + i, _mm512_andnot_si512(c, v));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target(AVX512_TARGET))) static void classify_counts_avx512(
+    u8* mem, u32 len) {
+
+  __m512i lut_lo = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_LO));
+  __m512i lut_hi = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_HI));
+  __m512i nib = _mm512_set1_epi8(0x0f);
+  u32     i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+
+    if (likely(!_mm512_test_epi64_mask(v, v))) continue;
+
+    __m512i   hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), nib);
+    __m512i   r_lo = _mm512_shuffle_epi8(lut_lo, _mm512_and_si512(v, nib));
+    __mmask64 big = _mm512_test_epi8_mask(hi, hi);
+
+    _mm512_storeu_si512(mem + i, _mm512_mask_shuffle_epi8(r_lo, big, lut_hi, hi));
+
+  }
+
+}
+
+__attribute__((target(AVX512_TARGET))) static u32 count_bytes_avx512(u8* mem,
+                                                                     u32 len) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+    ret += _mm_popcnt_u64(_mm512_test_epi8_mask(v, v));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target(AVX512_TARGET))) static u32 count_non_255_bytes_avx512(
+    u8* mem, u32 len) {
+
+  __m512i ones = _mm512_set1_epi8(-1);
+  u32     i, ret = 0;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+    ret += _mm_popcnt_u64(_mm512_cmpneq_epi8_mask(v, ones));
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((target(AVX512_TARGET))) static void simplify_trace_avx512(
+    u8* mem, u32 len) {
+
+  __m512i hit = _mm512_set1_epi8(0x80), miss = _mm512_set1_epi8(1);
+  u32     i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+    _mm512_storeu_si512(mem + i, _mm512_mask_blend_epi8(
+                                    _mm512_test_epi8_mask(v, v), miss, hit));
+
+  }
+
+}
+
+__attribute__((target(AVX512_TARGET))) static void minimize_bits_avx512(
+    u8* dst, u8* src, u32 len) {
 
-  u8* fname;
-  s32 fd;
+  u32 i;
 
-  if (!bitmap_changed) return;
-  bitmap_changed = 0;
+  for (i = 0; i < len; i += 64) {
 
-  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
-  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    __m512i v = _mm512_loadu_si512(src + i);
+    u64     m = _mm512_test_epi8_mask(v, v);
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+    if (m) *(u64*)(dst + (i >> 3)) |= m;
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  }
 
-  close(fd);
-  ck_free(fname);
+}
+
+/* Fused post-exec pass: bucket the counts in place, note whether any of
+   them hit the virgin map, and compute the same checksum hash32() would,
+   all while the line is still in L1. The virgin map is only read; if the
+   result is zero, has_new_bits(virgin_bits) can skip its own pass. The
+   checksum has to match hash32() bit for bit, including the order of the
+   crc32 operands, since cached and freshly computed sums get compared. */
+
+#define CKSUM_STEP(_p)                \
+  do {                                \
+                                      \
+    u64 _w = *(u64*)(_p);             \
+    cur = _mm_crc32_u64(_w, cur);     \
+    if (_w) crc = cur;                \
+                                      \
+  } while (0)
+
+__attribute__((target("sse4.2"))) static u8 classify_scan_sse42(u8* mem,
+                                                                u8* vir,
+                                                                u32 len,
+                                                                u32* cksum) {
+
+  __m128i lut_lo = _mm_setr_epi8(CLASS_LUT_LO);
+  __m128i lut_hi = _mm_setr_epi8(CLASS_LUT_HI);
+  __m128i nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+  u64     crc = HASH_CONST, cur = HASH_CONST;
+  u8      ret = 0;
+  u32     i;
+
+  for (i = 0; i < len; i += 16) {
+
+    __m128i v = _mm_loadu_si128((__m128i*)(mem + i));
+
+    if (unlikely(!_mm_testz_si128(v, v))) {
+
+      __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+      __m128i r_lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, nib));
+      __m128i r_hi = _mm_shuffle_epi8(lut_hi, hi);
+
+      v = _mm_blendv_epi8(r_hi, r_lo, _mm_cmpeq_epi8(hi, zero));
+      _mm_storeu_si128((__m128i*)(mem + i), v);
+
+      if (!_mm_testz_si128(v, _mm_loadu_si128((__m128i*)(vir + i)))) ret = 1;
+
+    }
+
+    CKSUM_STEP(mem + i);
+    CKSUM_STEP(mem + i + 8);
+
+  }
+
+  *cksum = crc;
+  return ret;
 
 }
 
-/* Read bitmap from file. This is for the -B option again. */
+__attribute__((target("avx2"))) static u8 classify_scan_avx2(u8* mem, u8* vir,
+                                                             u32  len,
+                                                             u32* cksum) {
 
-void read_bitmap(u8* fname) {
+  __m256i lut_lo = _mm256_setr_epi8(CLASS_LUT_LO, CLASS_LUT_LO);
+  __m256i lut_hi = _mm256_setr_epi8(CLASS_LUT_HI, CLASS_LUT_HI);
+  __m256i nib = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+  u64     crc = HASH_CONST, cur = HASH_CONST;
+  u8      ret = 0;
+  u32     i;
 
-  s32 fd = open(fname, O_RDONLY);
+  for (i = 0; i < len; i += 32) {
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+    if (unlikely(!_mm256_testz_si256(v, v))) {
 
-  close(fd);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+      __m256i r_lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, nib));
+      __m256i r_hi = _mm256_shuffle_epi8(lut_hi, hi);
+
+      v = _mm256_blendv_epi8(r_hi, r_lo, _mm256_cmpeq_epi8(hi, zero));
+      _mm256_storeu_si256((__m256i*)(mem + i), v);
+
+      if (!_mm256_testz_si256(v, _mm256_loadu_si256((__m256i*)(vir + i))))
+        ret = 1;
+
+    }
+
+    CKSUM_STEP(mem + i);
+    CKSUM_STEP(mem + i + 8);
+    CKSUM_STEP(mem + i + 16);
+    CKSUM_STEP(mem + i + 24);
+
+  }
+
+  *cksum = crc;
+  return ret;
+
+}
+
+__attribute__((target(AVX512_TARGET))) static u8 classify_scan_avx512(
+    u8* mem, u8* vir, u32 len, u32* cksum) {
+
+  __m512i lut_lo = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_LO));
+  __m512i lut_hi = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_HI));
+  __m512i nib = _mm512_set1_epi8(0x0f);
+  u64     crc = HASH_CONST, cur = HASH_CONST;
+  u8      ret = 0;
+  u32     i, j;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+
+    if (unlikely(_mm512_test_epi64_mask(v, v))) {
+
+      __m512i   hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), nib);
+      __m512i   r_lo = _mm512_shuffle_epi8(lut_lo, _mm512_and_si512(v, nib));
+      __mmask64 big = _mm512_test_epi8_mask(hi, hi);
+
+      v = _mm512_mask_shuffle_epi8(r_lo, big, lut_hi, hi);
+      _mm512_storeu_si512(mem + i, v);
+
+      if (_mm512_test_epi64_mask(v, _mm512_loadu_si512(vir + i))) ret = 1;
+
+    }
+
+    for (j = 0; j < 64; j += 8)
+      CKSUM_STEP(mem + i + j);
+
+  }
+
+  *cksum = crc;
+  return ret;
+
+}
+
+#undef CKSUM_STEP
+
+/* Pick the kernels once at startup. AFL_NO_SIMD forces the scalar code,
+   which is handy when chasing a suspected kernel bug. */
+
+void init_bitmap_kernels(void) {
+
+  if (getenv("AFL_NO_SIMD")) return;
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw")) {
+
+    has_new_bits_vec = has_new_bits_avx512;
+    classify_counts_vec = classify_counts_avx512;
+    count_bytes_vec = count_bytes_avx512;
+    count_non_255_bytes_vec = count_non_255_bytes_avx512;
+    simplify_trace_vec = simplify_trace_avx512;
+    minimize_bits_vec = minimize_bits_avx512;
+    classify_scan_vec = classify_scan_avx512;
+
+  } else if (__builtin_cpu_supports("avx2")) {
+
+    has_new_bits_vec = has_new_bits_avx2;
+    classify_counts_vec = classify_counts_avx2;
+    count_bytes_vec = count_bytes_avx2;
+    count_non_255_bytes_vec = count_non_255_bytes_avx2;
+    simplify_trace_vec = simplify_trace_avx2;
+    minimize_bits_vec = minimize_bits_avx2;
+    classify_scan_vec = classify_scan_avx2;
+
+  } else if (__builtin_cpu_supports("sse4.2") &&
+             __builtin_cpu_supports("popcnt")) {
+
+    has_new_bits_vec = has_new_bits_sse42;
+    classify_counts_vec = classify_counts_sse42;
+    count_bytes_vec = count_bytes_sse42;
+    count_non_255_bytes_vec = count_non_255_bytes_sse42;
+    simplify_trace_vec = simplify_trace_sse42;
+    minimize_bits_vec = minimize_bits_sse42;
+    classify_scan_vec = classify_scan_sse42;
+
+  }
+
+}
+
+#else
+
+void init_bitmap_kernels(void) {
+
+}
+
+#endif                                            /* ^__x86_64__ && GNUC */
+
+/* Dirty-line summary. For targets built with AFL_DIRTY_MAP, the runtime
+   sets a bit in dirty_map for every 64-byte line of trace_bits in which a
+   counter went from 0 to 1. All other lines are known to be zero, so once
+   classify_trace() has turned the summary into a list of line offsets, the
+   passes below only need to visit those. */
+
+static u32* dirty_lines;               /* Offsets of the dirty trace lines  */
+static u32  dirty_lines_cnt;           /* Number of entries in dirty_lines  */
+static u32  dirty_lines_size;          /* Map size dirty_lines was made for */
+
+static void collect_dirty_lines(void) {
+
+  u32 words = (map_used + (1 << DIRTY_WORD_SHIFT) - 1) >> DIRTY_WORD_SHIFT;
+  u32 i;
+
+  if (unlikely(dirty_lines_size != map_size)) {
+
+    ck_free(dirty_lines);
+    dirty_lines = ck_alloc((map_size >> 6) * sizeof(u32));
+    dirty_lines_size = map_size;
+
+  }
+
+  dirty_lines_cnt = 0;
+
+  for (i = 0; i < words; ++i) {
+
+    u64 bits = dirty_map[i];
+
+    while (bits) {
+
+      u32 off = ((i << 6) + __builtin_ctzll(bits)) << 6;
+
+      bits &= bits - 1;
+      if (likely(off < map_used)) dirty_lines[dirty_lines_cnt++] = off;
+
+    }
+
+  }
+
+}
+
+/* One word of has_new_bits(), for the paths that pick the words to look at
+   themselves. Only called if (*cur & *vir) is non-zero. */
+
+static inline u8 new_bits_word(u8* cur, u8* vir, u8 ret) {
+
+  if (likely(ret < 2)) {
+
+    if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+        (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+        (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+        (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff))
+      ret = 2;
+    else
+      ret = 1;
+
+  }
+
+  *(u64*)vir &= ~*(u64*)cur;
+  return ret;
+
+}
+
+/* Zero trace_bits before the next exec, touching as little of it as the
+   last trace allows, and reset the touch log and dirty-line summary. */
+
+void reset_trace_bits(void) {
+
+  if (trace_sparse) {
+
+    u32* ent = touch_log + 1;
+    u32  n = touch_log[0];
+
+    while (n--)
+      trace_bits[*(ent++)] = 0;
+
+  } else if (trace_dirty) {
+
+    u32 i;
+
+    for (i = 0; i < dirty_lines_cnt; ++i)
+      memset(trace_bits + dirty_lines[i], 0, 64);
+
+  } else
+
+    memset(trace_bits, 0, map_used);
+
+  if (touch_log_on) touch_log[0] = 0;
+
+  if (dirty_map_on)
+    memset(dirty_map, 0,
+           ((map_used + (1 << DIRTY_WORD_SHIFT) - 1) >> DIRTY_WORD_SHIFT) *
+               sizeof(u64));
+
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
 
 }
 
@@ -73,6 +983,79 @@ void read_bitmap(u8* fname) {
 
 u8 has_new_bits(u8* virgin_map) {
 //u64 ttt = get_cur_time_us();
+
+  /* The fused pass in classify_trace() already found nothing in the trace
+     that touches virgin_bits; the map can only have lost bits since. */
+
+  if (virgin_map == virgin_bits && trace_cache_valid && !trace_hits_virgin)
+    return 0;
+
+  /* With the touch log, only the slots it lists can be non-zero. */
+
+  if (trace_sparse) {
+
+    u32* ent = touch_log + 1;
+    u32  n = touch_log[0];
+    u8   ret = 0;
+
+    while (n--) {
+
+      u32 idx = *(ent++);
+      u8  cur = trace_bits[idx];
+
+      if (unlikely(cur & virgin_map[idx])) {
+
+        if (virgin_map[idx] == 0xff)
+          ret = 2;
+        else if (!ret)
+          ret = 1;
+
+        virgin_map[idx] &= ~cur;
+
+      }
+
+    }
+
+    if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+    return ret;
+
+  }
+
+  /* With the dirty-line summary, only the marked lines can be non-zero. */
+
+  if (trace_dirty) {
+
+    u32 i, j;
+    u8  ret = 0;
+
+    for (i = 0; i < dirty_lines_cnt; ++i) {
+
+      u64* current = (u64*)(trace_bits + dirty_lines[i]);
+      u64* virgin = (u64*)(virgin_map + dirty_lines[i]);
+
+      for (j = 0; j < 8; ++j)
+        if (unlikely(current[j] & virgin[j]))
+          ret = new_bits_word((u8*)(current + j), (u8*)(virgin + j), ret);
+
+    }
+
+    if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+    return ret;
+
+  }
+
+#ifdef HAVE_BITMAP_SIMD
+
+  if (likely(has_new_bits_vec)) {
+
+    u8 ret = has_new_bits_vec(trace_bits, virgin_map, map_used);
+    if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+    return ret;
+
+  }
+
+#endif                                                 /* HAVE_BITMAP_SIMD */
+
 #ifdef WORD_SIZE_64
 
   u64* current = (u64*)trace_bits;
@@ -144,6 +1127,78 @@ u8 has_new_bits(u8* virgin_map) {
 
 }
 
+/* Same as has_new_bits(), but against the virgin map shared by all the
+   instances on the box. Bits are cleared with an atomic AND-NOT, so every
+   new tuple is credited to exactly one instance. Only worth calling once
+   has_new_bits(virgin_bits) found something, since we push everything we
+   clear locally to the shared map as well. */
+
+u8 has_new_bits_global(void) {
+
+#ifdef WORD_SIZE_64
+
+  u64* current = (u64*)trace_bits;
+  u64* virgin = (u64*)global_virgin;
+  u64  old;
+
+  u32 i = (map_used >> 3);
+
+#else
+
+  u32* current = (u32*)trace_bits;
+  u32* virgin = (u32*)global_virgin;
+  u32  old;
+
+  u32 i = (map_used >> 2);
+
+#endif                                                     /* ^WORD_SIZE_64 */
+
+  u8 ret = 0;
+
+  while (i--) {
+
+    if (unlikely(*current) && unlikely(*current & *virgin)) {
+
+      old = __atomic_fetch_and(virgin, ~*current, __ATOMIC_RELAXED);
+
+      if (likely(ret < 2) && (old & *current)) {
+
+        u8* cur = (u8*)current;
+        u8* vir = (u8*)&old;
+
+#ifdef WORD_SIZE_64
+
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff))
+          ret = 2;
+        else
+          ret = 1;
+
+#else
+
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff))
+          ret = 2;
+        else
+          ret = 1;
+
+#endif                                                     /* ^WORD_SIZE_64 */
+
+      }
+
+    }
+
+    ++current;
+    ++virgin;
+
+  }
+
+  return ret;
+
+}
+
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
 
@@ -186,6 +1241,12 @@ u32 count_bytes(u8* mem) {
   u32  i = (map_used >> 2);
   u32  ret = 0;
 
+  if (mem == trace_bits && (trace_sparse || trace_dirty)) return trace_nonzero;
+
+#ifdef HAVE_BITMAP_SIMD
+  if (likely(count_bytes_vec)) return count_bytes_vec(mem, map_used);
+#endif
+
   while (i--) {
 
     u32 v = *(ptr++);
@@ -211,6 +1272,11 @@ u32 count_non_255_bytes(u8* mem) {
   u32  i = (map_used >> 2);
   u32  ret = 0;
 
+#ifdef HAVE_BITMAP_SIMD
+  if (likely(count_non_255_bytes_vec))
+    return count_non_255_bytes_vec(mem, map_used);
+#endif
+
   while (i--) {
 
     u32 v = *(ptr++);
@@ -241,11 +1307,60 @@ const u8 simplify_lookup[256] = {
 
 };
 
+/* simplify_trace() for a trace with a dirty-line list: clean lines are all
+   zero, which simplifies to 1, so they just get filled. */
+
+static void simplify_trace_lines(void) {
+
+  u32 i, j, pos = 0;
+
+  for (i = 0; i < dirty_lines_cnt; ++i) {
+
+    u8* line = trace_bits + dirty_lines[i];
+
+    memset(trace_bits + pos, 1, dirty_lines[i] - pos);
+
+    for (j = 0; j < 64; ++j)
+      line[j] = simplify_lookup[line[j]];
+
+    pos = dirty_lines[i] + 64;
+
+  }
+
+  memset(trace_bits + pos, 1, map_used - pos);
+
+  trace_cache_valid = 0;
+  trace_dirty = 0;
+
+}
+
 #ifdef WORD_SIZE_64
 
-void simplify_trace(u64* mem) {
-//u64 ttt = get_cur_time_us();
-  u32 i = map_used >> 3;
+void simplify_trace(u64* mem) {
+//u64 ttt = get_cur_time_us();
+  u32 i = map_used >> 3;
+
+  if ((u8*)mem == trace_bits && trace_dirty) {
+
+    simplify_trace_lines();
+    return;
+
+  }
+
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
+
+#ifdef HAVE_BITMAP_SIMD
+
+  if (likely(simplify_trace_vec)) {
+
+    simplify_trace_vec((u8*)mem, map_used);
+    return;
+
+  }
+
+#endif
 
   while (i--) {
 
@@ -278,7 +1393,18 @@ void simplify_trace(u64* mem) {
 
 void simplify_trace(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_used >> 2;
+
+  if ((u8*)mem == trace_bits && trace_dirty) {
+
+    simplify_trace_lines();
+    return;
+
+  }
+
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
 
   while (i--) {
 
@@ -342,6 +1468,21 @@ void classify_counts(u64* mem) {
 
   u32 i = map_used >> 3;
 
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
+
+#ifdef HAVE_BITMAP_SIMD
+
+  if (likely(classify_counts_vec)) {
+
+    classify_counts_vec((u8*)mem, map_used);
+    return;
+
+  }
+
+#endif
+
   while (i--) {
 
     /* Optimize for sparse bitmaps. */
@@ -369,6 +1510,10 @@ void classify_counts(u32* mem) {
 
   u32 i = map_used >> 2;
 
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
+
   while (i--) {
 
     /* Optimize for sparse bitmaps. */
@@ -390,6 +1535,498 @@ void classify_counts(u32* mem) {
 
 #endif                                                     /* ^WORD_SIZE_64 */
 
+/* Touched-slot log. For targets built with AFL_TOUCH_LOG, the runtime
+   appends a slot to touch_log whenever its counter goes from 0 to 1. As long
+   as the log did not overflow, we classify, hash, compare and reset just the
+   slots it lists. Counters that wrap around get logged twice, so the log is
+   deduplicated first; the compacted log is also what reset_trace_bits()
+   clears before the next exec. */
+
+static u8* touch_seen;                 /* Dedup bitmap for the touch log    */
+static u32 touch_seen_size;            /* Map size touch_seen was made for  */
+
+static inline u32 touch_hash_step(u32 idx, u8 val) {
+
+  u32 x = (idx * 0x9e3779b1) ^ (val * 0x85ebca6b);
+
+  x ^= x >> 15;
+  x *= 0x2c1b3c6d;
+  x ^= x >> 12;
+
+  return x;
+
+}
+
+/* The checksum has to come out the same whether we walk the log or fall
+   back to the whole map, so with the touch log it is a sum over non-zero
+   slots rather than hash32(). */
+
+static u32 touch_cksum_full(void) {
+
+  u64* mem = (u64*)trace_bits;
+  u32  i, j, ret = HASH_CONST;
+
+  for (i = 0; i < (map_used >> 3); ++i) {
+
+    u8* mem8 = (u8*)(mem + i);
+
+    if (likely(!mem[i])) continue;
+
+    for (j = 0; j < 8; ++j)
+      if (mem8[j]) ret += touch_hash_step((i << 3) + j, mem8[j]);
+
+  }
+
+  return ret;
+
+}
+
+static void classify_trace_sparse(void) {
+
+  u32* ent = touch_log + 1;
+  u32  n = touch_log[0], i, kept = 0;
+  u32  cksum = HASH_CONST;
+  u8   hits = 0;
+
+  if (unlikely(touch_seen_size != map_size)) {
+
+    ck_free(touch_seen);
+    touch_seen = ck_alloc(map_size >> 3);
+    touch_seen_size = map_size;
+
+  }
+
+  trace_nonzero = 0;
+
+  for (i = 0; i < n; ++i) {
+
+    u32 idx = ent[i];
+    u8  val;
+
+    if (unlikely(idx >= map_used) || (touch_seen[idx >> 3] & (1 << (idx & 7))))
+      continue;
+
+    touch_seen[idx >> 3] |= 1 << (idx & 7);
+    ent[kept++] = idx;
+
+    if (!(val = trace_bits[idx])) continue;
+
+    val = count_class_lookup8[val];
+    trace_bits[idx] = val;
+
+    ++trace_nonzero;
+    cksum += touch_hash_step(idx, val);
+    hits |= val & virgin_bits[idx];
+
+  }
+
+  for (i = 0; i < kept; ++i)
+    touch_seen[ent[i] >> 3] = 0;
+
+  touch_log[0] = kept;
+
+  trace_cksum_cached = cksum;
+  trace_hits_virgin = !!hits;
+  trace_cache_valid = 1;
+  trace_sparse = 1;
+
+}
+
+/* Classify, hash and check against virgin_bits only the lines marked in the
+   dirty-line summary. The checksum is the same kind classify_trace_sparse()
+   computes. */
+
+static void classify_trace_lines(void) {
+
+  u32 i, j, k;
+  u32 cksum = HASH_CONST;
+  u64 hits = 0;
+
+  collect_dirty_lines();
+
+  trace_nonzero = 0;
+
+  for (i = 0; i < dirty_lines_cnt; ++i) {
+
+    u32  off = dirty_lines[i];
+    u64* mem = (u64*)(trace_bits + off);
+    u64* vir = (u64*)(virgin_bits + off);
+
+    for (j = 0; j < 8; ++j) {
+
+      u16* mem16 = (u16*)(mem + j);
+      u8*  mem8 = (u8*)(mem + j);
+
+      if (!mem[j]) continue;
+
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+      mem16[2] = count_class_lookup16[mem16[2]];
+      mem16[3] = count_class_lookup16[mem16[3]];
+
+      for (k = 0; k < 8; ++k)
+        if (mem8[k]) {
+
+          ++trace_nonzero;
+          cksum += touch_hash_step(off + (j << 3) + k, mem8[k]);
+
+        }
+
+      hits |= mem[j] & vir[j];
+
+    }
+
+  }
+
+  trace_cksum_cached = cksum;
+  trace_hits_virgin = !!hits;
+  trace_cache_valid = 1;
+  trace_dirty = 1;
+
+}
+
+/* Post-exec processing of trace_bits. With the vector kernels available
+   this is a single pass that also computes the exec checksum and checks the
+   trace against virgin_bits; trace_cksum() and has_new_bits(virgin_bits)
+   then reuse those results until trace_bits changes again. */
+
+void classify_trace(void) {
+
+  if (touch_log_on && likely(touch_log[0] <= TOUCH_LOG_SIZE)) {
+
+    classify_trace_sparse();
+    return;
+
+  }
+
+  if (dirty_map_on) {
+
+    classify_trace_lines();
+    return;
+
+  }
+
+  if (touch_log_on) {
+
+    /* The log overflowed. Do it the slow way, and leave the checksum to
+       trace_cksum(), the fused kernel would compute the wrong kind. */
+
+#ifdef WORD_SIZE_64
+    classify_counts((u64*)trace_bits);
+#else
+    classify_counts((u32*)trace_bits);
+#endif                                                     /* ^WORD_SIZE_64 */
+    return;
+
+  }
+
+#ifdef HAVE_BITMAP_SIMD
+
+  if (likely(classify_scan_vec)) {
+
+    trace_hits_virgin = classify_scan_vec(trace_bits, virgin_bits, map_used,
+                                          &trace_cksum_cached);
+    trace_cache_valid = 1;
+    return;
+
+  }
+
+#endif
+
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif                                                     /* ^WORD_SIZE_64 */
+
+}
+
+/* Checksum of the current trace, computed only if classify_trace() did not
+   get to it already. */
+
+u32 trace_cksum(void) {
+
+  if (!trace_cache_valid) {
+
+    if (touch_log_on || dirty_map_on)
+      trace_cksum_cached = touch_cksum_full();
+    else
+      trace_cksum_cached = hash32_time(trace_bits, map_used, HASH_CONST);
+    trace_hits_virgin = 1;                    /* Unknown, check the map */
+    trace_cache_valid = 1;
+
+  }
+
+  return trace_cksum_cached;
+
+}
+
+/* Slot re-layout. Compact slots are handed out in first-hit order, so hot
+   edges that were found late end up spread over lines that are otherwise
+   cold, and every exec touches more of the map than it needs to. With
+   AFL_DEFRAG_MAP, we sample which slots get hit and, now and then, renumber
+   them hottest first. Everything on our side that is indexed by slot is
+   permuted along with the index table. */
+
+static u32* slot_hits;                 /* Sampled hit counts, per slot      */
+static u32  slot_hits_size;            /* Map size slot_hits was made for   */
+static u32  slot_samples;              /* Samples since the last re-layout  */
+static u32  defrag_slots;              /* Slots used at the last re-layout  */
+
+void sample_slot_hits(void) {
+
+  u32 i, j;
+
+  if (unlikely(slot_hits_size != map_size)) {
+
+    ck_free(slot_hits);
+    slot_hits = ck_alloc(map_size * sizeof(u32));
+    slot_hits_size = map_size;
+
+  }
+
+  ++slot_samples;
+
+  if (trace_sparse) {
+
+    for (i = 0; i < touch_log[0]; ++i)
+      if (trace_bits[touch_log[i + 1]]) ++slot_hits[touch_log[i + 1]];
+
+  } else if (trace_dirty) {
+
+    for (i = 0; i < dirty_lines_cnt; ++i)
+      for (j = dirty_lines[i]; j < dirty_lines[i] + 64; ++j)
+        if (trace_bits[j]) ++slot_hits[j];
+
+  } else {
+
+    u64* mem = (u64*)trace_bits;
+
+    for (i = 0; i < (map_used >> 3); ++i)
+      if (unlikely(mem[i]))
+        for (j = i << 3; j < (i << 3) + 8; ++j)
+          if (trace_bits[j]) ++slot_hits[j];
+
+  }
+
+}
+
+static int compare_slot_hits(const void* a, const void* b) {
+
+  u32 x = *(u32*)a, y = *(u32*)b;
+
+  if (slot_hits[x] != slot_hits[y])
+    return slot_hits[x] > slot_hits[y] ? -1 : 1;
+  return x < y ? -1 : (x > y);
+
+}
+
+/* Apply perm[] to the first n entries of a slot-indexed byte map. */
+
+static void permute_slots(u8* map, u32* perm, u32 n, u8* tmp) {
+
+  u32 i;
+
+  for (i = 0; i < n; ++i)
+    tmp[perm[i]] = map[i];
+
+  memcpy(map, tmp, n);
+
+}
+
+/* Run every queue entry once more to refresh its checksum after the shape
+   of the traces changed. With absorb set, slots that only show up now are
+   quietly taken into the virgin maps, so that they don't pass for new
+   paths later on. */
+
+static void rerun_queue(char** argv, u8 absorb) {
+
+  struct queue_entry* q;
+
+  for (q = queue; q && !stop_soon; q = q->next) {
+
+    u8* mem;
+    s32 fd = open(q->fname, O_RDONLY);
+
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+    mem = ck_alloc_nozero(q->len);
+    ck_read(fd, mem, q->len, q->fname);
+    close(fd);
+
+    write_to_testcase(mem, q->len);
+    run_target(argv, exec_tmout);
+    q->exec_cksum = trace_cksum();
+
+    if (absorb && has_new_bits(virgin_bits) && global_virgin)
+      has_new_bits_global();
+
+    ck_free(mem);
+
+  }
+
+}
+
+/* Kill the fork server, renumber the slots hottest first, and bring it back
+   up. The queue entries' checksums depend on the layout too, so every entry
+   gets run once more to refresh them. Called between queue cycles. */
+
+void maybe_defrag_map(char** argv) {
+
+  struct queue_entry*  q;
+  struct queue_entry** top_tmp;
+  u32*                 order;
+  u32*                 perm;
+  u32*                 hits_tmp;
+  u8*                  tmp;
+  u32                  n = MIN(trace_idx[0], map_size), i;
+
+  if (dumb_mode || slot_samples < DEFRAG_MIN_SAMPLES || n < DEFRAG_MIN_SLOTS ||
+      n < defrag_slots + defrag_slots / 4)
+    return;
+
+  order = ck_alloc(n * sizeof(u32));
+  perm = ck_alloc(n * sizeof(u32));
+
+  for (i = 0; i < n; ++i)
+    order[i] = i;
+
+  qsort(order, n, sizeof(u32), compare_slot_hits);
+
+  for (i = 0; i < n; ++i)
+    perm[order[i]] = i;
+
+  defrag_slots = n;
+  slot_samples = 0;
+
+  for (i = 0; i < n; ++i)
+    if (perm[i] != i) break;
+
+  if (i == n) goto done;
+
+  if (not_on_tty) ACTF("Re-laying out %u map slots by hit frequency...", n);
+
+  if (forksrv_pid > 0) {
+
+    kill(forksrv_pid, SIGKILL);
+    if (waitpid(forksrv_pid, NULL, 0) <= 0) PFATAL("waitpid() failed");
+    close(fsrv_ctl_fd);
+    close(fsrv_st_fd);
+    forksrv_pid = 0;
+
+  }
+
+  stop_cmplog_forkserver();
+  stop_pool();
+
+  /* The index table. Entry 0 is the slot counter, which stays as is. */
+
+  for (i = 1; i < map_size; ++i)
+    if (trace_idx[i] < n) trace_idx[i] = perm[trace_idx[i]];
+
+  /* Our slot-indexed state. */
+
+  tmp = ck_alloc_nozero(n);
+
+  permute_slots(virgin_bits, perm, n, tmp);
+  permute_slots(virgin_tmout, perm, n, tmp);
+  permute_slots(virgin_crash, perm, n, tmp);
+  permute_slots(var_bytes, perm, n, tmp);
+
+  ck_free(tmp);
+
+  top_tmp = ck_alloc_nozero(n * sizeof(struct queue_entry*));
+
+  for (i = 0; i < n; ++i)
+    top_tmp[perm[i]] = top_rated[i];
+
+  memcpy(top_rated, top_tmp, n * sizeof(struct queue_entry*));
+  ck_free(top_tmp);
+
+  hits_tmp = ck_alloc_nozero(n * sizeof(u32));
+
+  for (i = 0; i < n; ++i)
+    hits_tmp[perm[i]] = slot_hits[i] >> 1;
+
+  memcpy(slot_hits, hits_tmp, n * sizeof(u32));
+  ck_free(hits_tmp);
+
+  for (q = queue; q; q = q->next) {
+
+    u8* mini;
+
+    if (!q->trace_mini) continue;
+
+    mini = ck_alloc(map_used >> 3);
+
+    for (i = 0; i < MIN(n, q->trace_mini_size); ++i)
+      if (q->trace_mini[i >> 3] & (1 << (i & 7)))
+        mini[perm[i] >> 3] |= 1 << (perm[i] & 7);
+
+    ck_free(q->trace_mini);
+    q->trace_mini = mini;
+    q->trace_mini_size = map_used;
+
+  }
+
+  /* Whatever trace_bits holds is in the old layout. */
+
+  memset(trace_bits, 0, map_size);
+  trace_cache_valid = 0;
+  trace_sparse = 0;
+  trace_dirty = 0;
+
+  bitmap_changed = 1;
+  score_changed = 1;
+
+  if (!no_forkserver) {
+
+    init_forkserver(argv);
+    if (cmplog_mode) init_cmplog_forkserver(argv);
+
+  }
+
+  rerun_queue(argv, 0);
+
+done:
+
+  ck_free(order);
+  ck_free(perm);
+
+}
+
+/* Send the laf-intel sites built with AFL_LLVM_LAF_SWITCH whose split form
+   has seen all of its outcomes back to the plain compare. Their chains have
+   nothing left to show us, so there is no point in paying for them. Takes
+   effect with the next exec, no fork server restart needed. Called between
+   queue cycles. */
+
+void maybe_switch_laf(char** argv) {
+
+  u8* seen;
+  u32 i, n = 0;
+
+  if (!laf_flags || dumb_mode) return;
+
+  seen = laf_flags + LAF_SITES;
+
+  for (i = 0; i < LAF_SITES; ++i) {
+
+    if (laf_flags[i] || seen[i] != 0xff) continue;
+
+    laf_flags[i] = 1;
+    ++n;
+
+  }
+
+  if (!n) return;
+
+  if (not_on_tty) ACTF("Switching %u laf-intel sites to plain compares...", n);
+
+  rerun_queue(argv, 1);
+
+}
+
 /* Compact trace bytes into a smaller bitmap. We effectively just drop the
    count information here. This is called only sporadically, for some
    new paths. */
@@ -398,6 +2035,17 @@ void minimize_bits(u8* dst, u8* src) {
 
   u32 i = 0;
 
+#ifdef HAVE_BITMAP_SIMD
+
+  if (likely(minimize_bits_vec)) {
+
+    minimize_bits_vec(dst, src, map_used);
+    return;
+
+  }
+
+#endif
+
   while (i < map_used) {
 
     if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
@@ -526,6 +2174,15 @@ u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       return 0;
     }
 
+    /* With a shared virgin map, keep our own finds only if they are new to
+       the whole fleet; somebody else already queued the rest. Inputs pulled
+       in by sync_fuzzers() are still judged by our local view alone. */
+
+    if (global_virgin && !has_new_bits_global() && !syncing_party) {
+      if (crash_mode) ++total_crashes;
+      return 0;
+    }
+
 #ifndef SIMPLE_FILES
 
     fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
@@ -544,7 +2201,7 @@ u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       ++queued_with_cov;
     }
 
-    queue_top->exec_cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+    queue_top->exec_cksum = trace_cksum();
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
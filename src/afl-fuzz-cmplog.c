@@ -194,6 +194,14 @@ void init_cmplog_forkserver(char** argv) {
 
   if (rlen == 4) {
 
+    /* Both binaries are built from the same harness, so they had better
+       agree on where the test cases come from. */
+
+    if (shm_fuzz_on != ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+                        (status & FS_OPT_SHDMEM_FUZZ) != 0))
+      FATAL("Only one of the target and the CmpLog binary uses "
+            "__AFL_FUZZ_INIT()");
+
     OKF("All right - fork server is up.");
     return;
 
@@ -347,14 +355,33 @@ void init_cmplog_forkserver(char** argv) {
 
 }
 
+/* Shut the cmplog fork server down, so that init_cmplog_forkserver() can
+   start it afresh. */
+
+void stop_cmplog_forkserver(void) {
+
+  if (cmplog_forksrv_pid <= 0) return;
+
+  if (cmplog_child_pid > 0) kill(cmplog_child_pid, SIGKILL);
+  cmplog_child_pid = 0;
+
+  kill(cmplog_forksrv_pid, SIGKILL);
+  if (waitpid(cmplog_forksrv_pid, NULL, 0) <= 0) PFATAL("waitpid() failed");
+
+  close(cmplog_fsrv_ctl_fd);
+  close(cmplog_fsrv_st_fd);
+  cmplog_forksrv_pid = 0;
+
+}
+
 u8 run_cmplog_target(char** argv, u32 timeout) {
 
   static struct itimerval it;
   static u32              prev_timed_out = 0;
-  static u64              exec_ms = 0;
 
   int status = 0;
   u32 tb4;
+  u64 start_us;
 
   child_timed_out = 0;
 
@@ -362,9 +389,11 @@ u8 run_cmplog_target(char** argv, u32 timeout) {
      must prevent any earlier operations from venturing into that
      territory. */
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
+  start_us = get_mono_time_us();
+
   /* If we're running in "dumb" mode, we can't rely on the fork server
      logic compiled into the target program, so we will just keep calling
      execve(). There is a bit of code duplication between here and
@@ -481,25 +510,29 @@ u8 run_cmplog_target(char** argv, u32 timeout) {
   }
 
   /* Configure timeout, as requested by user, then wait for child to terminate.
-   */
+     Same as in run_target(): a timer and SIGALRM without a fork server, a
+     deadline on the status pipe with one. */
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
-
-  setitimer(ITIMER_REAL, &it, NULL);
+  if (dumb_mode == 1 || no_forkserver) {
 
-  /* The SIGALRM handler simply kills the cmplog_child_pid and sets
-   * child_timed_out. */
+    it.it_value.tv_sec = (timeout / 1000);
+    it.it_value.tv_usec = (timeout % 1000) * 1000;
 
-  if (dumb_mode == 1 || no_forkserver) {
+    setitimer(ITIMER_REAL, &it, NULL);
 
     if (waitpid(cmplog_child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
 
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+
+    setitimer(ITIMER_REAL, &it, NULL);
+
   } else {
 
     s32 res;
 
-    if ((res = read(cmplog_fsrv_st_fd, &status, 4)) != 4) {
+    if ((res = read_status_timed(cmplog_fsrv_st_fd, &status, timeout,
+                                 cmplog_child_pid)) != 4) {
 
       if (stop_soon) return 0;
       SAYF(
@@ -525,15 +558,9 @@ u8 run_cmplog_target(char** argv, u32 timeout) {
 
   if (!WIFSTOPPED(status)) cmplog_child_pid = 0;
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms =
-      (u64)timeout - (it.it_value.tv_sec * 1000 + it.it_value.tv_usec / 1000);
-  if (slowest_exec_ms < exec_ms) slowest_exec_ms = exec_ms;
-
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
-
-  setitimer(ITIMER_REAL, &it, NULL);
+  last_exec_us = get_mono_time_us() - start_us;
+  if (slowest_exec_ms < last_exec_us / 1000)
+    slowest_exec_ms = last_exec_us / 1000;
 
   ++total_execs;
 
@@ -118,7 +118,13 @@ u8 skip_deterministic,                  /* Skip deterministic stages?       */
     no_cpu_meter_red,                   /* Feng shui on the status screen   */
     no_arith,                           /* Skip most arithmetic ops         */
     shuffle_queue,                      /* Shuffle input queue?             */
+    shared_virgin,                      /* Share virgin bits across fleet?  */
+    defrag_map,                         /* Re-layout slots by hit frequency?*/
     bitmap_changed = 1,                 /* Time to update bitmap?           */
+    trace_cache_valid,                  /* Cached trace results current?    */
+    trace_sparse,                       /* trace_bits only has logged slots?*/
+    trace_dirty,                        /* trace_bits only has dirty lines? */
+    batch_stage,                        /* Queue execs for run_batch()?     */
     qemu_mode,                          /* Running in QEMU mode?            */
     unicorn_mode,                       /* Running in Unicorn mode?         */
     use_wine,                           /* Use WINE with QEMU mode          */
@@ -147,11 +153,12 @@ u8 *trace_bits;                         /* SHM with instrumentation bitmap  */
 u32 *trace_idx;                         /* SHM with bitmap indexes          */
 u32 map_used;
 
-u8 virgin_bits[MAP_SIZE],               /* Regions yet untouched by fuzzing */
-    virgin_tmout[MAP_SIZE],             /* Bits we haven't seen in tmouts   */
-    virgin_crash[MAP_SIZE];             /* Bits we haven't seen in crashes  */
+u8 *virgin_bits,                        /* Regions yet untouched by fuzzing */
+    *virgin_tmout,                      /* Bits we haven't seen in tmouts   */
+    *virgin_crash,                      /* Bits we haven't seen in crashes  */
+    *global_virgin;                     /* Fleet-wide virgin bits (shared)  */
 
-u8 var_bytes[MAP_SIZE];                 /* Bytes that appear to be variable */
+u8 *var_bytes;                          /* Bytes that appear to be variable */
 
 volatile u8 stop_soon,                  /* Ctrl-C pressed?                  */
     clear_screen = 1,                   /* Window resized?                  */
@@ -181,6 +188,7 @@ u64 total_crashes,                      /* Total number of crashes          */
     unique_hangs,                       /* Hangs with unique signatures     */
     total_execs,                        /* Total execve() calls             */
     slowest_exec_ms,                    /* Slowest testcase non hang in ms  */
+    last_exec_us,                       /* Duration of the last exec (us)   */
     start_time,                         /* Unix start time (ms)             */
     last_path_time,                     /* Time for most recent path (ms)   */
     last_crash_time,                    /* Time for most recent crash (ms)  */
@@ -243,7 +251,7 @@ struct queue_entry *queue,              /* Fuzzing queue (linked list)      */
     *queue_top,                         /* Top of the list                  */
     *q_prev100;                         /* Previous 100 marker              */
 
-struct queue_entry *top_rated[MAP_SIZE]; /* Top entries for bitmap bytes     */
+struct queue_entry **top_rated;         /* Top entries for bitmap bytes     */
 
 struct extra_data *extras;              /* Extra tokens to fuzz with        */
 u32                extras_cnt;          /* Total number of tokens read      */
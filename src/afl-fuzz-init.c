@@ -456,7 +456,7 @@ static void check_map_coverage(void) {
 
   if (count_bytes(trace_bits) < 100) return;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < map_used; ++i)
+  for (i = (map_size >> 1); i < map_used; ++i)
     if (trace_bits[i]) return;
 
   WARNF("Recompile binary with newer version of afl to improve coverage!");
@@ -1231,8 +1231,15 @@ void maybe_delete_out_dir(void) {
   if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
   ck_free(fn);
 
+  /* The index table survives an in-place resume, load_index_table() picks
+     it up before the forkserver starts. */
+
   if (!in_place_resume) {
 
+    fn = alloc_printf("%s/fuzz_bitmap.idx", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
+
     fn = alloc_printf("%s/fuzzer_stats", out_dir);
     if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
     ck_free(fn);
@@ -1822,6 +1829,47 @@ static void handle_stop_sig(int sig) {
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
   if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  kill_pool();
+
+}
+
+/* Kill and reap the main, CmpLog and pool fork servers, along with the
+   children they are running (maybe stopped persistent ones). This runs at
+   the end of main() and as an atexit handler, so that on the way out of a
+   FATAL() the targets are also gone before remove_shm() checks whether
+   anybody still has the shared index table attached. */
+
+static s32 fuzzer_pid;
+
+void stop_all_forkservers(void) {
+
+  /* Not in the children whose exec failed and that exit() on our copy. */
+
+  if (getpid() != fuzzer_pid) return;
+
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+  child_pid = 0;
+
+  if (forksrv_pid > 0) {
+
+    kill(forksrv_pid, SIGKILL);
+    if (waitpid(forksrv_pid, NULL, 0) <= 0) WARNF("error waitpid\n");
+    forksrv_pid = 0;
+
+  }
+
+  stop_pool();
+  stop_cmplog_forkserver();
+
+}
+
+/* Have stop_all_forkservers() run at exit, before remove_shm(), which was
+   registered earlier. */
+
+void setup_forkserver_cleanup(void) {
+
+  fuzzer_pid = getpid();
+  atexit(stop_all_forkservers);
 
 }
 
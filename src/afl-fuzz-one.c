@@ -637,7 +637,7 @@ u8 fuzz_one_original(char** argv) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+      u32 cksum = trace_cksum();
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -682,7 +682,10 @@ u8 fuzz_one_original(char** argv) {
   stage_finds[STAGE_FLIP1] += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP1] += stage_max;
 
-  /* Two walking bits. */
+  /* Two walking bits. This stage and the next one do not look at the traces
+     of their execs, so these can be batched. */
+
+  batch_stage = 1;
 
   stage_name = "bitflip 2/1";
   stage_short = "flip2";
@@ -704,6 +707,8 @@ u8 fuzz_one_original(char** argv) {
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP2] += new_hit_cnt - orig_hit_cnt;
@@ -735,11 +740,15 @@ u8 fuzz_one_original(char** argv) {
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP4] += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP4] += stage_max;
 
+  batch_stage = 0;
+
   /* Effector map setup. These macros calculate:
 
      EFF_APOS      - position of a particular file offset in the map.
@@ -795,7 +804,7 @@ u8 fuzz_one_original(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+        cksum = trace_cksum();
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -836,7 +845,10 @@ u8 fuzz_one_original(char** argv) {
   stage_finds[STAGE_FLIP8] += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP8] += stage_max;
 
-  /* Two walking bytes. */
+  /* Two walking bytes. Neither this nor any of the remaining deterministic
+     stages look at the traces. */
+
+  batch_stage = 1;
 
   if (len < 2) goto skip_bitflip;
 
@@ -869,6 +881,8 @@ u8 fuzz_one_original(char** argv) {
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP16] += new_hit_cnt - orig_hit_cnt;
@@ -907,6 +921,8 @@ u8 fuzz_one_original(char** argv) {
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP32] += new_hit_cnt - orig_hit_cnt;
@@ -985,6 +1001,8 @@ skip_bitflip:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_ARITH8] += new_hit_cnt - orig_hit_cnt;
@@ -1087,6 +1105,8 @@ skip_bitflip:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_ARITH16] += new_hit_cnt - orig_hit_cnt;
@@ -1188,6 +1208,8 @@ skip_bitflip:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_ARITH32] += new_hit_cnt - orig_hit_cnt;
@@ -1249,6 +1271,8 @@ skip_arith:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_INTEREST8] += new_hit_cnt - orig_hit_cnt;
@@ -1323,6 +1347,8 @@ skip_arith:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_INTEREST16] += new_hit_cnt - orig_hit_cnt;
@@ -1398,6 +1424,8 @@ skip_arith:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_INTEREST32] += new_hit_cnt - orig_hit_cnt;
@@ -1464,6 +1492,8 @@ skip_interest:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_EXTRAS_UO] += new_hit_cnt - orig_hit_cnt;
@@ -1517,6 +1547,8 @@ skip_interest:
 
   ck_free(ex_tmp);
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_EXTRAS_UI] += new_hit_cnt - orig_hit_cnt;
@@ -1569,6 +1601,8 @@ skip_user_extras:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_EXTRAS_AO] += new_hit_cnt - orig_hit_cnt;
@@ -1576,6 +1610,8 @@ skip_user_extras:
 
 skip_extras:
 
+  batch_stage = 0;
+
   /* If we made this to here without jumping to havoc_stage or abandon_entry,
      we're properly done with deterministic steps and can mark it as such
      in the .state/ directory. */
@@ -1740,6 +1776,11 @@ havoc_stage:
 
   havoc_queued = queued_paths;
 
+  /* Havoc only looks at queued_paths, which may as well lag behind by a few
+     execs, so the executor pool gets it too. */
+
+  batch_stage = !!shm_pool_size;
+
   /* We essentially just do several thousand runs (depending on perf_score)
      where we take the input file and make random stacked tweaks. */
 
@@ -2152,6 +2193,10 @@ havoc_stage:
 
   }
 
+  if (run_batch(argv)) goto abandon_entry;
+
+  batch_stage = 0;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   if (!splice_cycle) {
@@ -2344,6 +2389,7 @@ radamsa_stage:
 abandon_entry:
 
   splicing_with = -1;
+  batch_stage = 0;
 
   /* Update pending_not_fuzzed count if we made it through the calibration
      cycle and have not seen this entry before. */
@@ -2655,7 +2701,7 @@ u8 common_fuzzing(char** argv, struct MOpt_globals_t MOpt_globals) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+      u32 cksum = trace_cksum();
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -2813,7 +2859,7 @@ u8 common_fuzzing(char** argv, struct MOpt_globals_t MOpt_globals) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+        cksum = trace_cksum();
       else
         cksum = ~queue_cur->exec_cksum;
 
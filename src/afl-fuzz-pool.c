@@ -0,0 +1,601 @@
+/*
+   american fuzzy lop++ - executor pool
+   ------------------------------------
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                        Heiko Eißfeldt <heiko.eissfeldt@hexco.de> and
+                        Andrea Fioraldi <andreafioraldi@gmail.com>
+
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   With AFL_EXEC_POOL=n, the stages that have fuzz_one() set batch_stage
+   hand their test cases to n fork servers of their own, each with its own
+   trace map, input file and SHM test case buffer, instead of running them
+   one at a time through run_target(). Whichever executor finishes first
+   has its trace copied to trace_bits and goes through save_if_interesting()
+   just like after run_target(). Calibration, trimming and the other stages
+   keep using the main fork server. This keeps n cores busy on targets that
+   spend most of their time blocked, with one queue and one scheduler.
+
+ */
+
+#include "afl-fuzz.h"
+
+struct executor {
+
+  s32 forksrv_pid,                     /* PID of its fork server            */
+      child_pid,                       /* PID of its fuzzed program         */
+      ctl_fd,                          /* Fork server control pipe (write)  */
+      st_fd,                           /* Fork server status pipe (read)    */
+      out_fd;                          /* Input fd, if fed through stdin    */
+
+  u8*    out_file;                     /* Input file, if named in argv      */
+  char** argv;                         /* argv with out_file substituted    */
+  u8*    bits;                         /* Trace map                         */
+  u32*   fuzz_len;                     /* SHM test case length, then data   */
+  u8     shm_fuzz;                     /* Target reads from fuzz_len?       */
+
+  u8  busy;                            /* Running a test case?              */
+  u32 timed_out;                       /* Killed the last child on timeout? */
+  u64 start_us,                        /* When the test case was sent off   */
+      done_us;                         /* When its status was readable, or 0*/
+
+  u8* mem;                             /* Copy of the test case...          */
+  u32 len,                             /* ...its length                     */
+      mem_size;                        /* ...and the room in mem            */
+  s32 cur_byte,                        /* stage_cur_byte when it was sent   */
+      cur_val;                         /* stage_cur_val, ditto              */
+
+};
+
+static struct executor pool[EXEC_POOL_MAX];
+static u32             pool_busy;      /* Executors running a test case     */
+static u8              pool_up;        /* Fork servers started?             */
+
+/* Set up input file and argv of executor i, where the target gets its own
+   copy of every argument naming out_file. */
+
+static void setup_executor_files(char** argv, u32 i) {
+
+  struct executor* e = &pool[i];
+  u8*              fn;
+  u32              n = 0, j;
+  u8               found = 0;
+
+  if (file_extension)
+    fn = alloc_printf("%s/.cur_input_%u.%s", out_dir, i, file_extension);
+  else
+    fn = alloc_printf("%s/.cur_input_%u", out_dir, i);
+
+  unlink(fn);                                              /* Ignore errors */
+
+  while (argv[n])
+    ++n;
+
+  e->argv = ck_alloc((n + 1) * sizeof(char*));
+
+  if (!out_file) {
+
+    e->out_fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (e->out_fd < 0) PFATAL("Unable to create '%s'", fn);
+    fcntl(e->out_fd, F_SETFD, FD_CLOEXEC);
+
+    memcpy(e->argv, argv, n * sizeof(char*));
+    ck_free(fn);
+    return;
+
+  }
+
+  for (j = 0; j < n; ++j) {
+
+    u8* loc = strstr(argv[j], out_file);
+
+    if (!loc) {
+
+      e->argv[j] = argv[j];
+      continue;
+
+    }
+
+    *loc = 0;
+    e->argv[j] = alloc_printf("%s%s%s", argv[j], fn, loc + strlen(out_file));
+    *loc = out_file[0];
+    found = 1;
+
+  }
+
+  if (!found)
+    FATAL("AFL_EXEC_POOL needs the input file to be named with @@");
+
+  e->out_fd = -1;
+  e->out_file = fn;
+
+}
+
+/* Start the fork server of executor i. init_forkserver() works on the
+   globals of the main one, so swap ours in for the duration. */
+
+static void start_executor(char** argv, u32 i) {
+
+  struct executor* e = &pool[i];
+
+  s32 main_pid = forksrv_pid, main_ctl_fd = fsrv_ctl_fd,
+      main_st_fd = fsrv_st_fd, main_out_fd = out_fd;
+  u8* main_bits = trace_bits;
+  u8  main_shm_fuzz = shm_fuzz_on, main_batch = batch_on;
+
+  if (!e->argv) setup_executor_files(argv, i);
+
+  e->bits = pool_bits[i];
+  e->fuzz_len = pool_fuzz_len[i];
+
+  trace_bits = e->bits;
+  if (!out_file) out_fd = e->out_fd;
+  set_pool_shm_env(i);
+
+  init_forkserver(e->argv);
+
+  e->forksrv_pid = forksrv_pid;
+  e->ctl_fd = fsrv_ctl_fd;
+  e->st_fd = fsrv_st_fd;
+  e->shm_fuzz = shm_fuzz_on;
+  e->child_pid = 0;
+  e->timed_out = 0;
+
+  /* Keep the fork servers started after us from holding our pipes open. */
+
+  fcntl(e->ctl_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(e->st_fd, F_SETFD, FD_CLOEXEC);
+
+  set_pool_shm_env(-1);
+  forksrv_pid = main_pid;
+  fsrv_ctl_fd = main_ctl_fd;
+  fsrv_st_fd = main_st_fd;
+  out_fd = main_out_fd;
+  trace_bits = main_bits;
+  shm_fuzz_on = main_shm_fuzz;
+  batch_on = main_batch;
+
+}
+
+static void start_pool(char** argv) {
+
+  u32 i;
+
+  ACTF("Starting %u pool executors...", shm_pool_size);
+
+  for (i = 0; i < shm_pool_size; ++i)
+    start_executor(argv, i);
+
+  pool_up = 1;
+
+}
+
+/* Kill the children and fork servers of the pool. Safe to call from a
+   signal handler. */
+
+void kill_pool(void) {
+
+  u32 i;
+
+  for (i = 0; i < shm_pool_size; ++i) {
+
+    if (pool[i].child_pid > 0) kill(pool[i].child_pid, SIGKILL);
+    if (pool[i].forksrv_pid > 0) kill(pool[i].forksrv_pid, SIGKILL);
+
+  }
+
+}
+
+/* Shut the pool down, so that the next test case for it starts it afresh.
+   Whatever it was running is dropped. */
+
+void stop_pool(void) {
+
+  u32 i;
+
+  if (!pool_up) return;
+
+  kill_pool();
+
+  for (i = 0; i < shm_pool_size; ++i) {
+
+    struct executor* e = &pool[i];
+
+    if (waitpid(e->forksrv_pid, NULL, 0) <= 0) PFATAL("waitpid() failed");
+
+    close(e->ctl_fd);
+    close(e->st_fd);
+    e->forksrv_pid = e->child_pid = 0;
+    e->busy = 0;
+
+  }
+
+  pool_busy = 0;
+  pool_up = 0;
+
+}
+
+/* Hand a test case to idle executor e. */
+
+static void send_to_executor(struct executor* e, u8* mem, u32 len) {
+
+  s32 res;
+
+  if (e->shm_fuzz && len > MAX_FILE) len = MAX_FILE;
+
+  if (len > e->mem_size) {
+
+    e->mem = ck_realloc(e->mem, len);
+    e->mem_size = len;
+
+  }
+
+  memcpy(e->mem, mem, len);
+  e->len = len;
+  e->cur_byte = stage_cur_byte;
+  e->cur_val = stage_cur_val;
+
+  if (e->shm_fuzz) {
+
+    memcpy(e->fuzz_len + 1, mem, len);
+    *e->fuzz_len = len;
+
+  } else if (e->out_file) {
+
+    s32 fd;
+
+    if (no_unlink) {
+
+      fd = open(e->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    } else {
+
+      unlink(e->out_file);                                /* Ignore errors. */
+      fd = open(e->out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    }
+
+    if (fd < 0) PFATAL("Unable to create '%s'", e->out_file);
+
+    ck_write(fd, mem, len, e->out_file);
+    close(fd);
+
+  } else {
+
+    lseek(e->out_fd, 0, SEEK_SET);
+    ck_write(e->out_fd, mem, len, "pool input");
+    if (ftruncate(e->out_fd, len)) PFATAL("ftruncate() failed");
+    lseek(e->out_fd, 0, SEEK_SET);
+
+  }
+
+  /* The slots in use may have grown since the last trace we looked at. */
+
+  memset(e->bits, 0, MIN(((trace_idx[0] + 63) / 64) * 64, map_size));
+  MEM_BARRIER();
+
+  e->start_us = get_mono_time_us();
+  e->done_us = 0;
+
+  if ((res = write(e->ctl_fd, &e->timed_out, 4)) != 4) {
+
+    if (stop_soon) return;
+    RPFATAL(res, "Unable to request new process from pool fork server");
+
+  }
+
+  e->timed_out = 0;
+
+  if ((res = read(e->st_fd, &e->child_pid, 4)) != 4) {
+
+    if (stop_soon) return;
+    RPFATAL(res, "Unable to request new process from pool fork server");
+
+  }
+
+  if (e->child_pid <= 0) FATAL("Pool fork server is misbehaving (OOM?)");
+
+  e->busy = 1;
+  ++pool_busy;
+
+}
+
+/* Look at which busy executors have a status to read, without blocking,
+   and note when we first saw each one done. run_target() calls this too,
+   so that results waiting behind calibration and trimming on the main
+   fork server are timed no later than the exec that held them up. Returns
+   how many there are. */
+
+u32 note_pool_finished(void) {
+
+  struct pollfd pfd[EXEC_POOL_MAX];
+  u8            idx[EXEC_POOL_MAX];
+
+  u64 now_us;
+  u32 n = 0, done = 0, i;
+
+  for (i = 0; i < shm_pool_size; ++i) {
+
+    if (!pool[i].busy) continue;
+
+    pfd[n].fd = pool[i].st_fd;
+    pfd[n].events = POLLIN;
+    idx[n++] = i;
+
+  }
+
+  if (!n || poll(pfd, n, 0) <= 0) return 0;
+
+  now_us = get_mono_time_us();
+
+  for (i = 0; i < n; ++i) {
+
+    struct executor* cur = &pool[idx[i]];
+
+    if (!pfd[i].revents) continue;
+
+    if (!cur->done_us) cur->done_us = now_us;
+    ++done;
+
+  }
+
+  return done;
+
+}
+
+/* Wait for the first busy executor to finish, killing the children that
+   run past exec_tmout on the way. Only children whose status has not come
+   in are killed: one that is done may already be reaped, or be a stopped
+   persistent child worth keeping. Returns the executor with its wait
+   status, or NULL if we are stopping. Of several done at once, the one
+   sent off first wins. */
+
+static struct executor* wait_for_executor(s32* status) {
+
+  struct pollfd pfd[EXEC_POOL_MAX];
+
+  while (1) {
+
+    struct executor* e = NULL;
+
+    u32 done = note_pool_finished(), n = 0, i;
+    u64 now_us = get_mono_time_us(), first_us = (u64)-1;
+    s32 res;
+
+    for (i = 0; i < shm_pool_size; ++i) {
+
+      struct executor* cur = &pool[i];
+      u64              deadline_us = cur->start_us + (u64)exec_tmout * 1000;
+
+      if (!cur->busy) continue;
+
+      if (cur->done_us) {
+
+        if (!e || cur->start_us < e->start_us) e = cur;
+        continue;
+
+      }
+
+      if (!cur->timed_out) {
+
+        if (now_us >= deadline_us) {
+
+          cur->timed_out = 1;
+          if (cur->child_pid > 0) kill(cur->child_pid, SIGKILL);
+
+        } else if (deadline_us < first_us)
+
+          first_us = deadline_us;
+
+      }
+
+      pfd[n].fd = cur->st_fd;
+      pfd[n].events = POLLIN;
+      ++n;
+
+    }
+
+    if (done) {
+
+      if ((res = read(e->st_fd, status, 4)) != 4) {
+
+        if (stop_soon) return NULL;
+        RPFATAL(res, "Unable to communicate with pool fork server");
+
+      }
+
+      e->busy = 0;
+      --pool_busy;
+
+      return e;
+
+    }
+
+    /* Round up, so that we never wake up early and spin. */
+
+    res = poll(pfd, n,
+               first_us == (u64)-1 ? -1 : (first_us - now_us + 999) / 1000);
+
+    if (res < 0) {
+
+      if (errno != EINTR) PFATAL("poll() failed");
+      if (stop_soon) return NULL;
+
+    }
+
+  }
+
+}
+
+/* Account for the exec e just finished and, like run_target() does, bring
+   its trace into trace_bits and classify it. Returns the fault. */
+
+static u8 finish_exec(struct executor* e, s32 status) {
+
+  if (!WIFSTOPPED(status)) e->child_pid = 0;
+
+  last_exec_us = e->done_us - e->start_us;
+  if (slowest_exec_ms < last_exec_us / 1000)
+    slowest_exec_ms = last_exec_us / 1000;
+
+  ++total_execs;
+
+  reset_trace_bits();
+  map_used = MIN(((trace_idx[0] + 63) / 64) * 64, map_size);
+  memcpy(trace_bits, e->bits, map_used);
+
+  classify_trace();
+
+  if (defrag_map && !(total_execs & (DEFRAG_SAMPLE_EXECS - 1)))
+    sample_slot_hits();
+
+  child_timed_out = e->timed_out;
+
+  if (WIFSIGNALED(status) && !stop_soon) {
+
+    kill_signal = WTERMSIG(status);
+
+    if (e->timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+
+    return FAULT_CRASH;
+
+  }
+
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
+
+    kill_signal = 0;
+    return FAULT_CRASH;
+
+  }
+
+  return FAULT_NONE;
+
+}
+
+/* Wait for the rest of the pool without looking at the results, when we
+   are about to bail out. Returns 1. */
+
+static u8 abandon_pool(void) {
+
+  s32 status;
+
+  while (pool_busy) {
+
+    struct executor* e = wait_for_executor(&status);
+
+    if (!e) {
+
+      stop_pool();
+      break;
+
+    }
+
+    finish_exec(e, status);
+
+  }
+
+  return 1;
+
+}
+
+/* Process the next result from the pool, the same way exec_and_save()
+   does after run_target(). Returns 1 if it's time to bail out. */
+
+static u8 save_next(char** argv) {
+
+  struct executor* e;
+
+  s32 status, byte = stage_cur_byte, val = stage_cur_val;
+  u8  fault;
+
+  e = wait_for_executor(&status);
+  if (!e) return abandon_pool();
+
+  fault = finish_exec(e, status);
+
+  if (stop_soon) return abandon_pool();
+
+  if (fault == FAULT_TMOUT) {
+
+    if (subseq_tmouts++ > TMOUT_LIMIT) {
+
+      ++cur_skipped_paths;
+      return abandon_pool();
+
+    }
+
+  } else
+
+    subseq_tmouts = 0;
+
+  if (skip_requested) {
+
+    skip_requested = 0;
+    ++cur_skipped_paths;
+    return abandon_pool();
+
+  }
+
+  /* The file name says which op made the test case, not the current one. */
+
+  stage_cur_byte = e->cur_byte;
+  stage_cur_val = e->cur_val;
+
+  queued_discovered += save_if_interesting(argv, e->mem, e->len, fault);
+
+  stage_cur_byte = byte;
+  stage_cur_val = val;
+
+  return 0;
+
+}
+
+/* Run a test case on the first idle executor, processing results while
+   there is none. Returns 1 if it's time to bail out. */
+
+u8 pool_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+
+  u32 i;
+
+  if (!pool_up) start_pool(argv);
+
+  /* Results may sit unread while we calibrate or send; time them now. */
+
+  note_pool_finished();
+
+  while (pool_busy == shm_pool_size)
+    if (save_next(argv)) return 1;
+
+  for (i = 0; pool[i].busy; ++i)
+    ;
+
+  send_to_executor(&pool[i], out_buf, len);
+
+  if (stop_soon) return abandon_pool();
+
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
+
+  return 0;
+
+}
+
+/* Process the results of everything the pool is still running. Returns 1
+   if it's time to bail out. */
+
+u8 drain_pool(char** argv) {
+
+  while (pool_busy)
+    if (save_next(argv)) return 1;
+
+  return 0;
+
+}
+
@@ -306,13 +306,15 @@ void trim_py(char** ret, size_t* retlen) {
 
 u8 trim_case_python(char** argv, struct queue_entry* q, u8* in_buf) {
 
-  static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8  tmp[64];
+  static u8* clean_trace;
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
   u32 orig_len = q->len;
 
+  if (!clean_trace) clean_trace = ck_alloc(map_size);
+
   stage_name = tmp;
   bytes_trim_in += q->len;
 
@@ -352,7 +354,7 @@ u8 trim_case_python(char** argv, struct queue_entry* q, u8* in_buf) {
 
     }
 
-    cksum = hash32_time(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = trace_cksum();
 
     if (cksum == q->exec_cksum) {
 
@@ -365,7 +367,7 @@ u8 trim_case_python(char** argv, struct queue_entry* q, u8* in_buf) {
       if (!needs_write) {
 
         needs_write = 1;
-        memcpy(clean_trace, trace_bits, MAP_SIZE);
+        memcpy(clean_trace, trace_bits, map_used);
 
       }
 
@@ -413,7 +415,10 @@ u8 trim_case_python(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_used);
+    trace_cache_valid = 0;
+    trace_sparse = 0;
+    trace_dirty = 0;
     update_bitmap_score(q);
 
   }
@@ -174,11 +174,17 @@ void update_bitmap_score(struct queue_entry* q) {
   u64 fav_factor = q->exec_us * q->len;
 
   /* For every byte set in trace_bits[], see if there is a previous winner,
-     and how it compares to us. */
+     and how it compares to us. Lines the dirty-line summary says were never
+     written to are skipped whole. */
 
   for (i = 0; i < map_used; ++i)
 
-    if (trace_bits[i]) {
+    if (trace_dirty && !(i & 63) &&
+        !(dirty_map[i >> DIRTY_WORD_SHIFT] & (1ULL << ((i >> 6) & 63))))
+
+      i += 63;
+
+    else if (trace_bits[i]) {
 
       if (top_rated[i]) {
 
@@ -226,11 +232,13 @@ void update_bitmap_score(struct queue_entry* q) {
 void cull_queue(void) {
 ///u64 ttt = get_cur_time_us();
   struct queue_entry* q;
-  static u8           temp_v[MAP_SIZE >> 3];
+  static u8*          temp_v;
   u32                 i;
 
   if (dumb_mode || !score_changed) return;
 
+  if (!temp_v) temp_v = ck_alloc(map_size >> 3);
+
   score_changed = 0;
 
   memset(temp_v, 255, map_used >> 3);
@@ -27,6 +27,95 @@
 
 #define STOP_CNT	1000000
 
+/* Read the wait status of a fork server's child from fd, but give up on
+   the child after timeout ms: kill pid, set child_timed_out and then read
+   the status the fork server reports for it. The deadline is kept on the
+   monotonic clock. Returns what read() did. */
+
+s32 read_status_timed(s32 fd, s32* status, u32 timeout, s32 pid) {
+
+  struct pollfd pfd;
+
+  u64 start_us = get_mono_time_us(), now_us = start_us;
+  u64 deadline_us = start_us + (u64)timeout * 1000;
+  s32 res;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (now_us < deadline_us) {
+
+    /* Round up, so that we never wake up early and spin. */
+
+    res = poll(&pfd, 1, (deadline_us - now_us + 999) / 1000);
+
+    if (res > 0) break;
+    if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+
+    now_us = get_mono_time_us();
+
+  }
+
+  if (now_us >= deadline_us && pid > 0) {
+
+    child_timed_out = 1;
+    kill(pid, SIGKILL);
+
+  }
+
+  return read(fd, status, 4);
+
+}
+
+/* The same for a batch (AFL_PERSISTENT_BATCH) in the works: timeout is
+   per test case, and the target bumps fuzz_batch->cur whenever it moves on
+   to the next one. So poll in steps of a quarter of the timeout, restart
+   the clock when cur changes, and kill pid once the test case it is on has
+   run for timeout ms. A hang costs at most 1.25 timeouts, not one per test
+   case queued. */
+
+static s32 read_batch_status(s32 fd, s32* status, u32 timeout, s32 pid) {
+
+  volatile u32* cur = &fuzz_batch->cur;
+
+  struct pollfd pfd;
+
+  u64 start_us = get_mono_time_us(), now_us = start_us;
+  u32 step = timeout / 4 + 1, seen = *cur;
+  s32 res;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (now_us < start_us + (u64)timeout * 1000) {
+
+    res = poll(&pfd, 1, step);
+
+    if (res > 0) break;
+    if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+
+    now_us = get_mono_time_us();
+
+    if (*cur != seen) {
+
+      seen = *cur;
+      start_us = now_us;
+
+    }
+
+  }
+
+  if (now_us >= start_us + (u64)timeout * 1000 && pid > 0) {
+
+    child_timed_out = 1;
+    kill(pid, SIGKILL);
+
+  }
+
+  return read(fd, status, 4);
+
+}
+
 /* Execute target application, monitoring for timeouts. Return status
    information. The called program will update trace_bits[]. */
 
@@ -34,10 +123,10 @@ u8 run_target(char** argv, u32 timeout) {
 
   static struct itimerval it;
   static u32              prev_timed_out = 0;
-  static u64              exec_ms = 0;
 
   int status = 0;
   u32 tb4;
+  u64 start_us;
 
   child_timed_out = 0;
 
@@ -46,10 +135,15 @@ u8 run_target(char** argv, u32 timeout) {
      territory. */
 
 //u64 ttt = get_cur_time_us();
-  memset(trace_bits, 0, map_used);
+  reset_trace_bits();
   MEM_BARRIER();
 //map_reset_time += get_cur_time_us() - ttt;
 
+  /* The exec time includes getting the child going. Fast targets may well
+     be done by the time we learn their PID. */
+
+  start_us = get_mono_time_us();
+
   /* If we're running in "dumb" mode, we can't rely on the fork server
      logic compiled into the target program, so we will just keep calling
      execve(). There is a bit of code duplication between here and
@@ -163,24 +257,35 @@ u8 run_target(char** argv, u32 timeout) {
   }
 
   /* Configure timeout, as requested by user, then wait for child to terminate.
-   */
+     Without a fork server that is still up to setitimer() and the SIGALRM
+     handler, which kills child_pid and sets child_timed_out. With one, we
+     wait on the status pipe with a deadline instead, which needs no signals
+     and fewer syscalls. */
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
-
-  setitimer(ITIMER_REAL, &it, NULL);
+  if (dumb_mode == 1 || no_forkserver) {
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+    it.it_value.tv_sec = (timeout / 1000);
+    it.it_value.tv_usec = (timeout % 1000) * 1000;
 
-  if (dumb_mode == 1 || no_forkserver) {
+    setitimer(ITIMER_REAL, &it, NULL);
 
     if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
 
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+
+    setitimer(ITIMER_REAL, &it, NULL);
+
   } else {
 
     s32 res;
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+    if (fuzz_batch && fuzz_batch->cnt)
+      res = read_batch_status(fsrv_st_fd, &status, timeout, child_pid);
+    else
+      res = read_status_timed(fsrv_st_fd, &status, timeout, child_pid);
+
+    if (res != 4) {
 
       if (stop_soon) return 0;
       SAYF(
@@ -210,15 +315,11 @@ u8 run_target(char** argv, u32 timeout) {
 
   if (!WIFSTOPPED(status)) child_pid = 0;
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms =
-      (u64)timeout - (it.it_value.tv_sec * 1000 + it.it_value.tv_usec / 1000);
-  if (slowest_exec_ms < exec_ms) slowest_exec_ms = exec_ms;
-
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  last_exec_us = get_mono_time_us() - start_us;
+  if (slowest_exec_ms < last_exec_us / 1000)
+    slowest_exec_ms = last_exec_us / 1000;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  if (shm_pool_size) note_pool_finished();
 
   ++total_execs;
   //if(total_execs == STOP_CNT)	stop_soon = 1;
@@ -231,16 +332,15 @@ u8 run_target(char** argv, u32 timeout) {
 
 //exec_time += get_cur_time_us() - ttt;
   tb4 = *(u32*)trace_bits;
-  map_used = ((trace_idx[0] + 63) / 64) * 64;	//align to 64
+  map_used = MIN(((trace_idx[0] + 63) / 64) * 64, map_size);	//align to 64
 
 //ttt = get_cur_time_us();
-#ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif                                                     /* ^WORD_SIZE_64 */
+  classify_trace();
 //map_classify_time += get_cur_time_us() - ttt;
 
+  if (defrag_map && !(total_execs & (DEFRAG_SAMPLE_EXECS - 1)))
+    sample_slot_hits();
+
   prev_timed_out = child_timed_out;
 
   /* Report outcome to caller. */
@@ -274,7 +374,8 @@ u8 run_target(char** argv, u32 timeout) {
 
 /* Write modified data to file for testing. If out_file is set, the old file
    is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+   truncated. Targets that take their test cases from shared memory get
+   them copied there instead, without any syscalls. */
 
 void write_to_testcase(void* mem, u32 len) {
   //u64 ttt = get_cur_time_us();
@@ -300,6 +401,24 @@ void write_to_testcase(void* mem, u32 len) {
 
 #endif
 
+  if (shm_fuzz_on) {
+
+    if (pre_save_handler) {
+
+      u8* new_data;
+      len = pre_save_handler(mem, len, &new_data);
+      mem = new_data;
+
+    }
+
+    if (len > MAX_FILE) len = MAX_FILE;
+
+    memcpy(shm_fuzz_buf, mem, len);
+    *shm_fuzz_len = len;
+    return;
+
+  }
+
   if (out_file) {
 
     if (no_unlink) {
@@ -349,6 +468,15 @@ void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  if (shm_fuzz_on) {
+
+    memcpy(shm_fuzz_buf, mem, skip_at);
+    memcpy(shm_fuzz_buf + skip_at, (u8*)mem + skip_at + skip_len, tail_len);
+    *shm_fuzz_len = len - skip_len;
+    return;
+
+  }
+
   if (out_file) {
 
     if (no_unlink) {
@@ -391,12 +519,12 @@ void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
 u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem, u32 handicap,
                   u8 from_queue) {
 
-  static u8 first_trace[MAP_SIZE];
+  static u8* first_trace;
 
   u8 fault = 0, new_bits = 0, var_detected = 0,
      first_run = (q->exec_cksum == 0);
 
-  u64 start_us, stop_us;
+  u64 exec_us = 0;
 
   s32 old_sc = stage_cur, old_sm = stage_max;
   u32 use_tmout = exec_tmout;
@@ -422,12 +550,12 @@ u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem, u32 handicap,
   if (dumb_mode != 1 && !no_forkserver && !cmplog_forksrv_pid && cmplog_mode)
     init_cmplog_forkserver(argv);
 
+  if (!first_trace) first_trace = ck_alloc(map_size);
+
   //u64 ttt = get_cur_time_us();
   if (q->exec_cksum) memcpy(first_trace, trace_bits, map_used);
   //map_copy_time += get_cur_time_us() - ttt;
 
-  start_us = get_cur_time_us();
-
   for (stage_cur = 0; stage_cur < stage_max; ++stage_cur) {
 
     u32 cksum;
@@ -437,6 +565,7 @@ u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem, u32 handicap,
     write_to_testcase(use_mem, q->len);
 
     fault = run_target(argv, use_tmout);
+    exec_us += last_exec_us;
 
     /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
        we want to bail out quickly. */
@@ -450,12 +579,13 @@ u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem, u32 handicap,
 
     }
 
-    cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+    cksum = trace_cksum();
 
     if (q->exec_cksum != cksum) {
 
       u8 hnb = has_new_bits(virgin_bits);
       if (hnb > new_bits) new_bits = hnb;
+      if (hnb && global_virgin) has_new_bits_global();
 
 //ttt = get_cur_time_us();
       if (q->exec_cksum) {
@@ -486,15 +616,15 @@ u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem, u32 handicap,
 
   }
 
-  stop_us = get_cur_time_us();
-
-  total_cal_us += stop_us - start_us;
+  total_cal_us += exec_us;
   total_cal_cycles += stage_max;
 
   /* OK, let's collect some stats about the performance of this test case.
-     This is used for fuzzing air time calculations in calculate_score(). */
+     This is used for fuzzing air time calculations in calculate_score(). It
+     is the time the target took, as run_target() measured it, so it does not
+     include our own per-exec overhead. */
 
-  q->exec_us = (stop_us - start_us) / stage_max;
+  q->exec_us = exec_us / stage_max;
   q->bitmap_size = count_bytes(trace_bits);
   q->handicap = handicap;
   q->cal_failed = 0;
@@ -695,8 +825,8 @@ u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
   if (py_functions[PY_FUNC_TRIM]) return trim_case_python(argv, q, in_buf);
 #endif
 
-  static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8  tmp[64];
+  static u8* clean_trace;
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
@@ -709,6 +839,8 @@ u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   if (q->len < 5) return 0;
 
+  if (!clean_trace) clean_trace = ck_alloc(map_size);
+
   stage_name = tmp;
   bytes_trim_in += q->len;
 
@@ -744,7 +876,7 @@ u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32_time(trace_bits, map_used, HASH_CONST);
+      cksum = trace_cksum();
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -810,6 +942,9 @@ u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     close(fd);
 
     memcpy(trace_bits, clean_trace, map_used);
+    trace_cache_valid = 0;
+    trace_sparse = 0;
+    trace_dirty = 0;
     update_bitmap_score(q);
 
   }
@@ -821,21 +956,13 @@ abort_trimming:
 
 }
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+/* Run a test case and process the results. Returns 1 if it's time to bail
+   out. */
 
-u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+static u8 exec_and_save(char** argv, u8* out_buf, u32 len) {
 
   u8 fault;
 
-  if (post_handler) {
-
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len) return 0;
-
-  }
-
   write_to_testcase(out_buf, len);
 
   fault = run_target(argv, exec_tmout);
@@ -877,3 +1004,113 @@ u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
 }
 
+/* Batched persistent mode (AFL_PERSISTENT_BATCH). In the stages that have
+   fuzz_one() set batch_stage, common_fuzz_stuff() only queues the test case
+   in fuzz_batch, and run_batch() hands all of them to the target in one
+   fork server round trip. The target runs them back to back and checks
+   each trace against a copy of virgin_bits; the ones it flags, the one it
+   crashed or hung on and those it never got to then take the usual path
+   through save_if_interesting(), one exec each.
+
+   With AFL_EXEC_POOL, the same stages go to the executor pool instead (see
+   afl-fuzz-pool.c), and run_batch() waits for what it is still running. */
+
+static u32 batch_cnt,                  /* Test cases queued                 */
+    batch_used;                        /* Bytes of fuzz_batch->data in use  */
+
+u8 run_batch(char** argv) {
+
+  struct fuzz_batch* b = fuzz_batch;
+
+  u32 n = batch_cnt, done, i;
+  u64 slowest = slowest_exec_ms;
+  u8  fault;
+
+  if (shm_pool_size) return drain_pool(argv);
+
+  if (!n) return 0;
+
+  batch_cnt = batch_used = 0;
+
+  memcpy(b->virgin, virgin_bits, map_used);
+  b->virgin_len = map_used;
+  b->tmout_us = exec_tmout * 1000;
+  b->cur = 0;
+  b->cnt = n;
+
+  /* run_target() sees the batch and applies exec_tmout to each test case
+     in turn, see read_batch_status(). */
+
+  fault = run_target(argv, exec_tmout);
+
+  /* That was one exec as far as run_target() could tell. */
+
+  b->cnt = 0;
+  slowest_exec_ms = slowest;
+
+  if (stop_soon) return 1;
+
+  done = MIN(b->cur, n);
+  if (done + (done < n && fault) > 1)
+    total_execs += done + (done < n && fault) - 1;
+
+  for (i = 0; i < n; ++i) {
+
+    if (i < done && !b->res[i]) continue;
+
+    if (exec_and_save(argv, b->data + b->off[i], b->len[i])) return 1;
+
+  }
+
+  return 0;
+
+}
+
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
+
+u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+
+  if (post_handler) {
+
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len) return 0;
+
+  }
+
+  if (!batch_stage || pre_save_handler)
+    return exec_and_save(argv, out_buf, len);
+
+  if (shm_pool_size) return pool_fuzz_stuff(argv, out_buf, len);
+
+  if (!batch_on) return exec_and_save(argv, out_buf, len);
+
+  if (len > MAX_FILE) len = MAX_FILE;
+
+  if ((batch_cnt == shm_batch_size || batch_used + len > MAX_FILE) &&
+      run_batch(argv))
+    return 1;
+
+  if (skip_requested) {
+
+    skip_requested = 0;
+    batch_cnt = batch_used = 0;
+    ++cur_skipped_paths;
+    return 1;
+
+  }
+
+  fuzz_batch->off[batch_cnt] = batch_used;
+  fuzz_batch->len[batch_cnt] = len;
+  memcpy(fuzz_batch->data + batch_used, out_buf, len);
+
+  ++batch_cnt;
+  batch_used += len;
+
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
+
+  return 0;
+
+}
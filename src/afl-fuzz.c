@@ -410,7 +410,6 @@ int main(int argc, char** argv) {
         if (in_bitmap) FATAL("Multiple -B options not supported");
 
         in_bitmap = optarg;
-        read_bitmap(in_bitmap);
         break;
 
       case 'C':                                               /* crash mode */
@@ -711,6 +710,23 @@ int main(int argc, char** argv) {
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue = 1;
   if (getenv("AFL_FAST_CAL")) fast_cal = 1;
 
+  if (getenv("AFL_SHARED_VIRGIN")) shared_virgin = 1;
+
+  if (getenv("AFL_SHARED_IDX") || shared_virgin) {
+
+    if (!sync_id) FATAL("AFL_SHARED_IDX and AFL_SHARED_VIRGIN need -M or -S");
+    shared_idx_dir = sync_dir;
+
+  }
+
+  if (getenv("AFL_DEFRAG_MAP")) {
+
+    if (shared_idx_dir)
+      FATAL("AFL_DEFRAG_MAP and AFL_SHARED_IDX are mutually exclusive");
+    defrag_map = 1;
+
+  }
+
   if (getenv("AFL_HANG_TMOUT")) {
 
     hang_tmout = atoi(getenv("AFL_HANG_TMOUT"));
@@ -718,6 +734,34 @@ int main(int argc, char** argv) {
 
   }
 
+  if (getenv("AFL_PERSISTENT_BATCH")) {
+
+    shm_batch_size = atoi(getenv("AFL_PERSISTENT_BATCH"));
+
+    if (shm_batch_size < 2 || shm_batch_size > FUZZ_BATCH_MAX)
+      FATAL("Bad value of AFL_PERSISTENT_BATCH (must be between 2 and %u)",
+            FUZZ_BATCH_MAX);
+
+  }
+
+  if (getenv("AFL_EXEC_POOL")) {
+
+    shm_pool_size = atoi(getenv("AFL_EXEC_POOL"));
+
+    if (shm_pool_size < 2 || shm_pool_size > EXEC_POOL_MAX)
+      FATAL("Bad value of AFL_EXEC_POOL (must be between 2 and %u)",
+            EXEC_POOL_MAX);
+
+    if (shm_batch_size)
+      FATAL("AFL_EXEC_POOL and AFL_PERSISTENT_BATCH are mutually exclusive");
+
+    if (dumb_mode || no_forkserver)
+      FATAL("AFL_EXEC_POOL needs the fork server");
+
+  }
+
+  if (getenv("AFL_SNAPSHOT")) setenv(SNAPSHOT_ENV_VAR, "1", 1);
+
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
@@ -813,13 +857,14 @@ int main(int argc, char** argv) {
 
   setup_post();
   setup_custom_mutator();
+  init_map_size();
+  shm_fuzz_mode = !dumb_mode;
+  if (dumb_mode) shm_batch_size = 0;
   setup_shm(dumb_mode);
-
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  setup_forkserver_cleanup();
 
   init_count_class16();
+  init_bitmap_kernels();
 
   setup_dirs_fds();
 
@@ -893,6 +938,17 @@ int main(int argc, char** argv) {
 
     use_argv = argv + optind;
 
+  /* Bring up the fork server before sizing the bitmaps, the target tells us
+     how big its map is during the handshake. A saved index table has to be
+     in place before that, so the target keeps using the same slots. */
+
+  load_index_table();
+
+  if (dumb_mode != 1 && !no_forkserver) init_forkserver(use_argv);
+
+  check_index_table();
+  setup_bitmaps();
+
   ///u64 ttt = get_cur_time_us();
   perform_dry_run(use_argv);
 
@@ -967,6 +1023,9 @@ int main(int argc, char** argv) {
 
       prev_queued = queued_paths;
 
+      if (defrag_map) maybe_defrag_map(use_argv);
+      maybe_switch_laf(use_argv);
+
       if (sync_id && queue_cycle == 1 && getenv("AFL_IMPORT_FIRST"))
         sync_fuzzers(use_argv);
 
@@ -1022,19 +1081,13 @@ int main(int argc, char** argv) {
    * AFL_EXIT_WHEN_DONE or AFL_BENCH_UNTIL_CRASH) the child and forkserver
    * where not killed?
    */
-  /* if we stopped programmatically, we kill the forkserver and the current
-     runner. if we stopped manually, this is done by the signal handler */
-  if (stop_soon == 2) {
-
-    if (child_pid > 0) kill(child_pid, SIGKILL);
-    if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
-    /* Now that we've killed the forkserver, we wait for it to be able to get
-     * rusage stats. */
-    if (waitpid(forksrv_pid, NULL, 0) <= 0) { WARNF("error waitpid\n"); }
-
-  }
+  /* we kill the forkservers and the current runners, which may be stopped
+     persistent children, however we stopped (after Ctrl-C, the signal
+     handler has only sent the signals). We wait for them to be able to get
+     rusage stats, and so that they no longer hold the shared index table. */
+  stop_all_forkservers();
 
-  //write_bitmap();
+  write_bitmap();
   write_stats_file(0, 0, 0);
   maybe_update_plot_file(0, 0);
   save_auto();
@@ -36,6 +36,7 @@
 #include "hash.h"
 #include "sharedmem.h"
 #include "cmplog.h"
+#include "batch.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -53,6 +54,11 @@
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+
+#ifndef __APPLE__
+#include <elf.h>
+#endif
 
 #ifndef USEMMAP
 #include <sys/ipc.h>
@@ -67,6 +73,10 @@ extern u32 map_used;
 //                                    BigMap
 //==============================================================================
 u8 disable_hugepage = 0;
+u32 map_size = MAP_SIZE;               /* First-level slots in the SHM maps */
+u32* touch_log;                        /* Slots touched by the last exec    */
+u64* dirty_map;                        /* Map lines written by the last exec*/
+u8*  laf_flags;                        /* Laf-intel site switches and state */
 
 #ifdef USEMMAP
 /* ================ Proteas ================ */
@@ -78,11 +88,157 @@ char           g_shm_file_path[L_tmpnam];
 static s32 shm_id;                     /* ID of the SHM region              */
 static s32 cmplog_shm_id;
 static s32 shm_idx_id;
+static s32 shm_virgin_id = -1;         /* Fleet-wide virgin map, if any     */
+static u8* shm_virgin_ptr;             /* ...and where we attached it       */
+static s32 shm_touch_id;
+static s32 shm_dirty_id;
+static s32 shm_laf_id;
+static s32 shm_fuzz_id;
+static s32 shm_batch_id;
+static s32* shm_pool_ids;              /* Map and test case IDs per executor*/
 #endif
 
+static u8 remove_shm_registered;
+
+u8* shared_idx_dir;                    /* Dir keying the shared index table */
+u8  shared_idx_fresh;                  /* Did we create the shared table?   */
+
 int             cmplog_mode;
 struct cmp_map *cmp_map;
 
+u8   shm_fuzz_mode;                    /* Offer test cases through SHM?     */
+u32* shm_fuzz_len;                     /* Length of the current test case   */
+u8*  shm_fuzz_buf;                     /* ...and its MAX_FILE bytes of data */
+
+u32                shm_batch_size;     /* Test cases per batch, 0 for none  */
+struct fuzz_batch* fuzz_batch;         /* Where they are queued             */
+
+u32   shm_pool_size;                   /* Pool executors, 0 for none        */
+u8**  pool_bits;                       /* Their trace maps                  */
+u32** pool_fuzz_len;                   /* ...and test case buffers, if any  */
+
+#ifndef USEMMAP
+
+/* Find (or create) a segment shared by all instances syncing through
+   shared_idx_dir. Segments are keyed off a lock file in that directory plus
+   proj. The lock is still held on return, so the caller can initialize a
+   fresh segment before anybody else attaches; drop it with unlock_shared(). */
+
+static s32 shared_lock_fd = -1;
+
+/* Take the lock that serializes attaching to and removing the shared
+   segments. Returns the name of the lock file, which keys them. */
+
+static u8* lock_shared(void) {
+
+  u8* fn = alloc_printf("%s/.bigmap_idx.lock", shared_idx_dir);
+
+  /* We get here before afl-fuzz sets up its output dirs. */
+
+  if (mkdir(shared_idx_dir, 0700) && errno != EEXIST)
+    PFATAL("Unable to create '%s'", shared_idx_dir);
+
+  shared_lock_fd = open(fn, O_RDWR | O_CREAT, 0600);
+
+  if (shared_lock_fd < 0) PFATAL("Unable to create '%s'", fn);
+  if (flock(shared_lock_fd, LOCK_EX)) PFATAL("flock() failed");
+
+  return fn;
+
+}
+
+static void* attach_shared(u8 proj, u32 size, s32* id, u8* fresh) {
+
+  u8*   fn = lock_shared();
+  s32   flags = 0600;
+  key_t key;
+  void* ret;
+
+  key = ftok(fn, proj);
+  if (key == -1) PFATAL("ftok() failed");
+
+  ck_free(fn);
+
+  if (!disable_hugepage) flags |= SHM_HUGETLB;
+
+  *id = shmget(key, size, IPC_CREAT | IPC_EXCL | flags);
+  *fresh = *id >= 0;
+
+  if (!*fresh) {
+
+    if (errno != EEXIST) PFATAL("shmget() failed");
+    *id = shmget(key, size, flags);
+    if (*id < 0) PFATAL("shmget() failed");
+
+  }
+
+  ret = shmat(*id, NULL, 0);
+  if (ret == (void*)-1) PFATAL("shmat() failed");
+
+  return ret;
+
+}
+
+static void unlock_shared(void) {
+
+  flock(shared_lock_fd, LOCK_UN);
+  close(shared_lock_fd);
+  shared_lock_fd = -1;
+
+}
+
+/* Detach from a shared segment, and drop it once nobody else has it
+   attached anymore. Removing it earlier would hand the next instance to
+   start a fresh, diverging copy; keeping it longer would have the next
+   campaign pick up a stale table, maybe from some other binary. So this
+   runs under the lock, and afl-fuzz stops its fork servers first (see
+   stop_all_forkservers()), as they and their targets are attached too. */
+
+static void remove_shared(s32 id, void* ptr) {
+
+  struct shmid_ds ds;
+
+  if (id < 0) return;
+
+  if (shared_lock_fd < 0) ck_free(lock_shared());
+
+  if (ptr) shmdt(ptr);
+
+  if (!shmctl(id, IPC_STAT, &ds) && !ds.shm_nattch) shmctl(id, IPC_RMID, NULL);
+
+}
+
+static u8 map_pow2(void) {
+
+  u8 pow2 = 0;
+
+  while ((1U << pow2) < map_size)
+    ++pow2;
+
+  return pow2;
+
+}
+
+/* Attach to the shared index table, initializing it if we are first. */
+
+static void setup_shared_idx(void) {
+
+  trace_idx = attach_shared(map_pow2(), map_size * sizeof(u32), &shm_idx_id,
+                            &shared_idx_fresh);
+
+  if (shared_idx_fresh) {
+
+    memset(trace_idx, 255, map_size * sizeof(u32));
+    trace_idx[0] = 0;
+
+  }
+
+  unlock_shared();
+
+}
+
+#endif                                                        /* !USEMMAP */
+
 /* Get rid of shared memory (atexit handler). */
 
 void remove_shm(void) {
@@ -90,7 +246,7 @@ void remove_shm(void) {
 #ifdef USEMMAP
   if (g_shm_base != NULL) {
 
-    munmap(g_shm_base, MAP_SIZE);
+    munmap(g_shm_base, map_size);
     g_shm_base = NULL;
 
   }
@@ -104,8 +260,59 @@ void remove_shm(void) {
 
 #else
   shmctl(shm_id, IPC_RMID, NULL);
-  shmctl(shm_idx_id, IPC_RMID, NULL);
+
+  if (shared_idx_dir) {
+
+    remove_shared(shm_idx_id, trace_idx);
+    remove_shared(shm_virgin_id, shm_virgin_ptr);
+    trace_idx = NULL;
+    shm_virgin_id = -1;
+    shm_virgin_ptr = NULL;
+    unlock_shared();
+
+  } else
+
+    shmctl(shm_idx_id, IPC_RMID, NULL);
+
+  shmctl(shm_touch_id, IPC_RMID, NULL);
+  shmctl(shm_dirty_id, IPC_RMID, NULL);
+  shmctl(shm_laf_id, IPC_RMID, NULL);
+
   if (cmplog_mode) shmctl(cmplog_shm_id, IPC_RMID, NULL);
+  if (shm_fuzz_mode) shmctl(shm_fuzz_id, IPC_RMID, NULL);
+  if (shm_batch_size) shmctl(shm_batch_id, IPC_RMID, NULL);
+
+  if (shm_pool_size) {
+
+    u32 i;
+
+    for (i = 0; i < shm_pool_size * 2; ++i)
+      if (shm_pool_ids[i] >= 0) shmctl(shm_pool_ids[i], IPC_RMID, NULL);
+
+  }
+
+#endif
+
+}
+
+/* Attach to the fleet-wide virgin map that goes with the shared index
+   table. Only afl-fuzz needs this, and only after the map size is final. */
+
+u8* setup_shared_virgin(void) {
+
+#ifdef USEMMAP
+  FATAL("Shared virgin maps are not supported with USEMMAP");
+#else
+  u8  fresh;
+  u8* ret;
+
+  ret = attach_shared(map_pow2() | 0x80, map_size, &shm_virgin_id, &fresh);
+  if (fresh) memset(ret, 255, map_size);
+  shm_virgin_ptr = ret;
+
+  unlock_shared();
+
+  return ret;
 #endif
 
 }
@@ -115,6 +322,8 @@ void remove_shm(void) {
 void setup_shm(unsigned char dumb_mode) {
 
 #ifdef USEMMAP
+  if (shm_pool_size) FATAL("Executor pools are not supported with USEMMAP");
+
   /* generate random file name for multi instance */
 
   /* thanks to f*cking glibc we can not use tmpnam securely, it generates a
@@ -127,7 +336,7 @@ void setup_shm(unsigned char dumb_mode) {
   if (g_shm_fd == -1) { PFATAL("shm_open() failed"); }
 
   /* configure the size of the shared memory segment */
-  if (ftruncate(g_shm_fd, MAP_SIZE)) {
+  if (ftruncate(g_shm_fd, map_size)) {
 
     PFATAL("setup_shm(): ftruncate() failed");
 
@@ -135,7 +344,7 @@ void setup_shm(unsigned char dumb_mode) {
 
   /* map the shared memory segment to the address space of the process */
   g_shm_base =
-      mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, g_shm_fd, 0);
+      mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, g_shm_fd, 0);
   if (g_shm_base == MAP_FAILED) {
 
     close(g_shm_fd);
@@ -144,7 +353,12 @@ void setup_shm(unsigned char dumb_mode) {
 
   }
 
-  atexit(remove_shm);
+  if (!remove_shm_registered) {
+
+    atexit(remove_shm);
+    remove_shm_registered = 1;
+
+  }
 
   /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
      we don't want them to detect instrumentation, since we won't be sending
@@ -153,29 +367,66 @@ void setup_shm(unsigned char dumb_mode) {
 
   if (!dumb_mode) setenv(SHM_ENV_VAR, g_shm_file_path, 1);
 
+  /* Without this, targets built for a bigger map assume MAP_SIZE and stay
+     off ours even after resize_shm(). */
+
+  if (!dumb_mode) {
+
+    u8* shm_str = alloc_printf("%u", map_size);
+    setenv(MAP_SIZE_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+  }
+
   trace_bits = g_shm_base;
 
   if (!trace_bits) PFATAL("mmap() failed");
 
 #else
   u8 *shm_str;
+  u32 i;
 
   if(disable_hugepage){
-    shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+    shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600);
   } else {
-    shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600 | SHM_HUGETLB);
+    shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600 | SHM_HUGETLB);
   }
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
-  if(disable_hugepage){
-    shm_idx_id = shmget(IPC_PRIVATE, MAP_SIZE * sizeof(u32), IPC_CREAT | IPC_EXCL | 0600);
+  if (shared_idx_dir) {
+
+    setup_shared_idx();
+
   } else {
-    shm_idx_id = shmget(IPC_PRIVATE, MAP_SIZE * sizeof(u32), IPC_CREAT | IPC_EXCL | 0600 | SHM_HUGETLB);
+
+    if(disable_hugepage){
+      shm_idx_id = shmget(IPC_PRIVATE, map_size * sizeof(u32), IPC_CREAT | IPC_EXCL | 0600);
+    } else {
+      shm_idx_id = shmget(IPC_PRIVATE, map_size * sizeof(u32), IPC_CREAT | IPC_EXCL | 0600 | SHM_HUGETLB);
+    }
+
+    if (shm_idx_id < 0) PFATAL("shmget() failed");
+
   }
-  
 
-  if (shm_idx_id < 0) PFATAL("shmget() failed");
+  /* The touch log, the dirty-line summary and the laf-intel switches are
+     tiny, no point in huge pages. */
+
+  shm_touch_id = shmget(IPC_PRIVATE, (TOUCH_LOG_SIZE + 2) * sizeof(u32),
+                        IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_touch_id < 0) PFATAL("shmget() failed");
+
+  shm_dirty_id =
+      shmget(IPC_PRIVATE, (map_size >> DIRTY_WORD_SHIFT) * sizeof(u64),
+             IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_dirty_id < 0) PFATAL("shmget() failed");
+
+  shm_laf_id = shmget(IPC_PRIVATE, LAF_SITES * 2, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_laf_id < 0) PFATAL("shmget() failed");
 
   if (cmplog_mode) {
 
@@ -186,7 +437,68 @@ void setup_shm(unsigned char dumb_mode) {
 
   }
 
-  atexit(remove_shm);
+  if (shm_fuzz_mode) {
+
+    shm_fuzz_id = shmget(IPC_PRIVATE, sizeof(u32) + MAX_FILE,
+                         IPC_CREAT | IPC_EXCL | 0600);
+
+    if (shm_fuzz_id < 0) PFATAL("shmget() failed");
+
+  }
+
+  if (shm_batch_size) {
+
+    shm_batch_id = shmget(IPC_PRIVATE, sizeof(struct fuzz_batch) + map_size,
+                          IPC_CREAT | IPC_EXCL | 0600);
+
+    if (shm_batch_id < 0) PFATAL("shmget() failed");
+
+  }
+
+  /* Every pool executor gets a trace map and, if we offer test cases
+     through SHM, a buffer for them. remove_shm() skips IDs left at -1. */
+
+  if (shm_pool_size) {
+
+    if (!shm_pool_ids) {
+
+      shm_pool_ids = ck_alloc(shm_pool_size * 2 * sizeof(s32));
+      pool_bits = ck_alloc(shm_pool_size * sizeof(u8*));
+      pool_fuzz_len = ck_alloc(shm_pool_size * sizeof(u32*));
+
+    }
+
+    for (i = 0; i < shm_pool_size * 2; ++i)
+      shm_pool_ids[i] = -1;
+
+    for (i = 0; i < shm_pool_size; ++i) {
+
+      shm_pool_ids[i * 2] =
+          shmget(IPC_PRIVATE, map_size,
+                 IPC_CREAT | IPC_EXCL | 0600 |
+                     (disable_hugepage ? 0 : SHM_HUGETLB));
+
+      if (shm_pool_ids[i * 2] < 0) PFATAL("shmget() failed");
+
+      if (shm_fuzz_mode) {
+
+        shm_pool_ids[i * 2 + 1] = shmget(IPC_PRIVATE, sizeof(u32) + MAX_FILE,
+                                         IPC_CREAT | IPC_EXCL | 0600);
+
+        if (shm_pool_ids[i * 2 + 1] < 0) PFATAL("shmget() failed");
+
+      }
+
+    }
+
+  }
+
+  if (!remove_shm_registered) {
+
+    atexit(remove_shm);
+    remove_shm_registered = 1;
+
+  }
 
   shm_str = alloc_printf("%d", shm_id);
 
@@ -204,6 +516,25 @@ void setup_shm(unsigned char dumb_mode) {
   if (!dumb_mode) setenv(SHM_IDX_ENV_VAR, shm_str, 1);
   ck_free(shm_str);
 
+  shm_str = alloc_printf("%u", map_size);
+  if (!dumb_mode) setenv(MAP_SIZE_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  /* The pool's traces are all looked at through trace_bits, which has no
+     touch log or dirty lines to go with them, so keep everyone off those. */
+
+  shm_str = alloc_printf("%d", shm_touch_id);
+  if (!dumb_mode && !shm_pool_size) setenv(SHM_TOUCH_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  shm_str = alloc_printf("%d", shm_dirty_id);
+  if (!dumb_mode && !shm_pool_size) setenv(SHM_DIRTY_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  shm_str = alloc_printf("%d", shm_laf_id);
+  if (!dumb_mode) setenv(SHM_LAF_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
   if (cmplog_mode) {
 
     shm_str = alloc_printf("%d", cmplog_shm_id);
@@ -214,19 +545,264 @@ void setup_shm(unsigned char dumb_mode) {
 
   }
 
+  if (shm_fuzz_mode) {
+
+    shm_str = alloc_printf("%d", shm_fuzz_id);
+    if (!dumb_mode) setenv(SHM_FUZZ_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+  }
+
+  if (shm_batch_size) {
+
+    shm_str = alloc_printf("%d", shm_batch_id);
+    if (!dumb_mode) setenv(SHM_BATCH_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+  }
+
   trace_bits = shmat(shm_id, NULL, 0);
   if (!trace_bits) PFATAL("shmat() failed");
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
+
+  if (!shared_idx_dir) {
+
+    trace_idx = shmat(shm_idx_id, NULL, 0);
+    if (!trace_idx) PFATAL("shmat() failed");
+    memset(trace_idx, 255, map_size * sizeof(u32));
+    trace_idx[0] = 0;
+
+  }
 
-  trace_idx = shmat(shm_idx_id, NULL, 0);
-  if (!trace_idx) PFATAL("shmat() failed");
-  memset(trace_idx, 255, MAP_SIZE * sizeof(u32));
-  trace_idx[0] = 0;
   map_used = 0;
 
+  touch_log = shmat(shm_touch_id, NULL, 0);
+  if (touch_log == (void*)-1) PFATAL("shmat() failed");
+  touch_log[0] = 0;
+
+  dirty_map = shmat(shm_dirty_id, NULL, 0);
+  if (dirty_map == (void*)-1) PFATAL("shmat() failed");
+
+  laf_flags = shmat(shm_laf_id, NULL, 0);
+  if (laf_flags == (void*)-1) PFATAL("shmat() failed");
+
   if (cmplog_mode) cmp_map = shmat(cmplog_shm_id, NULL, 0);
 
+  if (shm_fuzz_mode) {
+
+    shm_fuzz_len = shmat(shm_fuzz_id, NULL, 0);
+    if (shm_fuzz_len == (void*)-1) PFATAL("shmat() failed");
+    shm_fuzz_buf = (u8*)(shm_fuzz_len + 1);
+
+  }
+
+  if (shm_batch_size) {
+
+    fuzz_batch = shmat(shm_batch_id, NULL, 0);
+    if (fuzz_batch == (void*)-1) PFATAL("shmat() failed");
+    fuzz_batch->cnt = 0;
+
+  }
+
+  for (i = 0; i < shm_pool_size; ++i) {
+
+    pool_bits[i] = shmat(shm_pool_ids[i * 2], NULL, 0);
+    if (pool_bits[i] == (void*)-1) PFATAL("shmat() failed");
+    memset(pool_bits[i], 0, map_size);
+
+    if (shm_fuzz_mode) {
+
+      pool_fuzz_len[i] = shmat(shm_pool_ids[i * 2 + 1], NULL, 0);
+      if (pool_fuzz_len[i] == (void*)-1) PFATAL("shmat() failed");
+
+    }
+
+  }
+
+#endif
+
+}
+
+/* Point the trace map and test case buffer in the environment at those of
+   pool executor i, for a fork server about to be started, or back at ours
+   for i < 0. */
+
+void set_pool_shm_env(s32 i) {
+
+#ifndef USEMMAP
+  u8* shm_str;
+
+  shm_str = alloc_printf("%d", i < 0 ? shm_id : shm_pool_ids[i * 2]);
+  setenv(SHM_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  if (shm_fuzz_mode) {
+
+    shm_str = alloc_printf("%d", i < 0 ? shm_fuzz_id : shm_pool_ids[i * 2 + 1]);
+    setenv(SHM_FUZZ_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+  }
+
 #endif
 
 }
 
+/* Tear down the current segments and set up new ones with room for
+   new_size first-level slots. Called when the target reports a map size
+   other than ours in the forkserver handshake. */
+
+void resize_shm(u32 new_size) {
+
+  remove_shm();
+
+#ifndef USEMMAP
+  shmdt(trace_bits);
+  shmdt(trace_idx);
+  shmdt(touch_log);
+  shmdt(dirty_map);
+  shmdt(laf_flags);
+  if (cmplog_mode) shmdt(cmp_map);
+  if (shm_fuzz_mode) shmdt(shm_fuzz_len);
+  if (shm_batch_size) shmdt(fuzz_batch);
+
+  if (shm_pool_size) {
+
+    u32 i;
+
+    for (i = 0; i < shm_pool_size; ++i) {
+
+      shmdt(pool_bits[i]);
+      if (shm_fuzz_mode) shmdt(pool_fuzz_len[i]);
+
+    }
+
+  }
+
+#endif
+
+  map_size = new_size;
+  setup_shm(0);
+
+}
+
+/* Pick the initial map size. AFL_MAP_SIZE_POW2 lets the user size the SHM
+   regions up front, which saves the forkserver a restart and is the only
+   way to get a bigger map for targets that fit_map_size() can't read. */
+
+void init_map_size(void) {
+
+  u8* x = getenv("AFL_MAP_SIZE_POW2");
+
+  if (x) {
+
+    u32 pow2 = atoi(x);
+
+    if (pow2 < MAP_SIZE_POW2_MIN || pow2 > MAP_SIZE_POW2_MAX)
+      FATAL("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)",
+            MAP_SIZE_POW2_MIN, MAP_SIZE_POW2_MAX);
+
+    map_size = 1U << pow2;
+
+  }
+
+}
+
+#ifndef __APPLE__
+
+/* Largest map size record in the MAP_SIZE_SECTION of an ELF image, or 0. The
+   same walk works for both classes, hence the macro. */
+
+#define ELF_MAP_POW2(_bits)                                                   \
+                                                                              \
+  static u32 elf##_bits##_map_pow2(u8* img, u64 len) {                        \
+                                                                              \
+    Elf##_bits##_Ehdr* eh = (Elf##_bits##_Ehdr*)img;                          \
+    Elf##_bits##_Shdr *sh, *names;                                            \
+    u32                i, pow2 = 0, name_len = strlen(MAP_SIZE_SECTION) + 1;  \
+                                                                              \
+    if (len < sizeof(*eh) || !eh->e_shoff ||                                  \
+        eh->e_shentsize != sizeof(*sh) || eh->e_shstrndx >= eh->e_shnum ||    \
+        eh->e_shoff + (u64)eh->e_shnum * sizeof(*sh) > len)                   \
+      return 0;                                                               \
+                                                                              \
+    sh = (Elf##_bits##_Shdr*)(img + eh->e_shoff);                             \
+    names = sh + eh->e_shstrndx;                                              \
+                                                                              \
+    if ((u64)names->sh_offset + names->sh_size > len) return 0;               \
+                                                                              \
+    for (i = 0; i < eh->e_shnum; ++i) {                                       \
+                                                                              \
+      u64 off = sh[i].sh_offset, j;                                           \
+                                                                              \
+      if ((u64)sh[i].sh_name + name_len > names->sh_size ||                   \
+          memcmp(img + names->sh_offset + sh[i].sh_name, MAP_SIZE_SECTION,    \
+                 name_len) ||                                                 \
+          sh[i].sh_type == SHT_NOBITS || off + sh[i].sh_size > len)           \
+        continue;                                                             \
+                                                                              \
+      for (j = 0; j + sizeof(u32) <= sh[i].sh_size; j += sizeof(u32)) {       \
+                                                                              \
+        u32 rec;                                                              \
+        memcpy(&rec, img + off + j, sizeof(u32));                             \
+        if (rec > pow2) pow2 = rec;                                           \
+                                                                              \
+      }                                                                       \
+                                                                              \
+    }                                                                         \
+                                                                              \
+    return pow2;                                                              \
+                                                                              \
+  }
+
+ELF_MAP_POW2(32)
+ELF_MAP_POW2(64)
+
+#endif                                                       /* !__APPLE__ */
+
+/* afl-showmap and afl-analyze run the target without a forkserver, so they
+   never hear about its map size in the handshake. Read the size afl-llvm-pass
+   recorded in the binary instead, and grow the SHM regions to match. This
+   can't see instrumented shared libraries; for those the runtime leaves
+   MAP_SIZE_FAIL_SIG in the map and the user has to set AFL_MAP_SIZE_POW2. */
+
+void fit_map_size(u8* path) {
+
+#ifndef __APPLE__
+  struct stat st;
+  u8*         img;
+  u32         pow2 = 0;
+  s32         fd = open(path, O_RDONLY);
+
+  if (fd < 0) return;
+
+  if (fstat(fd, &st) || !st.st_size) {
+
+    close(fd);
+    return;
+
+  }
+
+  img = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (img == MAP_FAILED) return;
+
+  if (st.st_size > EI_CLASS && !memcmp(img, ELFMAG, SELFMAG)) {
+
+    if (img[EI_CLASS] == ELFCLASS64)
+      pow2 = elf64_map_pow2(img, st.st_size);
+    else if (img[EI_CLASS] == ELFCLASS32)
+      pow2 = elf32_map_pow2(img, st.st_size);
+
+  }
+
+  munmap(img, st.st_size);
+
+  if (pow2 < MAP_SIZE_POW2_MIN || pow2 > MAP_SIZE_POW2_MAX ||
+      (1U << pow2) <= map_size)
+    return;
+
+  resize_shm(1U << pow2);
+#endif
+
+}
@@ -134,7 +134,7 @@ static const u8 count_class_binary[256] = {
 
 static void classify_counts(u8* mem, const u8* map) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -188,10 +188,10 @@ static u32 write_results_to_file(u8 *out_file) {
 
   if (binary_mode) {
 
-    for (i = 0; i < MAP_SIZE; i++)
+    for (i = 0; i < map_size; i++)
       if (trace_bits[i]) ret++;
 
-    ck_write(fd, trace_bits, MAP_SIZE, out_file);
+    ck_write(fd, trace_bits, map_size, out_file);
     close(fd);
 
   } else {
@@ -200,7 +200,7 @@ static u32 write_results_to_file(u8 *out_file) {
 
     if (!f) PFATAL("fdopen() failed");
 
-    for (i = 0; i < MAP_SIZE; i++) {
+    for (i = 0; i < map_size; i++) {
 
       if (!trace_bits[i]) continue;
       ret++;
@@ -285,7 +285,7 @@ static u8 run_target_forkserver(char** argv, u8* mem, u32 len) {
   static u32              prev_timed_out = 0;
   int                     status = 0;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   write_to_testcase(mem, len);
@@ -342,6 +342,10 @@ static u8 run_target_forkserver(char** argv, u8* mem, u32 len) {
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
     FATAL("Unable to execute '%s'", argv[0]);
 
+  if (*(u32*)trace_bits == MAP_SIZE_FAIL_SIG)
+    FATAL("Target needs a map of 2^%u entries, set AFL_MAP_SIZE_POW2=%u",
+          ((u32*)trace_bits)[1], ((u32*)trace_bits)[1]);
+
   classify_counts(trace_bits,
                   binary_mode ? count_class_binary : count_class_human);
   total_execs++;
@@ -489,6 +493,10 @@ static void run_target(char** argv) {
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
     FATAL("Unable to execute '%s'", argv[0]);
 
+  if (*(u32*)trace_bits == MAP_SIZE_FAIL_SIG)
+    FATAL("Target needs a map of 2^%u entries, set AFL_MAP_SIZE_POW2=%u",
+          ((u32*)trace_bits)[1], ((u32*)trace_bits)[1]);
+
   classify_counts(trace_bits,
                   binary_mode ? count_class_binary : count_class_human);
 
@@ -878,12 +886,14 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !out_file) usage(argv[0]);
 
+  init_map_size();
   setup_shm(0);
   setup_signal_handlers();
 
   set_up_environment();
 
   find_binary(argv[optind]);
+  fit_map_size(target_path);
 
   if (!quiet_mode) {
 
@@ -68,6 +68,7 @@ u8*        trace_bits;                 /* SHM with instrumentation bitmap   */
 u32 *trace_idx;
 u32 map_used;
 static u8* mask_bitmap;                /* Mask for trace bits (-B)          */
+static u8* mask_file;                  /* File to load the mask from (-B)   */
 
 u8 *in_file,                           /* Minimizer input test case         */
     *output_file,                      /* Minimizer output file             */
@@ -131,7 +132,7 @@ static const u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -159,7 +160,7 @@ static void classify_counts(u8* mem) {
 
 static void apply_mask(u32* mem, u32* mask) {
 
-  u32 i = (MAP_SIZE >> 2);
+  u32 i = (map_size >> 2);
 
   if (!mask) return;
 
@@ -178,7 +179,7 @@ static void apply_mask(u32* mem, u32* mask) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i = (MAP_SIZE >> 2);
+  u32  i = (map_size >> 2);
 
   while (i--)
     if (*(ptr++)) return 1;
@@ -429,7 +430,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   write_to_testcase(mem, len);
@@ -539,7 +540,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   if (first_run) orig_cksum = cksum;
 
@@ -1050,7 +1051,8 @@ static void read_bitmap(u8* fname) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, mask_bitmap, MAP_SIZE, fname);
+  mask_bitmap = ck_alloc(map_size);
+  ck_read(fd, mask_bitmap, map_size, fname);
 
   close(fd);
 
@@ -1194,9 +1196,8 @@ int main(int argc, char** argv) {
            The option may be extended and made more official if it proves
            to be useful. */
 
-        if (mask_bitmap) FATAL("Multiple -B options not supported");
-        mask_bitmap = ck_alloc(MAP_SIZE);
-        read_bitmap(optarg);
+        if (mask_file) FATAL("Multiple -B options not supported");
+        mask_file = optarg;
         break;
 
       case 'h':
@@ -1210,6 +1211,7 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !in_file || !output_file) usage(argv[0]);
 
+  init_map_size();
   setup_shm(0);
   atexit(at_exit_handler);
   setup_signal_handlers();
@@ -1238,6 +1240,10 @@ int main(int argc, char** argv) {
 
   init_forkserver(use_argv);
 
+  /* The map size is only final after the handshake. */
+
+  if (mask_file) read_bitmap(mask_file);
+
   ACTF("Performing dry run (mem limit = %llu MB, timeout = %u ms%s)...",
        mem_limit, exec_tmout, edges_only ? ", edges only" : "");
 
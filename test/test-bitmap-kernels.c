@@ -0,0 +1,270 @@
+/*
+   Checks the vector bitmap kernels against the scalar code: every kernel
+   set the CPU supports gets the same random traces and virgin maps as the
+   AFL_NO_SIMD path, and all outputs have to match byte for byte.
+
+   Built by "make test/test-bitmap-kernels" (or "make tests"), which links
+   it with the afl-fuzz sources minus src/afl-fuzz.c, since we bring our
+   own main(). The kernel sources are included directly, so that the
+   dispatch pointers can be set to each kernel set in turn.
+*/
+
+#include "../src/afl-fuzz-bitmap.c"
+
+#define TEST_MAP_SIZE (1 << 16)
+#define TEST_ROUNDS 64
+
+/* Everything a kernel set produces for one trace / virgin map pair. */
+
+struct kernel_result {
+
+  u8  classified[TEST_MAP_SIZE];       /* classify_counts()                 */
+  u8  scanned[TEST_MAP_SIZE];          /* classify_trace(), fused or not    */
+  u32 cksum;                           /* ...and its checksum               */
+  u8  hits_virgin;                     /* ...and if it overlaps virgin_bits */
+  u8  new_bits;                        /* has_new_bits() return value       */
+  u8  virgin[TEST_MAP_SIZE];           /* ...and the virgin map it left     */
+  u32 bytes;                           /* count_bytes()                     */
+  u32 non_255;                         /* count_non_255_bytes()             */
+  u8  minimized[TEST_MAP_SIZE >> 3];   /* minimize_bits()                   */
+  u8  simplified[TEST_MAP_SIZE];       /* simplify_trace()                  */
+
+};
+
+static u8* kernel_names[] = {"scalar", "sse4.2", "avx2", "avx512bw"};
+
+/* Point the dispatch pointers at one kernel set. Level 0 leaves them all
+   NULL, which is what AFL_NO_SIMD does. Returns 0 if the CPU can't run the
+   set. */
+
+static u8 use_kernels(u32 level) {
+
+#ifdef HAVE_BITMAP_SIMD
+
+  has_new_bits_vec = NULL;
+  classify_counts_vec = NULL;
+  count_bytes_vec = NULL;
+  count_non_255_bytes_vec = NULL;
+  simplify_trace_vec = NULL;
+  minimize_bits_vec = NULL;
+  classify_scan_vec = NULL;
+
+  __builtin_cpu_init();
+
+  switch (level) {
+
+    case 0: return 1;
+
+    case 1:
+
+      if (!__builtin_cpu_supports("sse4.2") ||
+          !__builtin_cpu_supports("popcnt"))
+        return 0;
+
+      has_new_bits_vec = has_new_bits_sse42;
+      classify_counts_vec = classify_counts_sse42;
+      count_bytes_vec = count_bytes_sse42;
+      count_non_255_bytes_vec = count_non_255_bytes_sse42;
+      simplify_trace_vec = simplify_trace_sse42;
+      minimize_bits_vec = minimize_bits_sse42;
+      classify_scan_vec = classify_scan_sse42;
+      return 1;
+
+    case 2:
+
+      if (!__builtin_cpu_supports("avx2")) return 0;
+
+      has_new_bits_vec = has_new_bits_avx2;
+      classify_counts_vec = classify_counts_avx2;
+      count_bytes_vec = count_bytes_avx2;
+      count_non_255_bytes_vec = count_non_255_bytes_avx2;
+      simplify_trace_vec = simplify_trace_avx2;
+      minimize_bits_vec = minimize_bits_avx2;
+      classify_scan_vec = classify_scan_avx2;
+      return 1;
+
+    case 3:
+
+      if (!__builtin_cpu_supports("avx512bw")) return 0;
+
+      has_new_bits_vec = has_new_bits_avx512;
+      classify_counts_vec = classify_counts_avx512;
+      count_bytes_vec = count_bytes_avx512;
+      count_non_255_bytes_vec = count_non_255_bytes_avx512;
+      simplify_trace_vec = simplify_trace_avx512;
+      minimize_bits_vec = minimize_bits_avx512;
+      classify_scan_vec = classify_scan_avx512;
+      return 1;
+
+  }
+
+#endif                                                 /* HAVE_BITMAP_SIMD */
+
+  return !level;
+
+}
+
+/* Fill the trace with counters at the given density, in percent, and the
+   virgin map with a mix of untouched and partly cleared bytes. Whole
+   zero 64-byte lines are kept common, since the kernels skip those. */
+
+static void make_maps(u8* trace, u8* virgin, u32 density) {
+
+  u32 i;
+
+  for (i = 0; i < TEST_MAP_SIZE; ++i) {
+
+    if (!(i & 63) && random() % 4 == 0) {
+
+      memset(trace + i, 0, 64);
+      memset(virgin + i, 255, 64);
+      i += 63;
+      continue;
+
+    }
+
+    trace[i] = (u32)(random() % 100) < density ? random() : 0;
+
+    switch (random() % 3) {
+
+      case 0: virgin[i] = 255; break;
+      case 1: virgin[i] = 0; break;
+      default: virgin[i] = random();
+
+    }
+
+  }
+
+}
+
+/* Run everything through the current kernel set. */
+
+static void run_kernels(u8* trace, u8* virgin, struct kernel_result* r) {
+
+  memset(r, 0, sizeof(struct kernel_result));
+
+  /* classify_counts() on its own. */
+
+  memcpy(trace_bits, trace, TEST_MAP_SIZE);
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif                                                     /* ^WORD_SIZE_64 */
+  memcpy(r->classified, trace_bits, TEST_MAP_SIZE);
+
+  /* classify_trace(), which fuses the checksum and the virgin check where
+     it can. The scalar path leaves both to trace_cksum() and has_new_bits(),
+     so compute the overlap by hand when the cache doesn't have it. */
+
+  memcpy(trace_bits, trace, TEST_MAP_SIZE);
+  memcpy(virgin_bits, virgin, TEST_MAP_SIZE);
+  trace_cache_valid = 0;
+  classify_trace();
+
+  if (trace_cache_valid) {
+
+    r->hits_virgin = trace_hits_virgin;
+
+  } else {
+
+    u32 i;
+
+    for (i = 0; i < TEST_MAP_SIZE; ++i)
+      if (trace_bits[i] & virgin_bits[i]) r->hits_virgin = 1;
+
+  }
+
+  r->cksum = trace_cksum();
+  memcpy(r->scanned, trace_bits, TEST_MAP_SIZE);
+
+  /* has_new_bits() against a copy of the virgin map. */
+
+  trace_cache_valid = 0;
+  r->new_bits = has_new_bits(virgin_bits);
+  memcpy(r->virgin, virgin_bits, TEST_MAP_SIZE);
+
+  r->bytes = count_bytes(trace_bits);
+  r->non_255 = count_non_255_bytes(virgin);
+
+  minimize_bits(r->minimized, trace_bits);
+
+#ifdef WORD_SIZE_64
+  simplify_trace((u64*)trace_bits);
+#else
+  simplify_trace((u32*)trace_bits);
+#endif                                                     /* ^WORD_SIZE_64 */
+  memcpy(r->simplified, trace_bits, TEST_MAP_SIZE);
+
+}
+
+#define CHECK(_field, _what)                                                  \
+  do {                                                                        \
+                                                                              \
+    if (memcmp(&ref->_field, &got->_field, sizeof(ref->_field))) {            \
+                                                                              \
+      printf("%s: %s differs from the scalar code (round %u)\n",             \
+             kernel_names[level], _what, round);                              \
+      ret = 1;                                                                \
+                                                                              \
+    }                                                                         \
+                                                                              \
+  } while (0)
+
+int main(void) {
+
+  struct kernel_result *ref, *got;
+
+  u8 *trace, *virgin;
+  u32 level, round, tested = 0;
+  int ret = 0;
+
+  map_size = map_used = TEST_MAP_SIZE;
+
+  trace_bits = ck_alloc(TEST_MAP_SIZE);
+  virgin_bits = ck_alloc(TEST_MAP_SIZE);
+  trace = ck_alloc(TEST_MAP_SIZE);
+  virgin = ck_alloc(TEST_MAP_SIZE);
+  ref = ck_alloc(sizeof(struct kernel_result));
+  got = ck_alloc(sizeof(struct kernel_result));
+
+  init_count_class16();
+
+  for (round = 0; round < TEST_ROUNDS; ++round) {
+
+    /* From empty traces to full ones, with every counter value showing up
+       in the denser rounds. */
+
+    srandom(round);
+    make_maps(trace, virgin, round * 100 / (TEST_ROUNDS - 1));
+
+    use_kernels(0);
+    run_kernels(trace, virgin, ref);
+
+    for (level = 1; level < 4; ++level) {
+
+      if (!use_kernels(level)) continue;
+      if (!round) ++tested;
+
+      run_kernels(trace, virgin, got);
+
+      CHECK(classified, "classify_counts()");
+      CHECK(scanned, "classify_trace()");
+      CHECK(cksum, "trace checksum");
+      CHECK(hits_virgin, "virgin overlap");
+      CHECK(new_bits, "has_new_bits()");
+      CHECK(virgin, "has_new_bits() virgin map");
+      CHECK(bytes, "count_bytes()");
+      CHECK(non_255, "count_non_255_bytes()");
+      CHECK(minimized, "minimize_bits()");
+      CHECK(simplified, "simplify_trace()");
+
+    }
+
+  }
+
+  if (!ret) printf("%u kernel set(s) match the scalar code\n", tested);
+
+  return ret;
+
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+__AFL_FUZZ_INIT();
+
+int main(int argc, char** argv) {
+  unsigned char *buf;
+  int len;
+
+  __AFL_INIT();
+  buf = __AFL_FUZZ_TESTCASE_BUF;
+
+#ifdef NO_LOOP
+  /* AFL_SNAPSHOT only restores targets that are not persistent */
+  {
+#else
+  while (__AFL_LOOP(1000)) {
+#endif
+    len = __AFL_FUZZ_TESTCASE_LEN;
+
+    if (len < 1)
+      printf("Hum?\n");
+    else if (buf[0] == '0')
+      printf("Looks like a zero to me!\n");
+    else if (buf[0] == '1')
+      printf("Pretty sure that is a one!\n");
+    else if (len > 1 && buf[0] == buf[1])
+      printf("Twice the same!\n");
+    else
+      printf("Neither one or zero? How quaint!\n");
+  }
+
+  return 0;
+
+}
@@ -45,6 +45,9 @@ unset AFL_LLVM_INSTRIM
 unset AFL_LLVM_LAF_SPLIT_SWITCHES
 unset AFL_LLVM_LAF_TRANSFORM_COMPARES
 unset AFL_LLVM_LAF_SPLIT_COMPARES
+unset AFL_PERSISTENT_BATCH
+unset AFL_SNAPSHOT
+unset AFL_EXEC_POOL
 
 # on OpenBSD we need to work with llvm from /usr/local/bin
 test -e /usr/local/bin/opt && {
@@ -74,6 +77,21 @@ $ECHO "${RESET}${GREY}[*] starting afl++ test framework ..."
 
 test -z "$SYS" && $ECHO "$YELLOW[-] uname -m did not succeed"
 
+$ECHO "$BLUE[*] Testing: afl-fuzz bitmap kernels"
+test -e test-bitmap-kernels && {
+  ./test-bitmap-kernels > test.out 2>&1 && {
+    $ECHO "$GREEN[+] $(cat test.out)"
+  } || {
+    cat test.out
+    $ECHO "$RED[!] the vector bitmap kernels differ from the scalar code"
+    CODE=1
+  }
+  rm -f test.out
+} || {
+  $ECHO "$YELLOW[-] test-bitmap-kernels is not compiled, cannot test (run make tests)"
+  INCOMPLETE=1
+}
+
 $ECHO "$BLUE[*] Testing: ${AFL_GCC}, afl-showmap, afl-fuzz, afl-cmin and afl-tmin"
 test "$SYS" = "i686" -o "$SYS" = "x86_64" -o "$SYS" = "amd64" && {
  test -e ../${AFL_GCC} -a -e ../afl-showmap -a -e ../afl-fuzz && {
@@ -331,6 +349,93 @@ test -e ../afl-clang-fast -a -e ../split-switches-pass.so && {
     CODE=1
   }
   rm -f test-persistent
+  ../afl-clang-fast -o test-shm test-shm.c > /dev/null 2>&1
+  test -e test-shm && {
+    mkdir -p in
+    echo 0 > in/in
+    $ECHO "$GREY[*] running afl-fuzz for llvm_mode with AFL_PERSISTENT_BATCH, this will take approx 5 seconds"
+    {
+      AFL_PERSISTENT_BATCH=16 ../afl-fuzz -V5 -m ${MEM_LIMIT} -i in -o out -- ./test-shm >>errors 2>&1
+    } >>errors 2>&1
+    sleep 1
+    test -n "$( ls out/queue/id:000002* 2> /dev/null )" && grep -q "test cases per round trip" errors && {
+      ps -e -o stat= -o comm= 2> /dev/null | grep -v '^Z' | grep -q 'test-shm' && {
+        $ECHO "$RED[!] afl-fuzz with AFL_PERSISTENT_BATCH left test-shm processes behind"
+        CODE=1
+      } || {
+        $ECHO "$GREEN[+] afl-fuzz is working correctly with AFL_PERSISTENT_BATCH"
+      }
+    } || {
+      echo CUT------------------------------------------------------------------CUT
+      cat errors
+      echo CUT------------------------------------------------------------------CUT
+      $ECHO "$RED[!] afl-fuzz is not working correctly with AFL_PERSISTENT_BATCH"
+      CODE=1
+    }
+    rm -rf out errors
+    $ECHO "$GREY[*] running afl-fuzz for llvm_mode with AFL_EXEC_POOL, this will take approx 5 seconds"
+    {
+      AFL_EXEC_POOL=4 ../afl-fuzz -V5 -m ${MEM_LIMIT} -i in -o out -- ./test-shm @@ >>errors 2>&1
+    } >>errors 2>&1
+    sleep 1
+    test -n "$( ls out/queue/id:000002* 2> /dev/null )" && {
+      ps -e -o stat= -o comm= 2> /dev/null | grep -v '^Z' | grep -q 'test-shm' && {
+        $ECHO "$RED[!] afl-fuzz with AFL_EXEC_POOL left test-shm processes behind"
+        CODE=1
+      } || {
+        $ECHO "$GREEN[+] afl-fuzz is working correctly with AFL_EXEC_POOL"
+      }
+    } || {
+      grep -q "not supported with USEMMAP" errors && {
+        $ECHO "$YELLOW[-] afl-fuzz was built with USEMMAP, cannot test AFL_EXEC_POOL"
+        INCOMPLETE=1
+      } || {
+        echo CUT------------------------------------------------------------------CUT
+        cat errors
+        echo CUT------------------------------------------------------------------CUT
+        $ECHO "$RED[!] afl-fuzz is not working correctly with AFL_EXEC_POOL"
+        CODE=1
+      }
+    }
+    rm -rf in out errors
+  } || {
+    $ECHO "$RED[!] llvm_mode shared memory test case feature compilation failed"
+    CODE=1
+  }
+  ../afl-clang-fast -DNO_LOOP -o test-shm.snap test-shm.c > /dev/null 2>&1
+  test -e test-shm.snap && {
+    mkdir -p in
+    echo 0 > in/in
+    $ECHO "$GREY[*] running afl-fuzz for llvm_mode with AFL_SNAPSHOT, this will take approx 5 seconds"
+    {
+      AFL_SNAPSHOT=1 ../afl-fuzz -V5 -m ${MEM_LIMIT} -i in -o out -- ./test-shm.snap >>errors 2>&1
+    } >>errors 2>&1
+    sleep 1
+    test -n "$( ls out/queue/id:000002* 2> /dev/null )" && {
+      ps -e -o stat= -o comm= 2> /dev/null | grep -v '^Z' | grep -q 'test-shm' && {
+        $ECHO "$RED[!] afl-fuzz with AFL_SNAPSHOT left test-shm processes behind"
+        CODE=1
+      } || {
+        grep -q "restores its dirty pages" errors && {
+          $ECHO "$GREEN[+] afl-fuzz is working correctly with AFL_SNAPSHOT"
+        } || {
+          $ECHO "$YELLOW[-] the target took no snapshots, is the kernel built with CONFIG_MEM_SOFT_DIRTY?"
+          INCOMPLETE=1
+        }
+      }
+    } || {
+      echo CUT------------------------------------------------------------------CUT
+      cat errors
+      echo CUT------------------------------------------------------------------CUT
+      $ECHO "$RED[!] afl-fuzz is not working correctly with AFL_SNAPSHOT"
+      CODE=1
+    }
+    rm -rf in out errors
+  } || {
+    $ECHO "$RED[!] llvm_mode snapshot test compilation failed"
+    CODE=1
+  }
+  rm -f test-shm test-shm.snap
 } || {
   $ECHO "$YELLOW[-] llvm_mode not compiled, cannot test"
   INCOMPLETE=1
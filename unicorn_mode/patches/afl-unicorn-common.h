@@ -31,13 +31,14 @@
  */
 
 #include "../../config.h"
+#include "../../include/bigmap.h"
 
 /* NeverZero */
 
 #if (defined(__x86_64__) || defined(__i386__)) && defined(AFL_QEMU_NOT_ZERO)
 #define INC_AFL_AREA(loc)           \
   asm volatile(                     \
-      "incb (%0, %1, 1)\n"          \
+      "addb $1, (%0, %1, 1)\n"      \
       "adcb $0, (%0, %1, 1)\n"      \
       : /* no out */                \
       : "r"(afl_area_ptr), "r"(loc) \
@@ -46,3 +47,24 @@
 #define INC_AFL_AREA(loc) afl_area_ptr[loc]++
 #endif
 
+/* BigMap: edge hashes go through the index table to a compact map slot.
+   Like INC_AFL_AREA, this expects the uc_struct in scope as uc. The hash
+   is wrapped to the map size, so compcov may use h + k freely. */
+
+#define INC_AFL_EDGE(h)                                                  \
+  INC_AFL_AREA(afl_edge_slot(uc->afl_idx_ptr, (h) & (uc->afl_map_size - 1), \
+                             uc->afl_map_size))
+
+/* Look up the slot of edge h, claiming the next free one on first use, or
+   waiting for the one another thread is claiming (see bigmap.h). */
+
+static inline u32 afl_edge_slot(u32* idx, uintptr_t h, u32 map_size) {
+
+  u32 slot = idx[h];
+
+  if (__builtin_expect(slot < IDX_CLAIMING, 1)) return slot;
+
+  return bigmap_claim_slot(idx, h, map_size);
+
+}
+
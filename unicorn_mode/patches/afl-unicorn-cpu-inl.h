@@ -109,38 +109,65 @@ struct afl_tsl {
 
 static void afl_setup(struct uc_struct* uc) {
 
-  char *id_str = getenv(SHM_ENV_VAR), *inst_r = getenv("AFL_INST_RATIO");
+  char *id_str = getenv(SHM_ENV_VAR), *inst_r = getenv("AFL_INST_RATIO"),
+       *size_str = getenv(MAP_SIZE_ENV_VAR);
 
   int shm_id;
 
-  if (inst_r) {
+  uc->afl_map_size = MAP_SIZE;
 
-    unsigned int r;
+  if (id_str) {
 
-    r = atoi(inst_r);
+    shm_id = atoi(id_str);
+    uc->afl_area_ptr = shmat(shm_id, NULL, 0);
 
-    if (r > 100) r = 100;
-    if (!r) r = 1;
+    if (uc->afl_area_ptr == (void*)-1) exit(1);
 
-    uc->afl_inst_rms = MAP_SIZE * r / 100;
+    /* Edges land wherever the index table says; we are not built for a
+       map size, so just take whatever the parent set up. Without a table,
+       a zeroed one sends every edge to slot 0. */
 
-  } else {
+    id_str = getenv(SHM_IDX_ENV_VAR);
+
+    if (id_str) {
+
+      uc->afl_idx_ptr = shmat(atoi(id_str), NULL, 0);
+
+      if (uc->afl_idx_ptr == (void*)-1) exit(1);
+
+      if (size_str) {
+
+        u32 size = atoi(size_str);
+
+        if (size >= (1U << MAP_SIZE_POW2_MIN) &&
+            size <= (1U << MAP_SIZE_POW2_MAX) && !(size & (size - 1)))
+          uc->afl_map_size = size;
 
-    uc->afl_inst_rms = MAP_SIZE;
+      }
+
+    } else {
+
+      uc->afl_idx_ptr = calloc(MAP_SIZE, sizeof(u32));
+      if (!uc->afl_idx_ptr) exit(1);
+
+    }
 
   }
 
-  if (id_str) {
+  if (inst_r) {
 
-    shm_id = atoi(id_str);
-    uc->afl_area_ptr = shmat(shm_id, NULL, 0);
+    unsigned int r;
 
-    if (uc->afl_area_ptr == (void*)-1) exit(1);
+    r = atoi(inst_r);
+
+    if (r > 100) r = 100;
+    if (!r) r = 1;
 
-    /* With AFL_INST_RATIO set to a low value, we want to touch the bitmap
-       so that the parent doesn't give up on us. */
+    uc->afl_inst_rms = uc->afl_map_size / 100 * r;
+
+  } else {
 
-    if (inst_r) uc->afl_area_ptr[0] = 1;
+    uc->afl_inst_rms = uc->afl_map_size;
 
   }
 
@@ -235,7 +262,7 @@ static inline void afl_maybe_log(struct uc_struct* uc, unsigned long cur_loc) {
      the value to get something quasi-uniform. */
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 1;
+  cur_loc &= uc->afl_map_size - 1;
 
   /* Implement probabilistic instrumentation by looking at scrambled block
      address. This keeps the instrumented locations stable across runs. */
@@ -244,7 +271,7 @@ static inline void afl_maybe_log(struct uc_struct* uc, unsigned long cur_loc) {
 
   register uintptr_t afl_idx = cur_loc ^ prev_loc;
 
-  INC_AFL_AREA(afl_idx);
+  INC_AFL_EDGE(afl_idx);
 
   prev_loc = cur_loc >> 1;
 
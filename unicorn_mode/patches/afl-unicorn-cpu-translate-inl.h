@@ -40,7 +40,7 @@ static void afl_gen_compcov(TCGContext *s, uint64_t cur_loc, TCGv_i64 arg1,
   if (!is_imm && s->uc->afl_compcov_level < 2) return;
 
   cur_loc = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 7;
+  cur_loc &= s->uc->afl_map_size - 7;
 
   if (cur_loc >= s->uc->afl_inst_rms) return;
 
@@ -36,24 +36,26 @@
 void HELPER(afl_compcov_log_16)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
-  if ((arg1 & 0xff) == (arg2 & 0xff)) { INC_AFL_AREA(cur_loc); }
+  if ((arg1 & 0xff) == (arg2 & 0xff)) { INC_AFL_EDGE(cur_loc); }
 
 }
 
 void HELPER(afl_compcov_log_32)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
   if ((arg1 & 0xff) == (arg2 & 0xff)) {
 
-    INC_AFL_AREA(cur_loc);
+    INC_AFL_EDGE(cur_loc);
     if ((arg1 & 0xffff) == (arg2 & 0xffff)) {
 
-      INC_AFL_AREA(cur_loc + 1);
-      if ((arg1 & 0xffffff) == (arg2 & 0xffffff)) { INC_AFL_AREA(cur_loc + 2); }
+      INC_AFL_EDGE(cur_loc + 1);
+      if ((arg1 & 0xffffff) == (arg2 & 0xffffff)) { INC_AFL_EDGE(cur_loc + 2); }
 
     }
 
@@ -64,29 +66,30 @@ void HELPER(afl_compcov_log_32)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
 void HELPER(afl_compcov_log_64)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
   if ((arg1 & 0xff) == (arg2 & 0xff)) {
 
-    INC_AFL_AREA(cur_loc);
+    INC_AFL_EDGE(cur_loc);
     if ((arg1 & 0xffff) == (arg2 & 0xffff)) {
 
-      INC_AFL_AREA(cur_loc + 1);
+      INC_AFL_EDGE(cur_loc + 1);
       if ((arg1 & 0xffffff) == (arg2 & 0xffffff)) {
 
-        INC_AFL_AREA(cur_loc + 2);
+        INC_AFL_EDGE(cur_loc + 2);
         if ((arg1 & 0xffffffff) == (arg2 & 0xffffffff)) {
 
-          INC_AFL_AREA(cur_loc + 3);
+          INC_AFL_EDGE(cur_loc + 3);
           if ((arg1 & 0xffffffffff) == (arg2 & 0xffffffffff)) {
 
-            INC_AFL_AREA(cur_loc + 4);
+            INC_AFL_EDGE(cur_loc + 4);
             if ((arg1 & 0xffffffffffff) == (arg2 & 0xffffffffffff)) {
 
-              INC_AFL_AREA(cur_loc + 5);
+              INC_AFL_EDGE(cur_loc + 5);
               if ((arg1 & 0xffffffffffffff) == (arg2 & 0xffffffffffffff)) {
 
-                INC_AFL_AREA(cur_loc + 6);
+                INC_AFL_EDGE(cur_loc + 6);
 
               }
 
@@ -108,24 +111,26 @@ void HELPER(afl_compcov_log_64)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
 void HELPER(afl_compcov_log_16)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
-  if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(cur_loc); }
+  if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(cur_loc); }
 
 }
 
 void HELPER(afl_compcov_log_32)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
   if ((arg1 & 0xff000000) == (arg2 & 0xff000000)) {
 
-    INC_AFL_AREA(cur_loc + 2);
+    INC_AFL_EDGE(cur_loc + 2);
     if ((arg1 & 0xff0000) == (arg2 & 0xff0000)) {
 
-      INC_AFL_AREA(cur_loc + 1);
-      if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(cur_loc); }
+      INC_AFL_EDGE(cur_loc + 1);
+      if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(cur_loc); }
 
     }
 
@@ -136,27 +141,28 @@ void HELPER(afl_compcov_log_32)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
 void HELPER(afl_compcov_log_64)(void* uc_ptr, uint64_t cur_loc, uint64_t arg1,
                                 uint64_t arg2) {
 
-  u8* afl_area_ptr = ((struct uc_struct*)uc_ptr)->afl_area_ptr;
+  struct uc_struct* uc = uc_ptr;
+  u8*               afl_area_ptr = uc->afl_area_ptr;
 
   if ((arg1 & 0xff00000000000000) == (arg2 & 0xff00000000000000)) {
 
-    INC_AFL_AREA(cur_loc + 6);
+    INC_AFL_EDGE(cur_loc + 6);
     if ((arg1 & 0xff000000000000) == (arg2 & 0xff000000000000)) {
 
-      INC_AFL_AREA(cur_loc + 5);
+      INC_AFL_EDGE(cur_loc + 5);
       if ((arg1 & 0xff0000000000) == (arg2 & 0xff0000000000)) {
 
-        INC_AFL_AREA(cur_loc + 4);
+        INC_AFL_EDGE(cur_loc + 4);
         if ((arg1 & 0xff00000000) == (arg2 & 0xff00000000)) {
 
-          INC_AFL_AREA(cur_loc + 3);
+          INC_AFL_EDGE(cur_loc + 3);
           if ((arg1 & 0xff000000) == (arg2 & 0xff000000)) {
 
-            INC_AFL_AREA(cur_loc + 2);
+            INC_AFL_EDGE(cur_loc + 2);
             if ((arg1 & 0xff0000) == (arg2 & 0xff0000)) {
 
-              INC_AFL_AREA(cur_loc + 1);
-              if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_AREA(cur_loc); }
+              INC_AFL_EDGE(cur_loc + 1);
+              if ((arg1 & 0xff00) == (arg2 & 0xff00)) { INC_AFL_EDGE(cur_loc); }
 
             }
 